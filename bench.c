@@ -1,22 +1,115 @@
 // Chris Polis
-// bench.c - Functions for testing and benchmarking stl_io and stl_util
+// bench.c - Benchmarks for stl_io, stl_util and extrusion
+//
+// Usage: $ bench [options]
+// Options:
+//    --reps [#]                         Timed runs per benchmark (best is reported)
+//    --sizes [#,#,...]                  Mesh sizes in triangles for I/O, transform and template
+//    --image [#]                        Synthetic heightmap side in pixels
+//    --filter [text]                    Only benchmarks whose name contains text
+//    --output [file.json]               Results file instead of stdout
+//    --baseline [file.json]             Compare with an earlier --output, exit 1 on regression
+//    --threshold [%]                    Slowdown counted as a regression (default 10)
+//
+// Results are JSON, one benchmark per line, with the best and mean time
+// and MB/s and triangles/s of the best run. Benchmarks:
+//    write_bin|write_ascii_[n]          stl_writer into a temp file
+//    read_bin|read_ascii_[n]            Binary view / ASCII parser over a written file
+//    transform_tris|transform_points_[n] Affine transform kernels
+//    template_bin|template_ascii_[n]    copyTemplate into a binary writer
+//    extrude_[noise|text|stripes|checker] simpleExtrude of a synthetic heightmap
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "stl_util.h"
 #include "stl_io.h"
+#include "extrude.h"
+
+#define BENCH_MAX_SIZES   16
+#define BENCH_MAX_RESULTS 128
+#define BENCH_BATCH       8192      // tris per writer call
+
+typedef struct bench_opts_st {
+  int reps, image;
+  int sizes[BENCH_MAX_SIZES], sizeCount;
+  char *filter, *output, *baseline;
+  double threshold;
+} bench_opts;
+
+typedef struct bench_result_st {
+  char name[64];
+  long tris, bytes;
+  double best, mean;
+  double baseline;                // baseline tris/s, 0: none
+} bench_result;
+
+typedef struct bench_run_st {
+  const bench_opts *opts;
+  bench_result results[BENCH_MAX_RESULTS];
+  int count;
+} bench_run;
+
+// One benchmark's state, fn runs it once
+typedef void (*bench_fn)(void *arg);
+
+typedef struct io_bench_st {
+  stl_tri *tris;
+  int triCount;
+  stl_mode mode;
+  FILE *file;                     // input to read, or scratch output
+  char *filename;
+  affine_transform t;
+  float *x, *y, *z;
+} io_bench;
+
+typedef struct extrude_bench_st {
+  extrude_opts opts;
+  heightmap src, hm;
+  FILE *out;
+} extrude_bench;
+
+static const char *optString = "";
+
+static const struct option longOpts[] = {
+  { "reps",      required_argument, NULL, 'r' },
+  { "sizes",     required_argument, NULL, 's' },
+  { "image",     required_argument, NULL, 'i' },
+  { "filter",    required_argument, NULL, 'f' },
+  { "output",    required_argument, NULL, 'o' },
+  { "baseline",  required_argument, NULL, 'b' },
+  { "threshold", required_argument, NULL, 't' },
+  { NULL,        no_argument,       NULL, 0 }
+};
+
+//////////////////////////////////////////////////////
+// Test meshes
+//////////////////////////////////////////////////////
+
+// count prisms spread over a grid, so coordinates are not all alike
+void testMesh(stl_tri *tris, int count) {
+  float root[3];
+  int ndx;
+
+  for(ndx = 0; ndx < count; ndx++) {
+    root[0] = (ndx % 100) * 3.25f;
+    root[1] = (ndx / 100 % 100) * 2.75f;
+    root[2] = (ndx / 10000) * 4.125f;
+    createRectPrism(&tris[12 * ndx], root, 3.0, 2.5, 4.0);
+  }
+}
 
 void writeBinTestCube(char *filename, int count) {
   FILE *out = fopen(filename, "w");
   writeHeaderBin(out, 12 * count);
-  
-  float root[3] = { 0.0, 0.0, 0.0 };
+
   stl_tri *tris = malloc(sizeof(stl_tri) * 12 * count);
-  int ndx = 0;
-  for(ndx = 0; ndx < count; ndx++) 
-    createRectPrism(&tris[12 * ndx], root, 3.0, 2.5, 4.0);
-  
+  testMesh(tris, count);
+
   writeTriArrayBin(out, 12 * count, &tris[0]);
   free(tris);
   fclose(out);
@@ -26,18 +119,425 @@ void writeAsciiTestCube(char *filename, int count) {
   FILE *out = fopen(filename, "w");
   writeHeaderAscii(out);
 
-  float root[3] = { 0.0, 0.0, 0.0 };
   stl_tri *tris = malloc(sizeof(stl_tri) * 12 * count);
-  int ndx = 0;
-  for(ndx = 0; ndx < count; ndx++)
-    createRectPrism(&tris[12 * ndx], root, 3.0, 2.5, 4.0);
+  testMesh(tris, count);
 
-  writeTriArrayASCII(out, 12 * count, &tris[12 * ndx]);
+  writeTriArrayASCII(out, 12 * count, &tris[0]);
+  writeFooterAscii(out);
   free(tris);
   fclose(out);
 }
 
-int main(int argc, char *argv[]) {
-  writeBinTestCube("testcube.stl", 1);
+//////////////////////////////////////////////////////
+// Synthetic heightmaps
+//////////////////////////////////////////////////////
+
+// 3x5 digits, rows top to bottom
+static const char *glyphs[10] = {
+  "111101101101111", "010110010010111", "111001111100111", "111001111001111", "101101111001001",
+  "111100111001111", "111100111101111", "111001001001001", "111101111101111", "111101111001111"
+};
+
+static uint64_t nextRandom(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Fill hm with pattern: noise, text, stripes or checker
+void testHeightmap(heightmap *hm, const char *pattern) {
+  uint64_t state = 88172645463325252ULL;
+  int r, c, digit, gr, gc;
+
+  for(r = 0; r < hm->height; r++)
+    for(c = 0; c < hm->width; c++) {
+      int set = 0;
+      if(strcmp(pattern, "noise") == 0)
+        set = nextRandom(&state) & 1;
+      else if(strcmp(pattern, "stripes") == 0)
+        set = (c / 8) & 1;
+      else if(strcmp(pattern, "checker") == 0)
+        set = ((r / 4) + (c / 4)) & 1;
+      else {
+        // Lines of 3x scaled digits in 4x6 cells
+        digit = (r / 18 * 7 + c / 12) % 10;
+        gr = r % 18 / 3;
+        gc = c % 12 / 3;
+        set = gr < 5 && gc < 3 && glyphs[digit][gr * 3 + gc] == '1';
+      }
+      if(set)
+        HM_SET(hm, r, c);
+    }
+}
+
+//////////////////////////////////////////////////////
+// Benchmarks
+//////////////////////////////////////////////////////
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void benchWrite(void *arg) {
+  io_bench *b = arg;
+  stl_writer writer;
+  int ndx;
+
+  rewind(b->file);
+  if(b->mode == ASCII)
+    writeHeaderAscii(b->file);
+  else
+    writeHeaderBin(b->file, b->triCount);
+  if(initWriter(&writer, b->file, b->mode) != 0) {
+    fprintf(stderr, "warning: could not allocate writer\n");
+    return;
+  }
+  for(ndx = 0; ndx < b->triCount; ndx += BENCH_BATCH)
+    writerTriArray(&writer, b->triCount - ndx < BENCH_BATCH ? b->triCount - ndx : BENCH_BATCH, &b->tris[ndx]);
+  freeWriter(&writer);
+  if(b->mode == ASCII)
+    writeFooterAscii(b->file);
+  fflush(b->file);
+}
+
+static void benchRead(void *arg) {
+  io_bench *b = arg;
+  stl_parser parser;
+  stl_view view;
+  stl_view_iter it;
+  const unsigned char *rec;
+  stl_tri tri;
+  int count = 0;
+
+  if(b->mode == ASCII) {
+    openParser(&parser, b->file);
+    while(parseTriASCII(&parser, &tri))
+      b->tris[count++] = tri;
+    closeParser(&parser);
+  } else if(openView(&view, b->file) == 0) {
+    it = viewRange(&view, 0, view.triCount);
+    while((rec = viewNext(&it)))
+      unpackTriBin(rec, &b->tris[count++]);
+    closeView(&view);
+  }
+  if(count != b->triCount)
+    fprintf(stderr, "warning: read %d of %d tris\n", count, b->triCount);
+}
+
+static void benchTransformTris(void *arg) {
+  io_bench *b = arg;
+  transformTris(&b->t, b->triCount, b->tris);
+}
+
+static void benchTransformPoints(void *arg) {
+  io_bench *b = arg;
+  transformPoints(&b->t, b->triCount * 3, b->x, b->y, b->z);
+}
+
+static void benchTemplate(void *arg) {
+  io_bench *b = arg;
+  stl_writer writer;
+
+  rewind(b->file);
+  writeHeaderBin(b->file, 0);
+  if(initWriter(&writer, b->file, BINARY) != 0) {
+    fprintf(stderr, "warning: could not allocate writer\n");
+    return;
+  }
+  if(copyTemplate(&writer, b->filename) != b->triCount)
+    fprintf(stderr, "warning: template %s short\n", b->filename);
+  freeWriter(&writer);
+  fflush(b->file);
+}
+
+static void benchExtrude(void *arg) {
+  extrude_bench *b = arg;
+  stl_writer writer;
+  int triCount;
+
+  // simpleExtrude clears the pixels it has covered
+  memcpy(b->hm.rows, b->src.rows, sizeof(uint64_t) * b->src.rowWords * b->src.height);
+  rewind(b->out);
+  writeHeaderBin(b->out, 0);
+  if(initWriter(&writer, b->out, BINARY) != 0) {
+    fprintf(stderr, "warning: could not allocate writer\n");
+    return;
+  }
+  triCount = simpleExtrude(&b->opts, &writer, &b->hm);
+  freeWriter(&writer);
+  setTriCount(b->out, triCount);
+}
+
+// Run fn reps times (after one warm up run) and record the timings.
+// tris < 0: take the tri count from the output file
+static void runBench(bench_run *run, const char *name, bench_fn fn, void *arg, long tris, long bytes) {
+  bench_result *res;
+  double start, elapsed;
+  int rep;
+
+  if(run->opts->filter && !strstr(name, run->opts->filter))
+    return;
+  if(run->count == BENCH_MAX_RESULTS) {
+    fprintf(stderr, "too many benchmarks, skipping %s\n", name);
+    return;
+  }
+  res = &run->results[run->count++];
+  memset(res, 0, sizeof(bench_result));
+  snprintf(res->name, sizeof(res->name), "%s", name);
+  res->tris = tris;
+  res->bytes = bytes;
+
+  fn(arg);
+  for(rep = 0; rep < run->opts->reps; rep++) {
+    start = now();
+    fn(arg);
+    elapsed = now() - start;
+    res->mean += elapsed / run->opts->reps;
+    if(rep == 0 || elapsed < res->best)
+      res->best = elapsed;
+  }
+  fprintf(stderr, "%-28s %10.3f ms %10.1f MB/s %12.0f tris/s\n", res->name, res->best * 1e3,
+          res->bytes / res->best / 1e6, res->tris / res->best);
+}
+
+// Bytes in a file
+static long fileBytes(FILE *file) {
+  fflush(file);
+  fseek(file, 0L, SEEK_END);
+  return ftell(file);
+}
+
+// I/O, transform and template benchmarks on meshes of triCount tris
+static void benchMeshes(bench_run *run, int triCount) {
+  char name[64], binName[64], asciiName[64];
+  io_bench b;
+  long binBytes, asciiBytes;
+  int ndx;
+
+  memset(&b, 0, sizeof(io_bench));
+  b.triCount = triCount / 12 * 12;
+  b.tris = malloc(sizeof(stl_tri) * (b.triCount + 12));
+  testMesh(b.tris, b.triCount / 12);
+
+  // Write to scratch files, then read back what was written
+  snprintf(binName, sizeof(binName), "bench_%d.stl", b.triCount);
+  snprintf(asciiName, sizeof(asciiName), "bench_%d_ascii.stl", b.triCount);
+  writeBinTestCube(binName, b.triCount / 12);
+  writeAsciiTestCube(asciiName, b.triCount / 12);
+  b.file = fopen(binName, "r");
+  binBytes = fileBytes(b.file);
+  fclose(b.file);
+  b.file = fopen(asciiName, "r");
+  asciiBytes = fileBytes(b.file);
+  fclose(b.file);
+
+  b.file = tmpfile();
+  b.mode = BINARY;
+  snprintf(name, sizeof(name), "write_bin_%d", b.triCount);
+  runBench(run, name, benchWrite, &b, b.triCount, binBytes);
+  b.mode = ASCII;
+  snprintf(name, sizeof(name), "write_ascii_%d", b.triCount);
+  runBench(run, name, benchWrite, &b, b.triCount, asciiBytes);
+
+  b.filename = binName;
+  snprintf(name, sizeof(name), "template_bin_%d", b.triCount);
+  runBench(run, name, benchTemplate, &b, b.triCount, binBytes);
+  b.filename = asciiName;
+  snprintf(name, sizeof(name), "template_ascii_%d", b.triCount);
+  runBench(run, name, benchTemplate, &b, b.triCount, asciiBytes);
+  fclose(b.file);
+
+  b.file = fopen(binName, "r");
+  b.mode = BINARY;
+  snprintf(name, sizeof(name), "read_bin_%d", b.triCount);
+  runBench(run, name, benchRead, &b, b.triCount, binBytes);
+  fclose(b.file);
+  b.file = fopen(asciiName, "r");
+  b.mode = ASCII;
+  snprintf(name, sizeof(name), "read_ascii_%d", b.triCount);
+  runBench(run, name, benchRead, &b, b.triCount, asciiBytes);
+  fclose(b.file);
+  remove(binName);
+  remove(asciiName);
+
+  // Rotation keeps coordinates bounded over many runs
+  b.t = rotateTransform(2, 0.5f);
+  snprintf(name, sizeof(name), "transform_tris_%d", b.triCount);
+  runBench(run, name, benchTransformTris, &b, b.triCount, (long)b.triCount * sizeof(stl_tri));
+
+  b.x = malloc(sizeof(float) * b.triCount * 3);
+  b.y = malloc(sizeof(float) * b.triCount * 3);
+  b.z = malloc(sizeof(float) * b.triCount * 3);
+  for(ndx = 0; ndx < b.triCount * 3; ndx++) {
+    stl_tri *tri = &b.tris[ndx / 3];
+    float *v = ndx % 3 == 0 ? tri->vertexA : ndx % 3 == 1 ? tri->vertexB : tri->vertexC;
+    b.x[ndx] = v[0];
+    b.y[ndx] = v[1];
+    b.z[ndx] = v[2];
+  }
+  snprintf(name, sizeof(name), "transform_points_%d", b.triCount);
+  runBench(run, name, benchTransformPoints, &b, b.triCount, (long)b.triCount * 9 * sizeof(float));
+
+  free(b.x);
+  free(b.y);
+  free(b.z);
+  free(b.tris);
+}
+
+// simpleExtrude of a side x side pattern
+static void benchPattern(bench_run *run, const char *pattern, int side) {
+  char name[64];
+  extrude_bench b;
+  stl_writer writer;
+  int triCount;
+
+  defaultOpts(&b.opts);
+  scaleOpts(&b.opts, side, side);
+  initHeightmap(&b.src, side, side);
+  initHeightmap(&b.hm, side, side);
+  testHeightmap(&b.src, pattern);
+  b.out = tmpfile();
+
+  // Size the output once for the throughput numbers
+  memcpy(b.hm.rows, b.src.rows, sizeof(uint64_t) * b.src.rowWords * side);
+  if(initWriter(&writer, b.out, BINARY) == 0) {
+    triCount = simpleExtrude(&b.opts, &writer, &b.hm);
+    freeWriter(&writer);
+
+    snprintf(name, sizeof(name), "extrude_%s", pattern);
+    runBench(run, name, benchExtrude, &b, triCount, 84L + (long)triCount * STL_RECORD_SIZE);
+  } else
+    fprintf(stderr, "warning: could not allocate writer\n");
+
+  fclose(b.out);
+  freeHeightmap(&b.src);
+  freeHeightmap(&b.hm);
+  freeOpts(&b.opts);
+}
+
+//////////////////////////////////////////////////////
+// Results
+//////////////////////////////////////////////////////
+
+// tris/s by name from an earlier --output file -> 0 on success
+static int readBaseline(bench_run *run, const char *filename) {
+  FILE *in = fopen(filename, "r");
+  char line[512], name[64], *pos;
+  double trisPerSec;
+  int ndx;
+
+  if(!in) {
+    printf("Could not open baseline %s\n", filename);
+    return 1;
+  }
+  while(fgets(line, sizeof(line), in)) {
+    if(!(pos = strstr(line, "\"name\": \"")) || sscanf(pos + 9, "%63[^\"]", name) != 1)
+      continue;
+    if(!(pos = strstr(line, "\"tris_per_s\": ")) || sscanf(pos + 14, "%lf", &trisPerSec) != 1)
+      continue;
+    for(ndx = 0; ndx < run->count; ndx++)
+      if(strcmp(run->results[ndx].name, name) == 0)
+        run->results[ndx].baseline = trisPerSec;
+  }
+  fclose(in);
   return 0;
 }
+
+static void writeResults(bench_run *run, FILE *out) {
+  bench_result *res;
+  int ndx;
+
+  fprintf(out, "{\n  \"reps\": %d,\n  \"results\": [\n", run->opts->reps);
+  for(ndx = 0; ndx < run->count; ndx++) {
+    res = &run->results[ndx];
+    fprintf(out, "    { \"name\": \"%s\", \"tris\": %ld, \"bytes\": %ld, \"best_s\": %.6f, \"mean_s\": %.6f, "
+                 "\"mb_per_s\": %.2f, \"tris_per_s\": %.0f",
+            res->name, res->tris, res->bytes, res->best, res->mean,
+            res->bytes / res->best / 1e6, res->tris / res->best);
+    if(res->baseline > 0)
+      fprintf(out, ", \"vs_baseline\": %.3f", res->tris / res->best / res->baseline);
+    fprintf(out, " }%s\n", ndx + 1 < run->count ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+// Print the comparison, # of benchmarks slower than the threshold
+static int compareBaseline(bench_run *run) {
+  bench_result *res;
+  double ratio;
+  int ndx, regressions = 0;
+
+  fprintf(stderr, "\n%-28s %12s %12s %8s\n", "benchmark", "baseline/s", "tris/s", "ratio");
+  for(ndx = 0; ndx < run->count; ndx++) {
+    res = &run->results[ndx];
+    if(res->baseline <= 0) {
+      fprintf(stderr, "%-28s %12s %12.0f %8s\n", res->name, "-", res->tris / res->best, "new");
+      continue;
+    }
+    ratio = res->tris / res->best / res->baseline;
+    fprintf(stderr, "%-28s %12.0f %12.0f %8.3f%s\n", res->name, res->baseline, res->tris / res->best, ratio,
+            ratio < 1.0 - run->opts->threshold / 100.0 ? "  REGRESSION" : "");
+    regressions += ratio < 1.0 - run->opts->threshold / 100.0;
+  }
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *patterns[] = { "noise", "text", "stripes", "checker" };
+  bench_opts opts = { 5, 1024, { 1200, 120000, 1200000 }, 3, NULL, NULL, NULL, 10.0 };
+  bench_run *run;
+  FILE *out = stdout;
+  char *size;
+  int longIndex, opt, ndx, regressions = 0;
+
+  while((opt = getopt_long(argc, argv, optString, longOpts, &longIndex)) != -1) {
+    switch(opt) {
+      case 'r': opts.reps = atoi(optarg); break;
+      case 'i': opts.image = atoi(optarg); break;
+      case 'f': opts.filter = optarg; break;
+      case 'o': opts.output = optarg; break;
+      case 'b': opts.baseline = optarg; break;
+      case 't': opts.threshold = atof(optarg); break;
+      case 's':
+        opts.sizeCount = 0;
+        for(size = strtok(optarg, ","); size && opts.sizeCount < BENCH_MAX_SIZES; size = strtok(NULL, ","))
+          opts.sizes[opts.sizeCount++] = atoi(size);
+        break;
+      default:
+        printf("Usage: $ bench [--reps #] [--sizes #,#] [--image #] [--filter text] "
+               "[--output file.json] [--baseline file.json] [--threshold %%]\n");
+        return 1;
+    }
+  }
+  if(opts.reps < 1 || opts.image < 1) {
+    printf("--reps and --image must be positive\n");
+    return 1;
+  }
+
+  run = calloc(1, sizeof(bench_run));
+  run->opts = &opts;
+  for(ndx = 0; ndx < opts.sizeCount; ndx++)
+    if(opts.sizes[ndx] >= 12)
+      benchMeshes(run, opts.sizes[ndx]);
+  for(ndx = 0; ndx < 4; ndx++)
+    benchPattern(run, patterns[ndx], opts.image);
+
+  if(opts.baseline) {
+    if(readBaseline(run, opts.baseline) != 0)
+      return 1;
+    regressions = compareBaseline(run);
+  }
+
+  if(opts.output && !(out = fopen(opts.output, "w"))) {
+    printf("Could not open %s\n", opts.output);
+    return 1;
+  }
+  writeResults(run, out);
+  if(out != stdout)
+    fclose(out);
+  free(run);
+  return regressions > 0;
+}
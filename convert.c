@@ -1,8 +1,13 @@
 // Chris Polis
 // convert.c - A tool to convert STL files between ASCII and binary encoding
-// 
-// Usage: $ extrude [input (.stl)] [output (.stl)]
+//
+// Usage: $ convert [input (.stl)] [output (.stl)] [--compact]
+//
+// Both directions are split into chunks that are formatted/parsed on
+// worker threads (STL_THREADS overrides the count) and written in order.
+// Quantized meshes (extrude --quantized) are expanded to binary STL.
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,46 +16,264 @@
 
 #include "stl_util.h"
 #include "stl_io.h"
+#include "stl_mesh.h"
+#include "stl_thread.h"
+
+#define CHUNK_TRIS  8192        // binary -> ASCII: records per chunk
+#define CHUNK_BYTES (4 << 20)   // ASCII -> binary: input bytes per chunk
+
+typedef struct chunk_st {
+  uint32_t first, last;         // binary input records [first, last)
+  const char *start, *end;      // ASCII input bytes [start, end)
+  unsigned char *buf;           // formatted output
+  size_t len, cap;
+  uint32_t triCount;
+  int complete;                 // whole input range parsed
+  int failed;                   // buf could not grow, parse stopped
+} chunk;
+
+typedef struct convert_job_st {
+  stl_view *view;
+  ascii_format format;
+  chunk *chunks;
+} convert_job;
+
+// Format records of one chunk as ASCII
+void formatChunk(void *ctx, int ndx) {
+  convert_job *job = ctx;
+  chunk *c = &job->chunks[ndx];
+  stl_view_iter it = viewRange(job->view, c->first, c->last);
+  const unsigned char *rec;
+  stl_tri tri;
+
+  c->len = 0;
+  while((rec = viewNext(&it))) {
+    unpackTriBin(rec, &tri);
+    c->len += formatTriASCII((char *)c->buf + c->len, &tri, job->format);
+  }
+}
+
+// Parse facets of one chunk into binary records
+void parseChunk(void *ctx, int ndx) {
+  convert_job *job = ctx;
+  chunk *c = &job->chunks[ndx];
+  unsigned char *grown;
+  stl_parser parser;
+  stl_tri tri;
+
+  c->len = 0;
+  c->triCount = 0;
+  initParserRange(&parser, c->start, c->end);
+  while(parseTriASCII(&parser, &tri)) {
+    if(c->len + STL_RECORD_SIZE > c->cap) {
+      if(!(grown = realloc(c->buf, c->cap * 2))) {
+        c->failed = 1;
+        break;
+      }
+      c->buf = grown;
+      c->cap *= 2;
+    }
+    packTriBin(c->buf + c->len, &tri);
+    c->len += STL_RECORD_SIZE;
+    c->triCount++;
+  }
+  c->complete = parser.cur == c->end;
+}
+
+// Quantized mesh -> binary records with normals from the winding
+// -> 0 on success, -1 out of memory
+int expandQuantized(stl_mesh *mesh, stl_writer *writer) {
+  stl_tri *tris = malloc(sizeof(stl_tri) * CHUNK_TRIS);
+  uint32_t ndx, batch;
+
+  if(!tris)
+    return -1;
+  for(ndx = 0; ndx < mesh->triCount; ndx += batch) {
+    for(batch = 0; batch < CHUNK_TRIS && ndx + batch < mesh->triCount; batch++)
+      meshTri(mesh, ndx + batch, &tris[batch]);
+    writerTriArray(writer, batch, tris);
+  }
+  free(tris);
+  return 0;
+}
+
+// First facet boundary at or after pos
+const char *facetBoundary(const char *pos, const char *end) {
+  const char *found;
+
+  if(pos >= end)
+    return end;
+  found = memmem(pos, end - pos, "endfacet", 8);
+  return found ? found + 8 : end;
+}
+
+// Release the chunks of a round
+void freeChunks(chunk *chunks, int roundSize) {
+  int ndx;
+
+  for(ndx = 0; ndx < roundSize; ndx++)
+    free(chunks[ndx].buf);
+  free(chunks);
+}
+
+// Binary view -> ASCII, chunks formatted in parallel -> 0 on success,
+// -1 (nothing written) if the chunk buffers can't be allocated
+int convertToASCII(stl_view *view, stl_writer *writer, ascii_format format, int threads) {
+  int roundSize = threads * 2, ndx, count;
+  chunk *chunks = calloc(roundSize, sizeof(chunk));
+  convert_job job = { view, format, chunks };
+  uint32_t next = 0;
+
+  if(!chunks)
+    return -1;
+  for(ndx = 0; ndx < roundSize; ndx++)
+    if(!(chunks[ndx].buf = malloc((size_t)CHUNK_TRIS * STL_FACET_MAX))) {
+      freeChunks(chunks, roundSize);
+      return -1;
+    }
+
+  while(next < view->triCount) {
+    for(count = 0; count < roundSize && next < view->triCount; count++) {
+      chunks[count].first = next;
+      next = view->triCount - next < CHUNK_TRIS ? view->triCount : next + CHUNK_TRIS;
+      chunks[count].last = next;
+    }
+    runTasks(threads, count, formatChunk, &job);
+    for(ndx = 0; ndx < count; ndx++)
+      writerBytes(writer, chunks[ndx].buf, chunks[ndx].len);
+  }
+
+  freeChunks(chunks, roundSize);
+  return 0;
+}
+
+// ASCII parser input -> binary records, *triCount of them -> 0 on success,
+// -1 if a chunk buffer can't be allocated or grown
+int convertToBinary(stl_parser *parser, stl_writer *writer, int threads, uint32_t *triCount) {
+  int roundSize = threads * 2, ndx, count, done = 0, failed = 0;
+  chunk *chunks = calloc(roundSize, sizeof(chunk));
+  convert_job job = { NULL, ASCII_EXACT, chunks };
+  const char *next = parser->cur;
+
+  *triCount = 0;
+  if(!chunks)
+    return -1;
+  for(ndx = 0; ndx < roundSize; ndx++) {
+    chunks[ndx].cap = CHUNK_BYTES / 4;
+    if(!(chunks[ndx].buf = malloc(chunks[ndx].cap))) {
+      freeChunks(chunks, roundSize);
+      return -1;
+    }
+  }
+
+  while(!done && next < parser->end) {
+    for(count = 0; count < roundSize && next < parser->end; count++) {
+      chunks[count].start = next;
+      next = facetBoundary(next + CHUNK_BYTES < parser->end ? next + CHUNK_BYTES : parser->end, parser->end);
+      chunks[count].end = next;
+    }
+    runTasks(threads, count, parseChunk, &job);
+
+    // Stop at the first malformed facet, like a serial parse would
+    for(ndx = 0; ndx < count && !done; ndx++) {
+      writerBytes(writer, chunks[ndx].buf, chunks[ndx].len);
+      *triCount += chunks[ndx].triCount;
+      if(chunks[ndx].failed)
+        done = failed = 1;
+      else if(!chunks[ndx].complete) {
+        fprintf(stderr, "warning: stopped at malformed facet after %u tris\n", *triCount);
+        done = 1;
+      }
+    }
+  }
+
+  freeChunks(chunks, roundSize);
+  return failed ? -1 : 0;
+}
 
 int main(int argc, char *argv[]) {
 
-  if(argc != 3) {
-    printf("Usage: $ convert [input (.stl)] [output (.stl)]\n");
+  if(argc != 3 && !(argc == 4 && strcmp(argv[3], "--compact") == 0)) {
+    printf("Usage: $ convert [input (.stl)] [output (.stl)] [--compact]\n");
     return 1;
   }
 
-  int ndx;
-  stl_tri tempTri;
+  stl_view view;
+  stl_parser parser;
+  stl_writer writer;
+  stl_mesh mesh;
+  stl_mode mode;
   uint32_t triCount = 0;
+  int threads = getThreadCount(), result;
   FILE *infile = fopen(argv[1], "r");
   FILE *outfile = fopen(argv[2], "w");
 
-  // Check if it is binary or ascii
-  if(getFileMode(infile) == ASCII) {
+  if(!infile || !outfile) {
+    printf("Could not open %s\n", infile ? argv[2] : argv[1]);
+    return 1;
+  }
+
+  // Check if it is quantized, binary or ascii
+  mode = getFileMode(infile);
+  if(mode == QUANTIZED) {
+    printf("Detected QUANTIZED input, expanding to binary...\n");
+
+    initMesh(&mesh, 0.0f);
+    if(readQuantized(infile, &mesh) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
+    writeHeaderBin(outfile, 0);
+    if(initWriter(&writer, outfile, BINARY) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
+    }
+    result = expandQuantized(&mesh, &writer);
+    freeWriter(&writer);
+    setTriCount(outfile, result == 0 ? mesh.triCount : 0);
+    freeMesh(&mesh);
+
+  } else if(mode == ASCII) {
     printf("Detected ASCII input, converting to binary...\n");
 
-    readASCIIHeader(infile);
+    if(openParser(&parser, infile) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
     writeHeaderBin(outfile, 0);
-    while(readTriASCII(infile, &tempTri)) {
-      writeTriBin(outfile, &tempTri);
-      triCount++;
+    if(initWriter(&writer, outfile, BINARY) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
     }
+    result = convertToBinary(&parser, &writer, threads, &triCount);
+    closeParser(&parser);
+    freeWriter(&writer);
     setTriCount(outfile, triCount);
 
   } else {
     printf("Detected BINARY input, converting to ascii...\n");
 
-    triCount = readBinaryHeader(infile);
+    if(openView(&view, infile) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
     writeHeaderAscii(outfile);
-    for(ndx = 0; ndx < triCount; ndx++) {
-      readTriBin(infile, &tempTri);
-      writeTriASCII(outfile, &tempTri);
+    if(initWriter(&writer, outfile, ASCII) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
     }
+    result = convertToASCII(&view, &writer, argc == 4 ? ASCII_COMPACT : ASCII_EXACT, threads);
+    freeWriter(&writer);
     writeFooterAscii(outfile);
+    closeView(&view);
   }
 
   fclose(infile);
   fclose(outfile);
 
+  if(result != 0) {
+    printf("Could not allocate conversion buffers\n");
+    return 1;
+  }
   return 0;
 }
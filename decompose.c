@@ -0,0 +1,516 @@
+// Chris Polis
+// decompose.c - covering heightmap rows with rectangles for XY faces
+//
+// optimalRects follows the classic minimum partition of a rectilinear
+// polygon: each chord joining two concave corners saves one rectangle, the
+// largest set of chords that do not cross is a maximum independent set of
+// the bipartite horizontal/vertical crossing graph (Hopcroft-Karp matching
+// and Konig's theorem), and every concave corner left over gets one more
+// cut running to the nearest wall. The faces that remain are rectangles.
+
+#include <stdlib.h>
+#include <string.h>
+#include "decompose.h"
+
+// Pixels around a grid point, bit set = pixel set
+#define Q_NW  1
+#define Q_NE  2
+#define Q_SW  4
+#define Q_SE  8
+#define Q_ALL 15
+
+typedef struct corner_st {
+  int row, col;             // grid point, band rows
+  int missing;              // Q_ bit of the clear pixel
+  int resolved;             // a cut ends here
+} corner;
+
+typedef struct chord_st {
+  int line, start, end;     // grid line and points [start, end] along it
+} chord;
+
+typedef struct band_st {
+  heightmap *hm;
+  int first, rows, width;
+  heightmap hcut;           // rows + 1 lines: bit c of line r = wall above pixel (r, c)
+  heightmap vcut;           // rows lines of width + 1 bits: bit c = wall left of (r, c)
+  corner *corners;
+  int cornerCount, cornerAlloc;
+  chord *hchords, *vchords;
+  int hCount, hAlloc, vCount, vAlloc;
+} band;
+
+void appendRect(rect_list *list, int startCol, int endCol, int startRow, int endRow) {
+  rect *grown;
+
+  if(list->count == list->alloc) {
+    if(!(grown = realloc(list->rects, sizeof(rect) * (list->alloc ? list->alloc * 2 : 256)))) {
+      list->failed = 1;
+      return;
+    }
+    list->rects = grown;
+    list->alloc = list->alloc ? list->alloc * 2 : 256;
+  }
+  list->rects[list->count++] = (rect){ startCol, endCol, startRow, endRow };
+}
+
+void greedyRects(heightmap *hm, int firstRow, int lastRow, rect_list *list) {
+  int rowNdx, colNdx, startCol, endCol, endRow, clearRow;
+
+  for(rowNdx = firstRow; rowNdx < lastRow; rowNdx++) {
+    colNdx = 0;
+    while(nextRun(HM_ROW(hm, rowNdx), hm->width, colNdx, &startCol, &endCol)) {
+      // try to extend in y direction
+      endRow = rowNdx + 1;
+      while(endRow < lastRow && rangeSet(HM_ROW(hm, endRow), startCol, endCol))
+        endRow++;
+
+      // zero out
+      for(clearRow = rowNdx; clearRow < endRow; clearRow++)
+        clearRange(HM_ROW(hm, clearRow), startCol, endCol);
+
+      appendRect(list, startCol, endCol, rowNdx, endRow);
+      colNdx = endCol;
+    }
+  }
+}
+
+static int pixel(band *b, int row, int col) {
+  return row >= 0 && row < b->rows && col >= 0 && col < b->width && HM_GET(b->hm, b->first + row, col);
+}
+
+// Set pixels around grid point (row, col)
+static int quad(band *b, int row, int col) {
+  return pixel(b, row-1, col-1) * Q_NW | pixel(b, row-1, col) * Q_NE |
+         pixel(b, row, col-1) * Q_SW | pixel(b, row, col) * Q_SE;
+}
+
+static int concave(int q) {
+  return q == (Q_ALL ^ Q_NW) || q == (Q_ALL ^ Q_NE) || q == (Q_ALL ^ Q_SW) || q == (Q_ALL ^ Q_SE);
+}
+
+static int addChord(chord **chords, int *count, int *alloc, int line, int start, int end) {
+  chord *grown;
+
+  if(*count == *alloc) {
+    if(!(grown = realloc(*chords, sizeof(chord) * (*alloc ? *alloc * 2 : 256))))
+      return -1;
+    *chords = grown;
+    *alloc = *alloc ? *alloc * 2 : 256;
+  }
+  (*chords)[(*count)++] = (chord){ line, start, end };
+  return 0;
+}
+
+// Concave corners in raster order, grid points with exactly 3 set pixels
+// -> 0 on success
+static int findCorners(band *b) {
+  int words = WORDS_FOR(b->width + 1), row, word, result = 0;
+  uint64_t *north = calloc(words, sizeof(uint64_t)), *south = calloc(words, sizeof(uint64_t));
+  corner *grown;
+
+  if(!north || !south)
+    result = -1;
+  for(row = 0; row <= b->rows && result == 0; row++) {
+    memcpy(north, south, sizeof(uint64_t) * words);
+    memset(south, 0, sizeof(uint64_t) * words);
+    if(row < b->rows)
+      memcpy(south, HM_ROW(b->hm, b->first + row), sizeof(uint64_t) * b->hm->rowWords);
+
+    for(word = 0; word < words; word++) {
+      uint64_t ne = north[word], se = south[word];
+      uint64_t nw = (ne << 1) | (word ? north[word-1] >> 63 : 0);
+      uint64_t sw = (se << 1) | (word ? south[word-1] >> 63 : 0);
+      uint64_t three = ((nw & ne) & (sw | se)) | ((sw & se) & (nw | ne));
+      uint64_t bits;
+
+      for(bits = three & ~(nw & ne & sw & se); bits && result == 0; bits &= bits - 1) {
+        int col = (word << 6) + __builtin_ctzll(bits);
+        if(b->cornerCount == b->cornerAlloc) {
+          if(!(grown = realloc(b->corners, sizeof(corner) * (b->cornerAlloc ? b->cornerAlloc * 2 : 256)))) {
+            result = -1;
+            break;
+          }
+          b->corners = grown;
+          b->cornerAlloc = b->cornerAlloc ? b->cornerAlloc * 2 : 256;
+        }
+        b->corners[b->cornerCount++] = (corner){ row, col, Q_ALL ^ quad(b, row, col), 0 };
+      }
+    }
+  }
+  free(north);
+  free(south);
+  return result;
+}
+
+static corner *findCorner(band *b, int row, int col) {
+  int lo = 0, hi = b->cornerCount - 1;
+
+  while(lo <= hi) {
+    int mid = (lo + hi) / 2;
+    corner *c = &b->corners[mid];
+    if(c->row == row && c->col == col)
+      return c;
+    if(c->row < row || (c->row == row && c->col < col))
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+// Chords that run inside the shape from one concave corner to another,
+// walked east and south only so each is found once -> 0 on success
+static int findChords(band *b) {
+  int ndx, x, y, q;
+
+  for(ndx = 0; ndx < b->cornerCount; ndx++) {
+    corner *c = &b->corners[ndx];
+
+    if(c->missing == Q_NW || c->missing == Q_SW) {
+      for(x = c->col; pixel(b, c->row-1, x) && pixel(b, c->row, x); ) {
+        if((q = quad(b, c->row, ++x)) == Q_ALL)
+          continue;
+        if((q == (Q_ALL ^ Q_NE) || q == (Q_ALL ^ Q_SE)) &&
+           addChord(&b->hchords, &b->hCount, &b->hAlloc, c->row, c->col, x) != 0)
+          return -1;
+        break;
+      }
+    }
+    if(c->missing == Q_NW || c->missing == Q_NE) {
+      for(y = c->row; pixel(b, y, c->col-1) && pixel(b, y, c->col); ) {
+        if((q = quad(b, ++y, c->col)) == Q_ALL)
+          continue;
+        if((q == (Q_ALL ^ Q_SW) || q == (Q_ALL ^ Q_SE)) &&
+           addChord(&b->vchords, &b->vCount, &b->vAlloc, c->col, c->row, y) != 0)
+          return -1;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Crossing graph as adjacency lists of the horizontal chords. Chords that
+// share an end corner count as crossing -> 0 on success, else both NULL
+static int crossingGraph(band *b, int **adjStart, int **adj) {
+  int *rowFirst = calloc(b->rows + 2, sizeof(int));
+  int *pairs = NULL, pairCount = 0, pairAlloc = 0;
+  int ndx, row, *fill = NULL, *grown;
+
+  *adjStart = *adj = NULL;
+  if(!rowFirst)
+    return -1;
+
+  // Horizontal chords come in raster order, index them by row
+  for(ndx = 0; ndx < b->hCount; ndx++)
+    rowFirst[b->hchords[ndx].line + 1]++;
+  for(row = 0; row <= b->rows; row++)
+    rowFirst[row + 1] += rowFirst[row];
+
+  for(ndx = 0; ndx < b->vCount; ndx++) {
+    chord *v = &b->vchords[ndx];
+    for(row = v->start; row <= v->end; row++) {
+      int lo = rowFirst[row], hi = rowFirst[row + 1] - 1, found = -1;
+      while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(b->hchords[mid].start <= v->line) {
+          found = mid;
+          lo = mid + 1;
+        } else
+          hi = mid - 1;
+      }
+      if(found < 0 || b->hchords[found].end < v->line)
+        continue;
+      if(pairCount + 2 > pairAlloc) {
+        if(!(grown = realloc(pairs, sizeof(int) * (pairAlloc ? pairAlloc * 2 : 512))))
+          goto fail;
+        pairs = grown;
+        pairAlloc = pairAlloc ? pairAlloc * 2 : 512;
+      }
+      pairs[pairCount++] = found;
+      pairs[pairCount++] = ndx;
+    }
+  }
+
+  *adjStart = calloc(b->hCount + 1, sizeof(int));
+  *adj = malloc(sizeof(int) * (pairCount / 2 + 1));
+  fill = malloc(sizeof(int) * (b->hCount + 1));
+  if(!*adjStart || !*adj || !fill)
+    goto fail;
+  for(ndx = 0; ndx < pairCount; ndx += 2)
+    (*adjStart)[pairs[ndx] + 1]++;
+  for(ndx = 0; ndx < b->hCount; ndx++)
+    (*adjStart)[ndx + 1] += (*adjStart)[ndx];
+  memcpy(fill, *adjStart, sizeof(int) * (b->hCount + 1));
+  for(ndx = 0; ndx < pairCount; ndx += 2)
+    (*adj)[fill[pairs[ndx]]++] = pairs[ndx + 1];
+
+  free(fill);
+  free(pairs);
+  free(rowFirst);
+  return 0;
+
+fail:
+  free(*adjStart);
+  free(*adj);
+  *adjStart = *adj = NULL;
+  free(fill);
+  free(pairs);
+  free(rowFirst);
+  return -1;
+}
+
+// Maximum matching of horizontal to vertical chords (Hopcroft-Karp)
+// -> 0 on success
+static int matchChords(int hCount, int vCount, int *adjStart, int *adj, int *matchH, int *matchV) {
+  int *dist = malloc(sizeof(int) * (hCount + 1));
+  int *queue = malloc(sizeof(int) * (hCount + 1));
+  int *stack = malloc(sizeof(int) * (hCount + 1));
+  int *edge = malloc(sizeof(int) * (hCount + 1));
+  int ndx, head, tail, found, depth, result = 0;
+
+  if(!dist || !queue || !stack || !edge) {
+    result = -1;
+    goto done;
+  }
+  for(ndx = 0; ndx < hCount; ndx++)
+    matchH[ndx] = -1;
+  for(ndx = 0; ndx < vCount; ndx++)
+    matchV[ndx] = -1;
+
+  for(;;) {
+    // Layer the free horizontal chords and what alternates away from them
+    for(head = tail = ndx = 0; ndx < hCount; ndx++) {
+      dist[ndx] = matchH[ndx] < 0 ? 0 : -1;
+      if(matchH[ndx] < 0)
+        queue[tail++] = ndx;
+    }
+    for(found = 0; head < tail; head++) {
+      int h = queue[head], e;
+      for(e = adjStart[h]; e < adjStart[h+1]; e++) {
+        int next = matchV[adj[e]];
+        if(next < 0)
+          found = 1;
+        else if(dist[next] < 0) {
+          dist[next] = dist[h] + 1;
+          queue[tail++] = next;
+        }
+      }
+    }
+    if(!found)
+      break;
+
+    // Vertex disjoint shortest augmenting paths, depth first without recursion
+    for(ndx = 0; ndx < hCount; ndx++)
+      edge[ndx] = adjStart[ndx];
+    for(ndx = 0; ndx < hCount; ndx++) {
+      if(matchH[ndx] >= 0 || dist[ndx] != 0)
+        continue;
+      stack[0] = ndx;
+      depth = 1;
+      while(depth > 0) {
+        int h = stack[depth-1], next;
+        if(edge[h] == adjStart[h+1]) {
+          dist[h] = -1;
+          if(--depth > 0)
+            edge[stack[depth-1]]++;
+          continue;
+        }
+        next = matchV[adj[edge[h]]];
+        if(next < 0) {
+          // Flip the path on the stack
+          while(depth > 0) {
+            h = stack[--depth];
+            matchH[h] = adj[edge[h]];
+            matchV[matchH[h]] = h;
+          }
+        } else if(dist[next] == dist[h] + 1)
+          stack[depth++] = next;
+        else
+          edge[h]++;
+      }
+    }
+  }
+
+done:
+  free(dist);
+  free(queue);
+  free(stack);
+  free(edge);
+  return result;
+}
+
+// Mark a maximum set of non-crossing chords: the complement of the
+// minimum vertex cover found by alternating search from free horizontals
+// (pickH comes in zeroed) -> 0 on success
+static int pickChords(band *b, int *adjStart, int *adj, int *matchH, int *matchV,
+                      char *pickH, char *pickV) {
+  int *queue = malloc(sizeof(int) * (b->hCount + 1));
+  int ndx, head = 0, tail = 0;
+
+  if(!queue)
+    return -1;
+  for(ndx = 0; ndx < b->vCount; ndx++)
+    pickV[ndx] = 1;
+  for(ndx = 0; ndx < b->hCount; ndx++)
+    if(matchH[ndx] < 0) {
+      pickH[ndx] = 1;
+      queue[tail++] = ndx;
+    }
+  for(; head < tail; head++) {
+    int h = queue[head], e;
+    for(e = adjStart[h]; e < adjStart[h+1]; e++) {
+      int v = adj[e];
+      if(!pickV[v] || matchH[h] == v)
+        continue;
+      pickV[v] = 0;
+      if(matchV[v] >= 0 && !pickH[matchV[v]]) {
+        pickH[matchV[v]] = 1;
+        queue[tail++] = matchV[v];
+      }
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+static void resolve(band *b, int row, int col) {
+  corner *c = findCorner(b, row, col);
+  if(c)
+    c->resolved = 1;
+}
+
+// Vertical cut from a concave corner into the shape, up to the boundary,
+// a horizontal cut or another concave corner
+static void cutFrom(band *b, corner *c) {
+  int dir = (c->missing == Q_NW || c->missing == Q_NE) ? 1 : -1;
+  int y = c->row, col = c->col, q;
+
+  for(;;) {
+    int seg = dir > 0 ? y : y - 1;
+    if(!pixel(b, seg, col-1) || !pixel(b, seg, col) || HM_GET(&b->vcut, seg, col))
+      return;
+    HM_SET(&b->vcut, seg, col);
+    y += dir;
+    if((col > 0 && HM_GET(&b->hcut, y, col-1)) || (col < b->width && HM_GET(&b->hcut, y, col)))
+      return;
+    if((q = quad(b, y, col)) != Q_ALL) {
+      if(concave(q))
+        resolve(b, y, col);
+      return;
+    }
+  }
+}
+
+// Rectangles of the partition in raster order, pixels cleared
+static void extractRects(band *b, rect_list *list) {
+  int row, col, startCol, endCol, endRow, wallStart, wallEnd, clearRow;
+
+  for(row = 0; row < b->rows; row++) {
+    uint64_t *bits = HM_ROW(b->hm, b->first + row);
+    col = 0;
+    while(nextRun(bits, b->width, col, &startCol, &endCol)) {
+      if(nextRun(HM_ROW(&b->vcut, row), b->width + 1, startCol + 1, &wallStart, &wallEnd) && wallStart < endCol)
+        endCol = wallStart;
+
+      endRow = row + 1;
+      while(endRow < b->rows && rangeSet(HM_ROW(b->hm, b->first + endRow), startCol, endCol) &&
+            !rangeAny(HM_ROW(&b->hcut, endRow), startCol, endCol))
+        endRow++;
+
+      for(clearRow = row; clearRow < endRow; clearRow++)
+        clearRange(HM_ROW(b->hm, b->first + clearRow), startCol, endCol);
+
+      appendRect(list, startCol, endCol, b->first + row, b->first + endRow);
+      col = endCol;
+    }
+  }
+}
+
+int optimalRects(heightmap *hm, int firstRow, int lastRow, rect_list *list) {
+  band b;
+  heightmap copy;
+  rect_list greedy = { NULL, 0, 0 };
+  int *adjStart = NULL, *adj = NULL, *matchH = NULL, *matchV = NULL, ndx, row, col, count;
+  char *pickH = NULL, *pickV = NULL;
+
+  memset(&b, 0, sizeof(band));
+  b.hm = hm;
+  b.first = firstRow;
+  b.rows = lastRow - firstRow;
+  b.width = hm->width;
+  if(b.rows <= 0 || b.width <= 0)
+    return 0;
+
+  // Greedy count on a copy, for comparison
+  if(initHeightmap(&copy, hm->width, b.rows) != 0)
+    goto fallback;
+  memcpy(copy.rows, HM_ROW(hm, firstRow), sizeof(uint64_t) * hm->rowWords * b.rows);
+  greedyRects(&copy, 0, b.rows, &greedy);
+  freeHeightmap(&copy);
+  free(greedy.rects);
+  if(greedy.failed)
+    goto fallback;
+
+  if(initHeightmap(&b.hcut, b.width, b.rows + 1) != 0 || initHeightmap(&b.vcut, b.width + 1, b.rows) != 0 ||
+     findCorners(&b) != 0 || findChords(&b) != 0 || crossingGraph(&b, &adjStart, &adj) != 0)
+    goto fallback;
+  matchH = malloc(sizeof(int) * (b.hCount + 1));
+  matchV = malloc(sizeof(int) * (b.vCount + 1));
+  pickH = calloc(b.hCount + 1, 1);
+  pickV = malloc(b.vCount + 1);
+  if(!matchH || !matchV || !pickH || !pickV ||
+     matchChords(b.hCount, b.vCount, adjStart, adj, matchH, matchV) != 0 ||
+     pickChords(&b, adjStart, adj, matchH, matchV, pickH, pickV) != 0)
+    goto fallback;
+
+  // Cut along the chosen chords
+  for(ndx = 0; ndx < b.hCount; ndx++) {
+    chord *c = &b.hchords[ndx];
+    if(!pickH[ndx])
+      continue;
+    for(col = c->start; col < c->end; col++)
+      HM_SET(&b.hcut, c->line, col);
+    resolve(&b, c->line, c->start);
+    resolve(&b, c->line, c->end);
+  }
+  for(ndx = 0; ndx < b.vCount; ndx++) {
+    chord *c = &b.vchords[ndx];
+    if(!pickV[ndx])
+      continue;
+    for(row = c->start; row < c->end; row++)
+      HM_SET(&b.vcut, row, c->line);
+    resolve(&b, c->start, c->line);
+    resolve(&b, c->end, c->line);
+  }
+
+  // One cut per remaining concave corner
+  for(ndx = 0; ndx < b.cornerCount; ndx++)
+    if(!b.corners[ndx].resolved)
+      cutFrom(&b, &b.corners[ndx]);
+
+  extractRects(&b, list);
+  count = greedy.count;
+  goto done;
+
+  // Out of memory before any pixel is cleared: greedy rectangles instead
+fallback:
+  count = list->count;
+  greedyRects(hm, firstRow, lastRow, list);
+  count = list->count - count;
+
+done:
+  free(adjStart);
+  free(adj);
+  free(matchH);
+  free(matchV);
+  free(pickH);
+  free(pickV);
+  free(b.corners);
+  free(b.hchords);
+  free(b.vchords);
+  freeHeightmap(&b.hcut);
+  freeHeightmap(&b.vcut);
+  return count;
+}
@@ -0,0 +1,34 @@
+// Chris Polis
+// decompose.h - covering heightmap rows with rectangles for XY faces
+
+#ifndef __include_decompose
+#define __include_decompose
+
+#include "heightmap.h"
+
+// Pixel rectangle, columns [startCol, endCol) by rows [startRow, endRow)
+typedef struct rect_st {
+  int startCol, endCol, startRow, endRow;   // startRow < 0: merged away
+} rect;
+
+// Rectangles in order of their top left pixel (row, then column)
+typedef struct rect_list_st {
+  rect *rects;
+  int count, alloc;
+  int failed;                               // an append ran out of memory
+} rect_list;
+
+// Append a rectangle, dropped with failed set when out of memory
+void appendRect(rect_list *list, int startCol, int endCol, int startRow, int endRow);
+
+// Greedy rectangles over rows [firstRow, lastRow) of hm, grown downwards
+// but never past lastRow; covered bits are cleared
+void greedyRects(heightmap *hm, int firstRow, int lastRow, rect_list *list);
+
+// Near-minimal rectangles over rows [firstRow, lastRow) of hm from a
+// maximum set of non-crossing chords between concave corners; covered
+// bits are cleared. Returns # of rectangles greedyRects would have used.
+// Out of memory it falls back to greedyRects over the same rows
+int optimalRects(heightmap *hm, int firstRow, int lastRow, rect_list *list);
+
+#endif
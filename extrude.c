@@ -2,8 +2,11 @@
 // extrude.c - A tool for converting 2D images into 3D objects
 //
 // Usage: $ extrude [input file (.png)] [width(px)] [height(px)] [output (.stl)] [options]
+//        $ extrude --serve [socket] [--workers #]   Job server, see serve.c
 // Options: 
 //    --binary | --ascii                 STL output in binary or ASCII format
+//    --compact                          ASCII output with shortest numbers
+//    --quantized                        Compact indexed mesh for previews (convert expands it)
 //    --extrude | cut | sunken | relief  Extrusion type
 //    --width [#]                        STL object width
 //    --height [#]                       STL object height
@@ -12,6 +15,16 @@
 //    --addto [filename]                 Add to existing STL 
 //    --invert                           Invert black/white on 2D img 
 //    --flip                             Flip image horizontally
+//    --threads [#]                      Tiled extrusion on # threads (0: all cores)
+//    --optimal                          Near-minimal top/bottom rectangles
+//    --stream                           Extrude rows as read, O(width) memory
+//    --levels [#]                       Grayscale relief with # height levels
+//    --progressive                      1/8, 1/4, 1/2 previews as [output].lod#.stl first
+//    --cache [dir]                      Directory for cached meshes and templates
+//    --incremental                      Reuse cached faces of unchanged tiles
+//    --stats                            Per phase timings as a JSON line to stderr
+//    --stats=file                       Same, appended to file
+//    --data [#]                         Server jobs: # inline image bytes
 //
 // Examples:
 //  - generate iPhone 4 case:
@@ -24,35 +37,32 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "stl_util.h"
 #include "stl_io.h"
+#include "heightmap.h"
+#include "decompose.h"
+#include "png.h"
+#include "stl_thread.h"
+#include "meshcache.h"
+#include "extrude.h"
 
-#define TRI_ALLOC_SIZE 20000
-// Access 1D array as a 2D array
-#define DATA(r, c) (data[(r)*pxWidth + (c)])
+#define TILE_LINES 64           // wall lines / band rows per parallel task
+#define PROGRESSIVE_COARSEST 8  // first --progressive preview is 1/8 resolution
+#define CACHE_TILE 128          // --incremental tile size in pixels
+#define TEMPLATE_CACHE_VERSION 2 // .tpl entry layout, part of its key
 
 
-// Defaults
-stl_mode       output_mode                    = BINARY;
-extrusion_mode extrude_mode                   = EXTRUDE;
-int            invert                         = 0;
-int            flip                           = 0;
-float          depth                          = 10.0;
-float          width                          = 10.0;
-float          height                         = 10.0;
-float          base                           = 0.0;
-float          xScale                         = 1.0;
-float          yScale                         = 1.0;
-float          zScale                         = 1.0;
-char           *addTo                         = NULL;
-
 // Options
-static const char *optString = "yzecsrw:d:h:b:a:i:";
+static const char *optString = "yzecsrw:d:h:b:a:i:t:";
 static const struct option longOpts[] = {
     { "binary",  no_argument,       NULL, 'B' },
     { "ascii",   no_argument,       NULL, 'A' },
+    { "compact", no_argument,       NULL, 'C' },
+    { "quantized", no_argument,     NULL, 'Q' },
     { "extrude", no_argument,       NULL, 'e' },
     { "cut",     no_argument,       NULL, 'c' },
     { "sunken",  no_argument,       NULL, 's' },
@@ -64,331 +74,1599 @@ static const struct option longOpts[] = {
     { "addto",   required_argument, NULL, 'a' },
     { "invert",  no_argument,       NULL, 'i' },
     { "flip",    no_argument,       NULL, 'f' },
+    { "threads", required_argument, NULL, 't' },
+    { "optimal", no_argument,       NULL, 'o' },
+    { "stream",  no_argument,       NULL, 'S' },
+    { "levels",  required_argument, NULL, 'L' },
+    { "serve",   no_argument,       NULL, 'V' },
+    { "workers", required_argument, NULL, 'W' },
+    { "data",    required_argument, NULL, 'D' },
+    { "progressive", no_argument,   NULL, 'P' },
+    { "cache",   required_argument, NULL, 'K' },
+    { "incremental", no_argument,   NULL, 'I' },
+    { "stats",   optional_argument, NULL, 'T' },
     { NULL,      no_argument,       NULL, 0 }
 };
 
-void parseArgs(int argc, char *argv[]) {
+// Defaults
+void defaultOpts(extrude_opts *opts) {
+  opts->output_mode   = BINARY;
+  opts->number_format = ASCII_EXACT;
+  opts->extrude_mode  = EXTRUDE;
+  opts->invert        = 0;
+  opts->flip          = 0;
+  opts->depth         = 10.0;
+  opts->width         = 10.0;
+  opts->height        = 10.0;
+  opts->base          = 0.0;
+  opts->xScale        = 1.0;
+  opts->yScale        = 1.0;
+  opts->zScale        = 1.0;
+  opts->addTo         = NULL;
+  opts->threads       = 1;
+  opts->optimal       = 0;
+  opts->stream        = 0;
+  opts->levels        = 2;
+  opts->progressive   = 0;
+  opts->cacheDir      = NULL;
+  opts->incremental   = 0;
+  opts->serve         = 0;
+  opts->workers       = 4;
+  opts->dataBytes     = -1;
+  opts->stats         = NULL;
+  opts->statsFile     = NULL;
+}
+
+void parseArgs(extrude_opts *opts, int argc, char *argv[]) {
   int longIndex;
   int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
   while( opt != -1 ) {
     switch( opt ) {
-      case 'B': output_mode = BINARY; break;
-      case 'A': output_mode = ASCII;  break;
-      case 'e': extrude_mode = EXTRUDE; break;
-      case 'c': extrude_mode = CUT; break;
-      case 's': extrude_mode = SUNKEN; break;
-      case 'r': extrude_mode = RELIEF; break;
-      case 'w': width = atof(optarg); break;
-      case 'd': depth = atof(optarg); break;
-      case 'h': height = atof(optarg); break;
-      case 'b': base = atof(optarg); break;
-      case 'f': flip = 1; break;
+      case 'B': opts->output_mode = BINARY; break;
+      case 'A': opts->output_mode = ASCII;  break;
+      case 'C': opts->output_mode = ASCII; opts->number_format = ASCII_COMPACT; break;
+      case 'Q': opts->output_mode = QUANTIZED; break;
+      case 'e': opts->extrude_mode = EXTRUDE; break;
+      case 'c': opts->extrude_mode = CUT; break;
+      case 's': opts->extrude_mode = SUNKEN; break;
+      case 'r': opts->extrude_mode = RELIEF; break;
+      case 'w': opts->width = atof(optarg); break;
+      case 'd': opts->depth = atof(optarg); break;
+      case 'h': opts->height = atof(optarg); break;
+      case 'b': opts->base = atof(optarg); break;
+      case 'f': opts->flip = 1; break;
       case 'a':
-         addTo = malloc(sizeof(char) * (strlen(optarg) + 1));
-        strcpy(addTo, optarg);
+        free(opts->addTo);
+        opts->addTo = malloc(sizeof(char) * (strlen(optarg) + 1));
+        strcpy(opts->addTo, optarg);
+        break;
+      case 'i': opts->invert = 1; break;
+      case 't': opts->threads = atoi(optarg); break;
+      case 'o': opts->optimal = 1; break;
+      case 'S': opts->stream = 1; break;
+      case 'L': opts->levels = atoi(optarg) < 2 ? 2 : atoi(optarg) > 256 ? 256 : atoi(optarg); break;
+      case 'P': opts->progressive = 1; break;
+      case 'K':
+        free(opts->cacheDir);
+        opts->cacheDir = malloc(sizeof(char) * (strlen(optarg) + 1));
+        strcpy(opts->cacheDir, optarg);
         break;
-      case 'i': invert = 1; break;
+      case 'I': opts->incremental = 1; break;
+      case 'T':
+        if(!opts->stats)
+          opts->stats = malloc(sizeof(extrude_stats));
+        free(opts->statsFile);
+        opts->statsFile = NULL;
+        if(optarg) {
+          opts->statsFile = malloc(sizeof(char) * (strlen(optarg) + 1));
+          strcpy(opts->statsFile, optarg);
+        }
+        break;
+      case 'V': opts->serve = 1; break;
+      case 'W': opts->workers = atoi(optarg); break;
+      case 'D': opts->dataBytes = atol(optarg); break;
       default: break;
     }        
     opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
   }
 }
 
-void printState(char *dest, char *source, int iWidth, int iHeight) {
+// Release strings parseArgs allocated
+void freeOpts(extrude_opts *opts) {
+  free(opts->addTo);
+  free(opts->cacheDir);
+  free(opts->stats);
+  free(opts->statsFile);
+  opts->addTo = opts->cacheDir = opts->statsFile = NULL;
+  opts->stats = NULL;
+}
+
+// Object size defaults to the image size, then per pixel scale
+void scaleOpts(extrude_opts *opts, int imgWidth, int imgHeight) {
+  opts->width = (opts->width == 10.0) ? imgWidth : opts->width;
+  opts->height = (opts->height == 10.0) ? imgHeight : opts->height;
+  opts->zScale = opts->depth;
+  opts->xScale = opts->width / imgWidth;
+  opts->yScale = opts->height / imgHeight;
+}
+
+void printState(const extrude_opts *opts, char *dest, char *source, int iWidth, int iHeight) {
   printf("********** EXTRUDING **********\n"); 
   printf("source (png or hmp): %s (%dx%d)\n", source, iWidth, iHeight);
-  printf("invert source      : %s\n", invert ? "true" : "false");
-  printf("template (stl)     : %s\n", addTo ? addTo : "none");
-  printf("dest (stl)         : %s (%s)\n", dest, (output_mode == ASCII ? "ASCII" : "Binary"));
-  printf("extrusion type     : %s\n", extrusionModeString(extrude_mode));
-  printf("output dimensions  : %f x %f x %f(+ %f base)\n", width, height, depth, base);
-  printf("dimension scaling  : x: %f y: %f z: %f\n", xScale, yScale, zScale);
+  printf("invert source      : %s\n", opts->invert ? "true" : "false");
+  printf("template (stl)     : %s\n", opts->addTo ? opts->addTo : "none");
+  printf("dest (stl)         : %s (%s)\n", dest, (opts->output_mode == ASCII ? "ASCII" :
+                                                    opts->output_mode == QUANTIZED ? "Quantized" : "Binary"));
+  printf("extrusion type     : %s\n", extrusionModeString(opts->extrude_mode));
+  printf("height levels      : %d\n", opts->levels);
+  printf("output dimensions  : %f x %f x %f(+ %f base)\n", opts->width, opts->height, opts->depth, opts->base);
+  printf("dimension scaling  : x: %f y: %f z: %f\n", opts->xScale, opts->yScale, opts->zScale);
 }
 
 // copy STL data from template into output file, return tri count
-int copyTemplate(FILE *out, char *filename) {
-  FILE *template = fopen(filename, "r");
-  int triCount, ndx;
+int copyTemplate(stl_writer *out, char *filename) {
+  FILE *template;
+  int triCount = 0;
+  const unsigned char *rec;
+  stl_view view;
+  stl_parser parser;
+  stl_view_iter it;
   stl_tri tempTri;
 
-  if(!filename)
+  if(!filename || !(template = fopen(filename, "r")))
     return 0;
 
   if(getFileMode(template) == ASCII) {
-    readASCIIHeader(template);
-    while(readTriASCII(template, &tempTri)) {
-      if(output_mode == ASCII)
-        writeTriASCII(out, &tempTri);
-      else
-        writeTriBin(out, &tempTri);
+    openParser(&parser, template);
+    while(parseTriASCII(&parser, &tempTri)) {
+      writerTri(out, &tempTri);
       triCount++;
     }
+    closeParser(&parser);
 
-  } else {
-    triCount = readBinaryHeader(template);
-    for(ndx = 0; ndx < triCount; ndx++) {
-      readTriBin(template, &tempTri);
-      if(output_mode == ASCII)
-        writeTriASCII(out, &tempTri);
-      else
-        writeTriBin(out, &tempTri);
+  } else if(openView(&view, template) == 0) {
+    triCount = view.triCount;
+    it = viewRange(&view, 0, triCount);
+    while((rec = viewNext(&it))) {
+      unpackTriBin(rec, &tempTri);
+      writerTri(out, &tempTri);
     }
+    closeView(&view);
   }
   fclose(template);
   return triCount;
 }
 
-void parsePNG(FILE *png, char *data, int size, int invert) {
+// Template through --cache dir: encoded in the output format once per
+// path, mtime, size and format (.tpl entry: tri count and byte count as
+// uint64, then the encoded triangles), then spliced into out. An entry
+// whose size does not match its header is removed and the template is
+// copied instead -> tri count, -1 when splicing into out fails
+int cachedTemplate(stl_writer *out, const extrude_opts *opts) {
+  char name[4096], temp[4096 + 32];
+  int64_t stamp[4];
+  uint64_t head[2] = { 0, 0 };    // tri count, encoded bytes
+  stl_writer encoder;
+  struct stat st;
+  uint64_t key;
+  FILE *entry;
+  int encoded, triCount;
 
+  if(!opts->addTo || stat(opts->addTo, &st) != 0 || openCacheDir(opts->cacheDir) != 0)
+    return copyTemplate(out, opts->addTo);
+  stamp[0] = st.st_mtim.tv_sec;
+  stamp[1] = st.st_mtim.tv_nsec;
+  stamp[2] = st.st_size;
+  stamp[3] = TEMPLATE_CACHE_VERSION << 16 | opts->output_mode << 8 | opts->number_format;
+  key = hashBytes(CACHE_HASH_SEED, opts->addTo, strlen(opts->addTo));
+  key = hashBytes(key, stamp, sizeof(stamp));
+  cacheEntryName(name, sizeof(name), opts->cacheDir, key, ".tpl");
+
+  // Miss: encode through a writer like the output's
+  if(!(entry = openCacheEntry(name)) && (entry = createCacheEntry(name, temp, sizeof(temp)))) {
+    fwrite(head, sizeof(head), 1, entry);
+    encoded = initWriter(&encoder, entry, opts->output_mode) == 0;
+    if(encoded) {
+      encoder.format = opts->number_format;
+      head[0] = copyTemplate(&encoder, opts->addTo);
+    }
+    freeWriter(&encoder);
+    head[1] = encoder.bytes;
+    rewind(entry);
+    fwrite(head, sizeof(head), 1, entry);
+    commitCacheEntry(entry, temp, name, encoded && (encoder.bytes > 0 || head[0] == 0));
+    trimCache(opts->cacheDir, CACHE_MAX_BYTES);
+    entry = fopen(name, "r");
+  }
+  if(!entry)
+    return copyTemplate(out, opts->addTo);
+
+  // Truncated or corrupt entry: drop it before anything reaches out
+  if(fread(head, sizeof(head), 1, entry) != 1 || fstat(fileno(entry), &st) != 0 ||
+     (uint64_t)st.st_size != sizeof(head) + head[1] || head[0] > INT32_MAX ||
+     (opts->output_mode == BINARY && head[1] != head[0] * STL_RECORD_SIZE)) {
+    printf("Bad template cache entry %s, removed\n", name);
+    fclose(entry);
+    unlink(name);
+    return copyTemplate(out, opts->addTo);
+  }
+
+  triCount = head[0];
+  if(writerSplice(out, fileno(entry), sizeof(head), head[1]) != 0) {
+    printf("Could not copy template cache entry %s\n", name);
+    triCount = -1;
+  }
+  fclose(entry);
+  return triCount;
 }
 
-void parseHMP(FILE *hmp, char *data, int size, int invert, int iWidth) {
-  int ndx;
-  fread(data, 1, size, hmp);
+// Apply --flip and --invert to one row
+void rowOptions(const extrude_opts *opts, uint64_t *bits, int width) {
+  if(opts->flip)
+    flipRow(bits, width);
+  if(opts->invert)
+    invertRow(bits, width);
+}
 
-  for(ndx = 0; ndx < size; ndx++)
-    data[ndx] = (data[ndx] == '0') ? 0 : 1;
+// Decode PNG scanlines into the bitmap, thresholded, flip and invert
+// applied per row. Image is cropped/padded to the map size, png is the
+// caller's decoder state -> 0 on success, -1 if the PNG can't be opened
+// or a scanline is corrupt
+int parsePNG(const extrude_opts *opts, FILE *file, png_reader *png, heightmap *hm) {
+  int row, result = 0;
 
-  if(flip) {
-    printf("flipping...\n");
-    char *newData = (char*)malloc(sizeof(char) * size);
-    for(ndx = 0; ndx < size; ndx++) {
-      //int revNdx = (iWidth - (ndx % iWidth) - 1) + (iWidth * (ndx / iWidth);
-      newData[ndx] = data[(iWidth - (ndx % iWidth) - 1) + (iWidth * (ndx / iWidth))];
-    }
-    data = newData;
+  if(openPNG(png, file) != 0)
+    return -1;
+  if(png->width != hm->width || png->height != hm->height)
+    printf("warning: PNG is %dx%d, extruding %dx%d\n", png->width, png->height, hm->width, hm->height);
+
+  // Rows past a shorter image stay clear
+  for(row = 0; row < hm->height && row < png->height && result == 0; row++)
+    if((result = readPNGRow(png, HM_ROW(hm, row), hm->width)) == 0)
+      rowOptions(opts, HM_ROW(hm, row), hm->width);
+  closePNG(png);
+  return result;
+}
+
+// Read one text row of width characters, return # read
+int readHMPLine(FILE *hmp, char *line, int width) {
+  int col, filled, got, kept;
+
+  // Line breaks are optional and skipped
+  for(filled = 0; filled < width; filled = kept) {
+    if((got = fread(line + filled, 1, width - filled, hmp)) == 0)
+      break;
+    for(col = kept = filled; col < filled + got; col++)
+      if(line[col] != '\n' && line[col] != '\r')
+        line[kept++] = line[col];
   }
+  return filled;
 }
 
-void invertData(char *data, int size) {
-  int ndx;
-  for(ndx = 0; ndx < size; ndx++)
-    data[ndx] = (data[ndx] == 0) ? 1 : 0;
+// Read one '0'/'1' text row into bits, flip and invert applied
+void readHMPRow(const extrude_opts *opts, FILE *hmp, char *line, uint64_t *bits, int width) {
+  int col, filled = readHMPLine(hmp, line, width);
+
+  memset(bits, 0, sizeof(uint64_t) * WORDS_FOR(width));
+  for(col = 0; col < filled; col++)
+    if(line[col] != '0')
+      bits[col >> 6] |= 1ULL << (col & 63);
+  rowOptions(opts, bits, width);
 }
 
-int addBase(FILE *out) {
-  if(base == 0.0f)
-    return 0;
+// Read '0'/'1' text into the bitmap row by row
+void parseHMP(const extrude_opts *opts, FILE *hmp, heightmap *hm) {
+  char *line = malloc(hm->width);
+  int row;
 
-  stl_tri tris[12];
-  float root[3] = { 0.0f, 0.0f, 0.0f };
-  createRectPrism(&tris, root, width, height, base);
-  if(output_mode == BINARY)
-    writeTriArrayBin(out, 12, &tris);
-  else
-    writeTriArrayASCII(out, 12, &tris);
-  return 4;
+  if(opts->flip)
+    printf("flipping...\n");
+
+  for(row = 0; row < hm->height; row++)
+    readHMPRow(opts, hmp, line, HM_ROW(hm, row), hm->width);
+  free(line);
 }
 
-void writeFace(FILE *out, stl_tri *tris) {
-  if(output_mode == BINARY) {
-    writeTriBin(out, &tris[0]);
-    writeTriBin(out, &tris[1]);
+// Read one row of levels 0..levels-1: .hmp digits or PNG darkness split
+// into equal steps, flip and invert applied. Rows past a shorter PNG are
+// clear -> 0 on success, -1 on a corrupt PNG row
+int readLevelRow(const extrude_opts *opts, FILE *in, png_reader *png, char *line, unsigned char *level, int width) {
+  int col, filled, swap;
+
+  memset(level, 0, width);
+  if(png) {
+    if(png->row >= png->height)
+      memset(line, 0, width);
+    else if(readPNGInk(png, (unsigned char *)line, width) != 0)
+      return -1;
+    for(col = 0; col < width; col++)
+      level[col] = (unsigned char)line[col] * opts->levels / 256;
   } else {
-    writeTriASCII(out, &tris[0]);
-    writeTriASCII(out, &tris[1]);
+    filled = readHMPLine(in, line, width);
+    for(col = 0; col < filled; col++)
+      if(line[col] > '0' && line[col] <= '9')
+        level[col] = line[col] - '0' < opts->levels ? line[col] - '0' : opts->levels - 1;
   }
+
+  for(col = 0; opts->flip && col < width / 2; col++) {
+    swap = level[col];
+    level[col] = level[width - 1 - col];
+    level[width - 1 - col] = swap;
+  }
+  for(col = 0; opts->invert && col < width; col++)
+    level[col] = opts->levels - 1 - level[col];
+  return 0;
+}
+
+// Read the image into levels - 1 planes, plane k-1 holding the pixels at
+// level k or above -> 0 on success, -1 on failure
+int parseLevels(const extrude_opts *opts, FILE *in, int isPNG, heightmap *planes) {
+  int width = planes[0].width, row, col, k, result = 0;
+  unsigned char *level = malloc(width);
+  char *line = malloc(width);
+  png_reader *png = NULL;
+
+  if(!level || !line || (isPNG && !(png = malloc(sizeof(png_reader))))) {
+    printf("Could not allocate %d pixel level rows\n", width);
+    result = -1;
+  } else if(isPNG) {
+    if(openPNG(png, in) != 0)
+      result = -1;
+    else if(png->width != width || png->height != planes[0].height)
+      printf("warning: PNG is %dx%d, extruding %dx%d\n", png->width, png->height, width, planes[0].height);
+  }
+
+  for(row = 0; result == 0 && row < planes[0].height; row++) {
+    if((result = readLevelRow(opts, in, png, line, level, width)) != 0)
+      break;
+    for(col = 0; col < width; col++)
+      for(k = 1; k <= level[col]; k++)
+        HM_SET(&planes[k-1], row, col);
+  }
+
+  if(png) {
+    closePNG(png);
+    free(png);
+  }
+  free(level);
+  free(line);
+  return result;
 }
 
-void writeYZFace(FILE *out, stl_tri *tris, int col, int startRow, int endRow, float *normal) {
-  float tempA[3] = { col * xScale, startRow * yScale, base };
-  float tempB[3] = { col * xScale, endRow * yScale, base + zScale };
+// Base prism under the object -> # of triangles, -1 on failure
+int addBase(const extrude_opts *opts, stl_writer *out) {
+  tri_builder base = TRI_BUILDER_INIT;
+  float root[3] = { 0.0f, 0.0f, 0.0f };
+  int triCount;
+
+  if(opts->base == 0.0f)
+    return 0;
+  appendRectPrism(&base, root, opts->width, opts->height, opts->base);
+  if((triCount = writeBuilder(out, &base)) < 0)
+    printf("Could not allocate base triangles\n");
+  freeBuilder(&base);
+  return triCount;
+}
+
+void writeYZFace(tri_buffer *out, int col, int startRow, int endRow, float z0, float z1, float *normal) {
+  const extrude_opts *opts = out->opts;
+  float tempA[3] = { col * opts->xScale, startRow * opts->yScale, opts->base + z0 };
+  float tempB[3] = { col * opts->xScale, endRow * opts->yScale, opts->base + z1 };
                 
-  createYZFace(tris, tempA, tempB, normal);
-  writeFace(out, tris);
+  appendYZFace(&out->mesh, tempA, tempB, normal);
 }
-void writeXZFace(FILE *out, stl_tri *tris, int row, int startCol, int endCol, float *normal) {
-  float tempA[3] = { startCol * xScale, row * yScale, base };
-  float tempB[3] = { endCol * xScale, row * yScale, base + zScale };
+void writeXZFace(tri_buffer *out, int row, int startCol, int endCol, float z0, float z1, float *normal) {
+  const extrude_opts *opts = out->opts;
+  float tempA[3] = { startCol * opts->xScale, row * opts->yScale, opts->base + z0 };
+  float tempB[3] = { endCol * opts->xScale, row * opts->yScale, opts->base + z1 };
                 
-  createXZFace(tris, tempA, tempB, normal);
-  writeFace(out, tris);
+  appendXZFace(&out->mesh, tempA, tempB, normal);
 }
-void writeXYFace(FILE *out, stl_tri *tris, int startCol, int endCol, int startRow, int endRow, float z, float *normal) {
-  float tempA[3] = { startCol * xScale, startRow * yScale, base + z };
-  float tempB[3] = { endCol * xScale, endRow * yScale, base + z };
+void writeXYFace(tri_buffer *out, int startCol, int endCol, int startRow, int endRow, float z, float *normal) {
+  const extrude_opts *opts = out->opts;
+  float tempA[3] = { startCol * opts->xScale, startRow * opts->yScale, opts->base + z };
+  float tempB[3] = { endCol * opts->xScale, endRow * opts->yScale, opts->base + z };
                 
-  createXYFace(tris, tempA, tempB, normal);
-  writeFace(out, tris);
+  appendXYFace(&out->mesh, tempA, tempB, normal);
+}
+
+
+typedef void (*wall_fn)(tri_buffer *out, int line, int start, int end, float z0, float z1, float *normal);
+
+// Walls along one pixel boundary from the XOR of the bit lines on either
+// side, from z0 up to z1: lowOnly runs face highNormal, highOnly runs face
+// lowNormal. Runs are emitted in order of position, returns # of triangles
+int writeWalls(tri_buffer *out, const uint64_t *low, const uint64_t *high,
+               uint64_t *lowOnly, uint64_t *highOnly, int bitCount, int line,
+               float z0, float z1, wall_fn wall, float *highNormal, float *lowNormal) {
+  int word, words = WORDS_FOR(bitCount), triCount = 0;
+  int lowStart, lowEnd, highStart, highEnd, haveLow, haveHigh;
+  uint64_t diff = 0;
+
+  for(word = 0; word < words; word++) {
+    uint64_t edge = low[word] ^ high[word];
+    lowOnly[word] = edge & low[word];
+    highOnly[word] = edge & high[word];
+    diff |= edge;
+  }
+  if(!diff)
+    return 0;
+
+  haveLow = nextRun(lowOnly, bitCount, 0, &lowStart, &lowEnd);
+  haveHigh = nextRun(highOnly, bitCount, 0, &highStart, &highEnd);
+  while(haveLow || haveHigh) {
+    if(haveLow && (!haveHigh || lowStart < highStart)) {
+      wall(out, line, lowStart, lowEnd, z0, z1, highNormal);
+      haveLow = nextRun(lowOnly, bitCount, lowEnd, &lowStart, &lowEnd);
+    } else {
+      wall(out, line, highStart, highEnd, z0, z1, lowNormal);
+      haveHigh = nextRun(highOnly, bitCount, highEnd, &highStart, &highEnd);
+    }
+    triCount += 2;
+  }
+  return triCount;
+}
+
+// Walls between lines first..last-1 and the line after each: columns of
+// the transposed map give YZ faces, rows of hm give XZ faces, z0 to z1.
+// A non-NULL flushTo drains out every TRI_ALLOC_SIZE tris, returns # of triangles;
+// if the edge masks can't be allocated out's builder is marked failed
+int writeWallLines(tri_buffer *out, stl_writer *flushTo, heightmap *lines, int first, int last,
+                   int yz, float z0, float z1) {
+  uint64_t *lowOnly = malloc(sizeof(uint64_t) * lines->rowWords);
+  uint64_t *highOnly = malloc(sizeof(uint64_t) * lines->rowWords);
+  int line, triCount = 0;
+
+  if(!lowOnly || !highOnly) {
+    out->mesh.failed = 1;
+    last = first;
+  }
+  for(line = first; line < last; line++) {
+    if(yz)
+      triCount += writeWalls(out, HM_ROW(lines, line), HM_ROW(lines, line+1), lowOnly, highOnly,
+                             lines->width, line+1, z0, z1, writeYZFace, V_PX, V_NX);
+    else
+      triCount += writeWalls(out, HM_ROW(lines, line), HM_ROW(lines, line+1), lowOnly, highOnly,
+                             lines->width, line+1, z0, z1, writeXZFace, V_PY, V_NY);
+    if(flushTo && out->mesh.count >= TRI_ALLOC_SIZE)
+      writeBuilder(flushTo, &out->mesh);
+  }
+  free(lowOnly);
+  free(highOnly);
+  return triCount;
+}
+
+// Report rectangles/triangles saved over the greedy scan
+void reportOptimal(rect_list *lists, int listCount, int greedyCount) {
+  int ndx, r, count = 0;
+
+  for(ndx = 0; ndx < listCount; ndx++)
+    for(r = 0; r < lists[ndx].count; r++)
+      count += lists[ndx].rects[r].startRow >= 0;
+  printf("optimal tops       : %d rectangles (greedy %d), %d triangles saved\n",
+         count, greedyCount, (greedyCount - count) * 4);
 }
 
+// One face at height z per live rectangle, returns # of triangles
+int writeRectLayer(tri_buffer *out, stl_writer *flushTo, rect_list *list, float z, float *normal) {
+  int ndx, triCount = 0;
+
+  for(ndx = 0; ndx < list->count; ndx++) {
+    rect *r = &list->rects[ndx];
+    if(r->startRow < 0)
+      continue;
+    writeXYFace(out, r->startCol, r->endCol, r->startRow, r->endRow, z, normal);
+    triCount += 2;
+    if(flushTo && out->mesh.count >= TRI_ALLOC_SIZE)
+      writeBuilder(flushTo, &out->mesh);
+  }
+  return triCount;
+}
 
-// Extrude heightmap(data), return # of triangles
-int simpleExtrude(FILE *out, char *data, int pxWidth, int pxHeight) {
-  int ndx, zCol, zRow, colNdx, rowNdx, startRow, endRow, startCol, endCol;
+// Bottom and top faces of each live rectangle, returns # of triangles
+int writeRects(tri_buffer *out, stl_writer *flushTo, rect_list *list) {
+  int ndx, triCount = 0;
+
+  for(ndx = 0; ndx < list->count; ndx++) {
+    rect *r = &list->rects[ndx];
+    if(r->startRow < 0)
+      continue;
+    writeXYFace(out, r->startCol, r->endCol, r->startRow, r->endRow, 0.0f, V_NZ);
+    writeXYFace(out, r->startCol, r->endCol, r->startRow, r->endRow, out->opts->zScale, V_PZ);
+    triCount += 4;
+    if(flushTo && out->mesh.count >= TRI_ALLOC_SIZE)
+      writeBuilder(flushTo, &out->mesh);
+  }
+  return triCount;
+}
+
+// Extrude heightmap, return # of triangles, -1 on failure (clears hm)
+int simpleExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm) {
   int triCount = 0;
-  stl_tri *tempTris = malloc(sizeof(stl_tri) * 2);
+  tri_buffer buf = { TRI_BUILDER_INIT, opts };
+  rect_list rects = { NULL, 0, 0 };
+  heightmap cols;
+  int passTris;
 
-  // Check Y borders -> generate YZ faces
-  for(colNdx = 0; colNdx < (pxWidth - 1); colNdx++) {
-    rowNdx = 0;
-  
-    while(rowNdx < pxHeight) {
-      if(DATA(rowNdx, colNdx) && !DATA(rowNdx, colNdx+1)) { //1|0
-        startRow = rowNdx;
-        endRow = rowNdx++;
-        while(DATA(rowNdx, colNdx) && !DATA(rowNdx, colNdx+1))
-          endRow = rowNdx++;
-        
-        writeYZFace(out, tempTris, (colNdx+1), startRow, endRow+1, V_PX);
-        triCount += 2;
-
-      } else if(!DATA(rowNdx, colNdx) && DATA(rowNdx, colNdx+1)) { //0|1
-        startRow = rowNdx;
-        endRow = rowNdx++;
-        while(!DATA(rowNdx, colNdx) && DATA(rowNdx, colNdx+1)) //0|1
-          endRow = rowNdx++;
-        
-        writeYZFace(out, tempTris, (colNdx+1), startRow, endRow+1, V_NX);
-        triCount += 2;
+  // Check Y borders -> generate YZ faces, column against next column
+  beginPhase(opts->stats, out);
+  if(transposeHeightmap(hm, &cols) != 0) {
+    printf("Could not allocate %dx%d transposed heightmap\n", hm->height, hm->width);
+    return -1;
+  }
+  triCount += passTris = writeWallLines(&buf, out, &cols, 0, hm->width - 1, 1, 0.0f, opts->zScale);
+  freeHeightmap(&cols);
+  writeBuilder(out, &buf.mesh);   // every pass's bytes are counted in its own phase
+  endPhase(opts->stats, PHASE_YZ, out, passTris, passTris / 2);
+
+  // Check X borders -> generate XZ faces, row against next row
+  triCount += passTris = writeWallLines(&buf, out, hm, 0, hm->height - 1, 0, 0.0f, opts->zScale);
+  writeBuilder(out, &buf.mesh);
+  endPhase(opts->stats, PHASE_XZ, out, passTris, passTris / 2);
+
+  // Check top/bottom -> generate XY faces
+  if(opts->optimal)
+    reportOptimal(&rects, 1, optimalRects(hm, 0, hm->height, &rects));
+  else
+    greedyRects(hm, 0, hm->height, &rects);
+  triCount += passTris = writeRects(&buf, out, &rects);
+  writeBuilder(out, &buf.mesh);
+  endPhase(opts->stats, PHASE_XY, out, passTris, passTris / 4);
+
+  if(buf.mesh.failed || rects.failed) {
+    printf("Could not allocate %s\n", rects.failed ? "top rectangles" : "triangles");
+    triCount = -1;
+  }
+  free(rects.rects);
+  freeBuilder(&buf.mesh);
+  return triCount;
+}
+
+typedef struct extrude_job_st {
+  const extrude_opts *opts;
+  heightmap *hm, *cols;
+  tri_buffer *bufs;             // one per task, written in task order
+  rect_list *bands;             // rectangles per row band
+  int *greedy;                  // greedy rectangle count per band, --optimal
+} extrude_job;
+
+void yzWallTask(void *ctx, int ndx) {
+  extrude_job *job = ctx;
+  int last = (ndx + 1) * TILE_LINES < job->cols->height - 1 ? (ndx + 1) * TILE_LINES : job->cols->height - 1;
+  writeWallLines(&job->bufs[ndx], NULL, job->cols, ndx * TILE_LINES, last, 1, 0.0f, job->opts->zScale);
+}
+
+void xzWallTask(void *ctx, int ndx) {
+  extrude_job *job = ctx;
+  int last = (ndx + 1) * TILE_LINES < job->hm->height - 1 ? (ndx + 1) * TILE_LINES : job->hm->height - 1;
+  writeWallLines(&job->bufs[ndx], NULL, job->hm, ndx * TILE_LINES, last, 0, 0.0f, job->opts->zScale);
+}
+
+void bandTask(void *ctx, int ndx) {
+  extrude_job *job = ctx;
+  int last = (ndx + 1) * TILE_LINES < job->hm->height ? (ndx + 1) * TILE_LINES : job->hm->height;
+  if(job->opts->optimal)
+    job->greedy[ndx] = optimalRects(job->hm, ndx * TILE_LINES, last, &job->bands[ndx]);
+  else
+    greedyRects(job->hm, ndx * TILE_LINES, last, &job->bands[ndx]);
+}
+
+int compareStartCol(const void *a, const void *b) {
+  return (*(rect **)a)->startCol - (*(rect **)b)->startCol;
+}
+
+// Join rectangles ending on seamRow in upper with ones of the same columns
+// starting there in lower; the lower one takes over, the upper is dropped
+// -> 0 on success
+int mergeSeam(rect_list *upper, rect_list *lower, int seamRow) {
+  rect **ending = malloc(sizeof(rect *) * (upper->count + 1));
+  int ndx, count = 0, low = 0;
+
+  if(!ending)
+    return -1;
+  for(ndx = 0; ndx < upper->count; ndx++)
+    if(upper->rects[ndx].startRow >= 0 && upper->rects[ndx].endRow == seamRow)
+      ending[count++] = &upper->rects[ndx];
+  qsort(ending, count, sizeof(rect *), compareStartCol);
+
+  // Rectangles starting on the seam come first in lower, in column order
+  for(ndx = 0; ndx < count && low < lower->count && lower->rects[low].startRow == seamRow; ) {
+    rect *up = ending[ndx], *down = &lower->rects[low];
+    if(up->startCol < down->startCol)
+      ndx++;
+    else if(down->startCol < up->startCol)
+      low++;
+    else {
+      if(up->endCol == down->endCol) {
+        down->startRow = up->startRow;
+        up->startRow = -1;
       }
-      rowNdx++;
+      ndx++;
+      low++;
     }
   }
+  free(ending);
+  return 0;
+}
+
+// Extrude heightmap split into TILE_LINES wide tasks on worker threads.
+// Output only depends on the tiling, not on the thread count; -1 on
+// failure (clears hm)
+int parallelExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm, int threads) {
+  int ndx, tasks, failed = 0, triCount = 0, passTris = 0;
+  int maxTasks = (hm->width > hm->height ? hm->width : hm->height) / TILE_LINES + 1;
+  heightmap cols;
+  extrude_job job;
+
+  // YZ walls in column tiles
+  beginPhase(opts->stats, out);
+  if(transposeHeightmap(hm, &cols) != 0) {
+    printf("Could not allocate %dx%d transposed heightmap\n", hm->height, hm->width);
+    return -1;
+  }
 
-  // Check X borders -> generate XZ faces
-  for(rowNdx = 0; rowNdx < (pxHeight - 1); rowNdx++) {
-    colNdx = 0;
-  
-    while(colNdx < pxWidth) {
-      if(DATA(rowNdx, colNdx) && !DATA(rowNdx+1, colNdx)) { //1/0
-        startCol = colNdx;
-        endCol = colNdx++;
-        while(DATA(rowNdx, colNdx) && !DATA(rowNdx+1, colNdx)) {
-          endCol = colNdx++;
-        }
-        writeXZFace(out, tempTris, rowNdx+1, startCol, endCol+1, V_PY);
-        triCount += 2;
-
-      } else if(!DATA(rowNdx, colNdx) && DATA(rowNdx+1, colNdx)) { //0/1
-        startCol = colNdx;
-        endCol = colNdx++;
-        while(!DATA(rowNdx, colNdx) && DATA(rowNdx+1, colNdx)) { //0/1
-          endCol = colNdx++;
-        }
-        writeXZFace(out, tempTris, rowNdx+1, startCol, endCol+1, V_NY);
-        triCount += 2;
-      }
-      colNdx++;
+  job.opts = opts;
+  job.hm = hm;
+  job.cols = &cols;
+  job.bufs = calloc(maxTasks, sizeof(tri_buffer));
+  job.bands = calloc(maxTasks, sizeof(rect_list));
+  job.greedy = calloc(maxTasks, sizeof(int));
+  if(!job.bufs || !job.bands || !job.greedy) {
+    printf("Could not allocate %d task buffers\n", maxTasks);
+    freeHeightmap(&cols);
+    free(job.bufs);
+    free(job.bands);
+    free(job.greedy);
+    return -1;
+  }
+  for(ndx = 0; ndx < maxTasks; ndx++)
+    job.bufs[ndx].opts = opts;
+
+  tasks = (hm->width - 1 + TILE_LINES - 1) / TILE_LINES;
+  runTasks(threads, tasks, yzWallTask, &job);
+  for(ndx = 0; ndx < tasks; ndx++)
+    passTris += writeBuilder(out, &job.bufs[ndx].mesh);
+  freeHeightmap(&cols);
+  endPhase(opts->stats, PHASE_YZ, out, passTris, passTris / 2);
+  triCount += passTris;
+
+  // XZ walls in row tiles
+  tasks = (hm->height - 1 + TILE_LINES - 1) / TILE_LINES;
+  runTasks(threads, tasks, xzWallTask, &job);
+  for(ndx = 0, passTris = 0; ndx < tasks; ndx++)
+    passTris += writeBuilder(out, &job.bufs[ndx].mesh);
+  endPhase(opts->stats, PHASE_XZ, out, passTris, passTris / 2);
+  triCount += passTris;
 
+  // XY faces per row band, rectangles joined across the band seams
+  tasks = (hm->height + TILE_LINES - 1) / TILE_LINES;
+  runTasks(threads, tasks, bandTask, &job);
+  for(ndx = 1; ndx < tasks; ndx++)
+    if(mergeSeam(&job.bands[ndx-1], &job.bands[ndx], ndx * TILE_LINES) != 0 && !failed) {
+      printf("Could not allocate band seam\n");
+      failed = 1;
     }
+  if(opts->optimal) {
+    for(ndx = 1; ndx < tasks; ndx++)
+      job.greedy[0] += job.greedy[ndx];
+    reportOptimal(job.bands, tasks, job.greedy[0]);
   }
+  for(ndx = 0, passTris = 0; ndx < tasks; ndx++) {
+    if(job.bands[ndx].failed && !failed) {
+      printf("Could not allocate top rectangles\n");
+      failed = 1;
+    }
+    passTris += writeRects(&job.bufs[0], out, &job.bands[ndx]);
+    writeBuilder(out, &job.bufs[0].mesh);
+    free(job.bands[ndx].rects);
+  }
+  endPhase(opts->stats, PHASE_XY, out, passTris, passTris / 4);
+  triCount += passTris;
 
-  // Check top/bottom -> generate XY faces
-  for(rowNdx = 0; rowNdx < pxHeight; rowNdx++) {
-    colNdx = 0;
-    while(colNdx < pxWidth) {
-      if(DATA(rowNdx,colNdx) == 1) {
-        startCol = colNdx;
-        endCol = colNdx;
-        startRow = rowNdx;
-        endRow = rowNdx;
-
-        // try to extend in x direction
-        colNdx++;
-        while(colNdx < pxWidth && DATA(rowNdx, colNdx))
-          endCol = colNdx++;
-
-        // try to extend in y direction
-        while((endRow + 1) < pxHeight) {
-          int allOnes = 1;
-          for(ndx = startCol; ndx <= endCol; ndx++) {
-            if(!DATA((endRow + 1), ndx)) {
-              allOnes = 0;
-              break;
-            }
-          }
-          if(allOnes)
-            endRow++;
-          else
-            break;
-        }
+  for(ndx = 0; ndx < maxTasks; ndx++) {
+    if(job.bufs[ndx].mesh.failed && !failed) {
+      printf("Could not allocate %d triangles\n", TRI_ALLOC_SIZE);
+      failed = 1;
+    }
+    freeBuilder(&job.bufs[ndx].mesh);
+  }
+  free(job.bufs);
+  free(job.bands);
+  free(job.greedy);
+  return failed ? -1 : triCount;
+}
+
+// Column boundaries [1, width) of row bits where only the left pixel
+// (leftOnly) or only the right pixel (rightOnly) is set
+void columnEdges(const uint64_t *bits, int width, uint64_t *leftOnly, uint64_t *rightOnly) {
+  int word, words = WORDS_FOR(width);
+
+  for(word = 0; word < words; word++) {
+    uint64_t shifted = (bits[word] << 1) | (word ? bits[word-1] >> 63 : 0);
+    uint64_t mask = ~0ULL;
+    if(word == 0)
+      mask &= ~1ULL;
+    if(((word + 1) << 6) > width)
+      mask &= (1ULL << (width & 63)) - 1;
+    leftOnly[word] = shifted & ~bits[word] & mask;
+    rightOnly[word] = ~shifted & bits[word] & mask;
+  }
+}
+
+// Close YZ wall runs set in before but not in after at row, open those set
+// in after but not in before, returns # of triangles
+int updateColumnRuns(tri_buffer *out, const uint64_t *before, const uint64_t *after, int words,
+                     int *runStart, int row, float *normal) {
+  int word, triCount = 0;
+  uint64_t bits;
+
+  for(word = 0; word < words; word++) {
+    for(bits = before[word] & ~after[word]; bits; bits &= bits - 1) {
+      int col = (word << 6) + __builtin_ctzll(bits);
+      writeYZFace(out, col, runStart[col], row, 0.0f, out->opts->zScale, normal);
+      triCount += 2;
+    }
+    for(bits = after[word] & ~before[word]; bits; bits &= bits - 1)
+      runStart[(word << 6) + __builtin_ctzll(bits)] = row;
+  }
+  return triCount;
+}
 
-        // zero out
-        for(zCol = startCol; zCol <= endCol; zCol++)
-          for(zRow = startRow; zRow <= endRow; zRow++)
-            DATA(zRow, zCol) = 0;
+// Extrude rows as they are read (from png if given, else .hmp text),
+// keeping only the previous row, the open YZ wall runs and the open
+// rectangles: memory is O(width) for any height. Produces the same faces
+// as simpleExtrude in a different order; returns # of triangles, -1 on
+// failure or a corrupt PNG row (rows past a shorter PNG are clear)
+int streamExtrude(const extrude_opts *opts, stl_writer *out, FILE *hmp, png_reader *png, int pxWidth, int pxHeight) {
+  int words = WORDS_FOR(pxWidth), row, ndx, startCol, endCol, past, triCount = 0;
+  uint64_t *prev = calloc(words, sizeof(uint64_t)), *cur = calloc(words, sizeof(uint64_t));
+  uint64_t *work = calloc(words, sizeof(uint64_t)), *swap;
+  uint64_t *lowOnly = calloc(words, sizeof(uint64_t)), *highOnly = calloc(words, sizeof(uint64_t));
+  uint64_t *prevLeft = calloc(words, sizeof(uint64_t)), *prevRight = calloc(words, sizeof(uint64_t));
+  uint64_t *left = calloc(words, sizeof(uint64_t)), *right = calloc(words, sizeof(uint64_t));
+  int *leftStart = calloc(pxWidth + 1, sizeof(int)), *rightStart = calloc(pxWidth + 1, sizeof(int));
+  char *line = malloc(pxWidth);
+  rect_list open = { NULL, 0, 0 }, next = { NULL, 0, 0 }, closed = { NULL, 0, 0 }, tempList;
+  tri_buffer buf = { TRI_BUILDER_INIT, opts };
 
-        writeXYFace(out, tempTris, startCol, endCol+1, startRow, endRow+1, 0.0f, V_NZ);
-        writeXYFace(out, tempTris, startCol, endCol+1, startRow, endRow+1, zScale, V_PZ);
-        triCount += 4;
+  if(!prev || !cur || !work || !lowOnly || !highOnly || !prevLeft || !prevRight || !left || !right ||
+     !leftStart || !rightStart || !line) {
+    printf("Could not allocate %d pixel stream rows\n", pxWidth);
+    triCount = -1;
+  }
+
+  for(row = 0; row <= pxHeight && triCount >= 0; row++) {
+    if(row < pxHeight && png) {
+      past = png->row >= png->height;
+      if(readPNGRow(png, cur, pxWidth) != 0 && !past) {
+        triCount = -1;
+        break;
       }
-      colNdx++;
+      rowOptions(opts, cur, pxWidth);
+    } else if(row < pxHeight)
+      readHMPRow(opts, hmp, line, cur, pxWidth);
+    else
+      memset(cur, 0, sizeof(uint64_t) * words);
+
+    // YZ walls: runs of each column boundary close when the row changes
+    columnEdges(cur, pxWidth, left, right);
+    triCount += updateColumnRuns(&buf, prevLeft, left, words, leftStart, row, V_PX);
+    triCount += updateColumnRuns(&buf, prevRight, right, words, rightStart, row, V_NX);
+
+    // XZ walls against the previous row
+    if(row > 0 && row < pxHeight)
+      triCount += writeWalls(&buf, prev, cur, lowOnly, highOnly, pxWidth, row, 0.0f, opts->zScale, writeXZFace, V_PY, V_NY);
+
+    // Open rectangles carry on while their whole span stays set, which is
+    // what greedyRects decides; the rest of the row starts new ones
+    memcpy(work, cur, sizeof(uint64_t) * words);
+    next.count = closed.count = 0;
+    for(ndx = 0; ndx < open.count; ndx++) {
+      rect *r = &open.rects[ndx];
+      if(row < pxHeight && rangeSet(cur, r->startCol, r->endCol)) {
+        clearRange(work, r->startCol, r->endCol);
+        appendRect(&next, r->startCol, r->endCol, r->startRow, 0);
+      } else
+        appendRect(&closed, r->startCol, r->endCol, r->startRow, row);
     }
+    for(startCol = 0; row < pxHeight && nextRun(work, pxWidth, startCol, &startCol, &endCol); startCol = endCol)
+      appendRect(&next, startCol, endCol, row, 0);
+    triCount += writeRects(&buf, out, &closed);
+    tempList = open;
+    open = next;
+    next = tempList;
+
+    if(buf.mesh.count >= TRI_ALLOC_SIZE)
+      writeBuilder(out, &buf.mesh);
+    swap = prev; prev = cur; cur = swap;
+    swap = prevLeft; prevLeft = left; left = swap;
+    swap = prevRight; prevRight = right; right = swap;
+  }
+  if(triCount >= 0 && (writeBuilder(out, &buf.mesh) < 0 || open.failed || next.failed || closed.failed)) {
+    printf("Could not allocate triangles or rectangles\n");
+    triCount = -1;
   }
 
-  free(tempTris);
+  free(prev); free(cur); free(work);
+  free(lowOnly); free(highOnly);
+  free(prevLeft); free(prevRight); free(left); free(right);
+  free(leftStart); free(rightStart);
+  free(line);
+  free(open.rects); free(next.rects); free(closed.rects);
+  freeBuilder(&buf.mesh);
   return triCount;
 }
 
-int complexExtrude(stl_tri *tris, char *data) {
+// Height of level k above the base, top level at full depth
+float levelZ(const extrude_opts *opts, int k, int levelCount) {
+  return opts->zScale * k / (levelCount - 1);
+}
+
+// Cover hm with rectangles (greedy or --optimal), clears hm
+void coverRects(const extrude_opts *opts, heightmap *hm, rect_list *list) {
+  list->count = 0;
+  if(opts->optimal)
+    optimalRects(hm, 0, hm->height, list);
+  else
+    greedyRects(hm, 0, hm->height, list);
+}
+
+// Face of the level relief on the pixel grid before it is triangulated:
+// walls have x0 == x1 (YZ) or y0 == y1 (XZ) and run from level z0 to z1,
+// tops and the bottom have z0 == z1
+typedef struct level_face_st {
+  int x0, x1, y0, y1, z0, z1;
+  float *normal;
+} level_face;
+
+// Face corner at level z on grid line, pos along it: alongX holds (y, x),
+// alongY holds (x, y)
+typedef struct level_point_st {
+  int z, line, pos;
+} level_point;
+
+typedef struct level_mesh_st {
+  level_face *faces;
+  int faceCount, faceAlloc;
+  level_point *alongX, *alongY;   // every face corner, sorted, no repeats
+  int pointCount;
+} level_mesh;
+
+// Append a face -> 0 on success
+int appendLevelFace(level_mesh *mesh, int x0, int x1, int y0, int y1, int z0, int z1, float *normal) {
+  level_face *grown;
+
+  if(mesh->faceCount == mesh->faceAlloc) {
+    if(!(grown = realloc(mesh->faces, sizeof(level_face) * (mesh->faceAlloc ? mesh->faceAlloc * 2 : 1024))))
+      return -1;
+    mesh->faces = grown;
+    mesh->faceAlloc = mesh->faceAlloc ? mesh->faceAlloc * 2 : 1024;
+  }
+  mesh->faces[mesh->faceCount++] = (level_face){ x0, x1, y0, y1, z0, z1, normal };
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  if(argc < 4) {
-    printf("Usage: $ extrude [input file (.png)] [width(px)] [height(px)] [output (.stl)] [options]\n");
-    return 1;
+// Walls of plane k between each line of lines and the next, from level
+// k-1 to k: columns of the transposed plane (yz) or rows -> 0 on success
+int levelWalls(level_mesh *mesh, heightmap *lines, int yz, int k, uint64_t *lowOnly, uint64_t *highOnly) {
+  int line, word, start, end, at, pass;
+
+  for(line = 0; line + 1 < lines->height; line++) {
+    const uint64_t *low = HM_ROW(lines, line), *high = HM_ROW(lines, line + 1);
+    for(word = 0; word < lines->rowWords; word++) {
+      lowOnly[word] = low[word] & ~high[word];
+      highOnly[word] = high[word] & ~low[word];
+    }
+    // lowOnly runs face towards the next line, highOnly runs back
+    for(pass = 0, at = line + 1; pass < 2; pass++)
+      for(start = 0; nextRun(pass ? highOnly : lowOnly, lines->width, start, &start, &end); start = end)
+        if(yz ? appendLevelFace(mesh, at, at, start, end, k - 1, k, pass ? V_NX : V_PX)
+              : appendLevelFace(mesh, start, end, at, at, k - 1, k, pass ? V_NY : V_PY))
+          return -1;
   }
+  return 0;
+}
 
-  char *dest = argv[4];
-  char *source = argv[1];
-  int imgWidth = atoi(argv[2]);
-  int imgHeight = atoi(argv[3]); 
-  int triCount = 0;
-  int pxCount; //, extTriCount;
-  char *data;
-  
-  // Open files
-  FILE *in = fopen(source, "r");
-  FILE *out = fopen(dest, "w");
+// One face at level z per live rectangle -> 0 on success
+int levelRects(level_mesh *mesh, rect_list *list, int z, float *normal) {
+  int ndx;
 
-  // Parse arguments
-  parseArgs(argc, argv);
-  pxCount = imgWidth * imgHeight;
-  width = (width == 10.0) ? imgWidth : width;
-  height = (height == 10.0) ? imgHeight : height;
-  zScale = depth;
-  xScale = width / imgWidth;
-  yScale = height / imgHeight;
-  printState(dest, source, imgWidth, imgHeight);
-  
-  // Write header
-  if(output_mode == ASCII)
-    writeHeaderAscii(out);
+  if(list->failed)
+    return -1;
+  for(ndx = 0; ndx < list->count; ndx++) {
+    rect *r = &list->rects[ndx];
+    if(r->startRow >= 0 && appendLevelFace(mesh, r->startCol, r->endCol, r->startRow, r->endRow, z, z, normal))
+      return -1;
+  }
+  return 0;
+}
+
+// Corners of face in order around it as grid x, y and level
+void levelCorners(const level_face *f, int corners[4][3]) {
+  int ndx;
+
+  for(ndx = 0; ndx < 4; ndx++) {
+    int far = ndx == 1 || ndx == 2, up = ndx >= 2;
+    int *c = corners[ndx];
+    if(f->z0 == f->z1) {          // (x0, y0) (x1, y0) (x1, y1) (x0, y1)
+      c[0] = far ? f->x1 : f->x0; c[1] = up ? f->y1 : f->y0; c[2] = f->z0;
+    } else if(f->x0 == f->x1) {   // (y0, z0) (y1, z0) (y1, z1) (y0, z1)
+      c[0] = f->x0; c[1] = far ? f->y1 : f->y0; c[2] = up ? f->z1 : f->z0;
+    } else {                      // (x0, z0) (x1, z0) (x1, z1) (x0, z1)
+      c[0] = far ? f->x1 : f->x0; c[1] = f->y0; c[2] = up ? f->z1 : f->z0;
+    }
+  }
+}
+
+int compareLevelPoints(const void *a, const void *b) {
+  const level_point *p = a, *q = b;
+
+  if(p->z != q->z)
+    return p->z < q->z ? -1 : 1;
+  if(p->line != q->line)
+    return p->line < q->line ? -1 : 1;
+  return p->pos < q->pos ? -1 : p->pos > q->pos;
+}
+
+// Sort and drop repeats -> # left
+int uniqueLevelPoints(level_point *points, int count) {
+  int ndx, kept = 0;
+
+  qsort(points, count, sizeof(level_point), compareLevelPoints);
+  for(ndx = 0; ndx < count; ndx++)
+    if(kept == 0 || compareLevelPoints(&points[kept - 1], &points[ndx]) != 0)
+      points[kept++] = points[ndx];
+  return kept;
+}
+
+// Every face corner along X and along Y -> 0 on success
+int levelPoints(level_mesh *mesh) {
+  int ndx, c, corners[4][3], count = 0;
+
+  mesh->alongX = malloc(sizeof(level_point) * 4 * (mesh->faceCount + 1));
+  mesh->alongY = malloc(sizeof(level_point) * 4 * (mesh->faceCount + 1));
+  if(!mesh->alongX || !mesh->alongY)
+    return -1;
+  for(ndx = 0; ndx < mesh->faceCount; ndx++) {
+    levelCorners(&mesh->faces[ndx], corners);
+    for(c = 0; c < 4; c++, count++) {
+      mesh->alongX[count] = (level_point){ corners[c][2], corners[c][1], corners[c][0] };
+      mesh->alongY[count] = (level_point){ corners[c][2], corners[c][0], corners[c][1] };
+    }
+  }
+  mesh->pointCount = uniqueLevelPoints(mesh->alongX, count);
+  uniqueLevelPoints(mesh->alongY, count);
+  return 0;
+}
+
+// First of the sorted points at or after (z, line, pos)
+int lowerLevelPoint(const level_point *points, int count, int z, int line, int pos) {
+  level_point key = { z, line, pos };
+  int low = 0, high = count, mid;
+
+  while(low < high) {
+    mid = (low + high) / 2;
+    if(compareLevelPoints(&points[mid], &key) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// Outline of face with every corner of another face lying on one of its
+// level edges put in, so the edges meet the neighbouring faces' edges end
+// to end. Walls are only split along their level edges, other faces never
+// touch their vertical edges -> # of points in poly
+int levelOutline(const level_mesh *mesh, const level_face *f, int (*poly)[3]) {
+  int corners[4][3], c, n = 0, along, from, to, first, last, ndx;
+  const level_point *points, *p;
+
+  levelCorners(f, corners);
+  for(c = 0; c < 4; c++) {
+    int *a = corners[c], *b = corners[(c + 1) % 4];
+    memcpy(poly[n++], a, sizeof(corners[c]));
+    if(a[2] != b[2])
+      continue;
+    along = a[1] == b[1] ? 0 : 1;
+    points = along ? mesh->alongY : mesh->alongX;
+    from = a[along];
+    to = b[along];
+    first = lowerLevelPoint(points, mesh->pointCount, a[2], a[1 - along], (from < to ? from : to) + 1);
+    last = lowerLevelPoint(points, mesh->pointCount, a[2], a[1 - along], from < to ? to : from);
+    for(ndx = 0; ndx < last - first; ndx++, n++) {
+      p = &points[from < to ? first + ndx : last - 1 - ndx];
+      poly[n][along] = p->pos;
+      poly[n][1 - along] = p->line;
+      poly[n][2] = p->z;
+    }
+  }
+  return n;
+}
+
+// Grid point -> STL coordinates
+void levelVertex(const extrude_opts *opts, const int *point, int levelCount, float *v) {
+  v[0] = point[0] * opts->xScale;
+  v[1] = point[1] * opts->yScale;
+  v[2] = opts->base + levelZ(opts, point[2], levelCount);
+}
+
+// Triangles of face: a plain quad as ever, a split outline as a fan around
+// the face centre -> # of triangles
+int writeLevelFace(tri_buffer *out, const level_mesh *mesh, const level_face *f, int (*poly)[3], int levelCount) {
+  const extrude_opts *opts = out->opts;
+  float z0 = levelZ(opts, f->z0, levelCount), z1 = levelZ(opts, f->z1, levelCount);
+  float low[3], high[3];
+  int n = levelOutline(mesh, f, poly), corners[4][3], ndx, k, ccw;
+  stl_tri *tris;
+
+  if(n == 4) {
+    if(f->z0 == f->z1)
+      writeXYFace(out, f->x0, f->x1, f->y0, f->y1, z0, f->normal);
+    else if(f->x0 == f->x1)
+      writeYZFace(out, f->x0, f->y0, f->y1, z0, z1, f->normal);
+    else
+      writeXZFace(out, f->y0, f->x0, f->x1, z0, z1, f->normal);
+    return 2;
+  }
+  if(!(tris = builderReserve(&out->mesh, n)))
+    return n;
+
+  // The corners go anticlockwise in (x, y), (y, z) or (x, z): facing +Z,
+  // +X and -Y respectively
+  ccw = f->z0 == f->z1 ? f->normal[2] > 0 : f->x0 == f->x1 ? f->normal[0] > 0 : f->normal[1] < 0;
+  levelCorners(f, corners);
+  levelVertex(opts, corners[0], levelCount, low);
+  levelVertex(opts, corners[2], levelCount, high);
+  for(ndx = 0; ndx < n; ndx++) {
+    for(k = 0; k < 3; k++)
+      tris[ndx].vertexA[k] = (low[k] + high[k]) / 2;
+    levelVertex(opts, poly[ndx], levelCount, ccw ? tris[ndx].vertexB : tris[ndx].vertexC);
+    levelVertex(opts, poly[(ndx + 1) % n], levelCount, ccw ? tris[ndx].vertexC : tris[ndx].vertexB);
+    memcpy(tris[ndx].normal, f->normal, sizeof(tris[ndx].normal));
+  }
+  return n;
+}
+
+// Grayscale relief from level planes (plane k-1 = pixels at level k or
+// above). Walls of plane k run from level k-1 to level k, so neighbours
+// get walls for exactly the steps between their levels; tops are merged
+// per level at its height and the bottom is merged over plane 0. Faces
+// follow level boundaries, not pixels. Merged faces are split wherever a
+// neighbour's corner lies on their edges so the mesh is closed with no
+// T-junctions; returns # of triangles, -1 on failure
+int complexExtrude(const extrude_opts *opts, stl_writer *out, heightmap *planes, int levelCount) {
+  int k, row, word, ndx, result = 0, triCount = 0;
+  tri_buffer buf = { TRI_BUILDER_INIT, opts };
+  rect_list rects = { NULL, 0, 0 };
+  level_mesh mesh = { NULL, 0, 0, NULL, NULL, 0 };
+  heightmap cols, exact = { 0 };
+  int pxWidth = planes[0].width, pxHeight = planes[0].height;
+  int words = WORDS_FOR(pxWidth > pxHeight ? pxWidth : pxHeight);
+  uint64_t *lowOnly = malloc(sizeof(uint64_t) * words), *highOnly = malloc(sizeof(uint64_t) * words);
+  int (*poly)[3] = NULL;
+
+  // Side walls, one level step at a time
+  if(!lowOnly || !highOnly)
+    result = -1;
+  for(k = 1; k < levelCount && result == 0; k++) {
+    if(transposeHeightmap(&planes[k-1], &cols) != 0) {
+      printf("Could not allocate %dx%d transposed heightmap\n", pxHeight, pxWidth);
+      result = -2;
+      break;
+    }
+    result = levelWalls(&mesh, &cols, 1, k, lowOnly, highOnly);
+    freeHeightmap(&cols);
+    if(result == 0)
+      result = levelWalls(&mesh, &planes[k-1], 0, k, lowOnly, highOnly);
+  }
+
+  // Bottom under every raised pixel
+  if(result == 0 && initHeightmap(&exact, pxWidth, pxHeight) != 0) {
+    printf("Could not allocate %dx%d heightmap\n", pxWidth, pxHeight);
+    result = -2;
+  }
+  if(result == 0) {
+    memcpy(exact.rows, planes[0].rows, sizeof(uint64_t) * exact.rowWords * pxHeight);
+    coverRects(opts, &exact, &rects);
+    result = levelRects(&mesh, &rects, 0, V_NZ);
+  }
+
+  // Tops of the pixels at exactly level k
+  for(k = 1; k < levelCount && result == 0; k++) {
+    for(row = 0; row < pxHeight; row++)
+      for(word = 0; word < exact.rowWords; word++)
+        HM_ROW(&exact, row)[word] = HM_ROW(&planes[k-1], row)[word] &
+                                    (k + 1 < levelCount ? ~HM_ROW(&planes[k], row)[word] : ~0ULL);
+    coverRects(opts, &exact, &rects);
+    result = levelRects(&mesh, &rects, k, V_PZ);
+  }
+
+  // Split at the corners of every face, then triangulate
+  if(result == 0 && (levelPoints(&mesh) != 0 || !(poly = malloc(sizeof(*poly) * (mesh.pointCount + 4)))))
+    result = -1;
+  for(ndx = 0; ndx < mesh.faceCount && result == 0; ndx++) {
+    triCount += writeLevelFace(&buf, &mesh, &mesh.faces[ndx], poly, levelCount);
+    if(buf.mesh.count >= TRI_ALLOC_SIZE)
+      writeBuilder(out, &buf.mesh);
+  }
+  writeBuilder(out, &buf.mesh);
+  if(result == -1 || buf.mesh.failed) {
+    printf("Could not allocate level relief faces\n");
+    result = -1;
+  }
+
+  free(lowOnly);
+  free(highOnly);
+  free(poly);
+  free(mesh.faces);
+  free(mesh.alongX);
+  free(mesh.alongY);
+  freeHeightmap(&exact);
+  free(rects.rects);
+  freeBuilder(&buf.mesh);
+  return result == 0 ? triCount : -1;
+}
+
+// Bitmap faces, tiled when threaded -> # of triangles, -1 on failure (clears hm)
+int extrudeBits(const extrude_opts *opts, stl_writer *out, heightmap *hm) {
+  if(opts->threads == 1)
+    return simpleExtrude(opts, out, hm);
+  return parallelExtrude(opts, out, hm, opts->threads > 0 ? opts->threads : getThreadCount());
+}
+
+// Tiles of the image, generated at 1 unit per pixel from z 0 to 1 in
+// tile coordinates (origin one pixel up and left of the tile), which is
+// the form they are cached in
+typedef struct tile_job_st {
+  const extrude_opts *opts;
+  extrude_opts unit;            // opts at unit scale, no base
+  heightmap *hm;
+  int tilesX;
+  tri_buffer *bufs;             // one per tile, rows of tilesX
+  int *cached;                  // 1 where the tile came from the cache, -1 out of memory
+} tile_job;
+
+// Faces of one tile: walls on its left and top border and inside it, and
+// its tops and bottoms. They depend only on the tile pixels, the column
+// left of it and the row above, so that is what the cache key hashes
+void tileTask(void *ctx, int ndx) {
+  tile_job *job = ctx;
+  heightmap *hm = job->hm, tile, lines;
+  tri_buffer *buf = &job->bufs[ndx];
+  rect_list rects = { NULL, 0, 0 };
+  int x0 = ndx % job->tilesX * CACHE_TILE, y0 = ndx / job->tilesX * CACHE_TILE;
+  int tw = hm->width - x0 < CACHE_TILE ? hm->width - x0 : CACHE_TILE;
+  int th = hm->height - y0 < CACHE_TILE ? hm->height - y0 : CACHE_TILE;
+  int row, header[6] = { CACHE_TILE, tw, th, x0 == 0, y0 == 0, job->opts->optimal };
+  uint64_t key;
+
+  // Tile plus one pixel border, image edges get no walls so they are keyed
+  resetBuilder(&buf->mesh);
+  job->cached[ndx] = -1;
+  if(initHeightmap(&tile, tw + 1, th + 1) != 0)
+    return;
+  for(row = y0 > 0 ? -1 : 0; row < th; row++)
+    if(x0 > 0)
+      copyRange(HM_ROW(&tile, row + 1), 0, HM_ROW(hm, y0 + row), x0 - 1, tw + 1);
+    else
+      copyRange(HM_ROW(&tile, row + 1), 1, HM_ROW(hm, y0 + row), 0, tw);
+  key = hashBytes(CACHE_HASH_SEED, header, sizeof(header));
+  key = hashBytes(key, tile.rows, sizeof(uint64_t) * tile.rowWords * tile.height);
+
+  job->cached[ndx] = 0;
+  if(loadCachedTris(job->opts->cacheDir, key, &buf->mesh) >= 0) {
+    freeHeightmap(&tile);
+    job->cached[ndx] = 1;
+    return;
+  }
+
+  // YZ walls between columns, the row above masked off
+  if(transposeHeightmap(&tile, &lines) != 0) {
+    job->cached[ndx] = -1;
+    freeHeightmap(&tile);
+    return;
+  }
+  for(row = 0; row < lines.height; row++)
+    HM_ROW(&lines, row)[0] &= ~1ULL;
+  writeWallLines(buf, NULL, &lines, x0 == 0, tw, 1, 0.0f, 1.0f);
+  freeHeightmap(&lines);
+
+  // XZ walls between rows, the column to the left masked off
+  for(row = 0; row < tile.height; row++)
+    HM_ROW(&tile, row)[0] &= ~1ULL;
+  writeWallLines(buf, NULL, &tile, y0 == 0, th, 0, 0.0f, 1.0f);
+
+  // Tops and bottoms of the tile's own pixels
+  if(job->opts->optimal)
+    optimalRects(&tile, 1, th + 1, &rects);
+  else
+    greedyRects(&tile, 1, th + 1, &rects);
+  writeRects(buf, NULL, &rects);
+  if(rects.failed)
+    job->cached[ndx] = -1;
   else
+    storeCachedTris(job->opts->cacheDir, key, &buf->mesh);
+
+  free(rects.rects);
+  freeHeightmap(&tile);
+}
+
+// Extrude in CACHE_TILE square tiles, reusing the faces of every tile
+// whose pixels and border are unchanged since they were cached in
+// --cache dir. Same surface as simpleExtrude, split at the tile edges.
+// Every tile is one task of a single runTasks call, so the whole mesh is
+// held in tile buffers until it is written; returns # of triangles, -1 on
+// failure
+int incrementalExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm) {
+  int tilesX = (hm->width + CACHE_TILE - 1) / CACHE_TILE, tilesY = (hm->height + CACHE_TILE - 1) / CACHE_TILE;
+  int ndx, tri, k, tiles = tilesX * tilesY, reused = 0, failed = 0, written, triCount = 0;
+  float x0, y0;
+  tri_chunk *chunk;
+  tile_job job;
+
+  if(!opts->cacheDir || openCacheDir(opts->cacheDir) != 0) {
+    printf("--incremental needs a usable --cache [dir], extruding without\n");
+    return extrudeBits(opts, out, hm);
+  }
+
+  job.opts = opts;
+  job.unit = *opts;
+  job.unit.xScale = job.unit.yScale = job.unit.zScale = 1.0f;
+  job.unit.base = 0.0f;
+  job.hm = hm;
+  job.tilesX = tilesX;
+  job.bufs = calloc(tiles, sizeof(tri_buffer));
+  job.cached = calloc(tiles, sizeof(int));
+  if(!job.bufs || !job.cached) {
+    printf("Could not allocate %d tile buffers\n", tiles);
+    free(job.bufs);
+    free(job.cached);
+    return -1;
+  }
+  for(ndx = 0; ndx < tiles; ndx++)
+    job.bufs[ndx].opts = &job.unit;
+
+  runTasks(opts->threads > 0 ? opts->threads : getThreadCount(), tiles, tileTask, &job);
+
+  // Tile coordinates -> output, in tile order
+  for(ndx = 0; ndx < tiles; ndx++) {
+    tri_buffer *buf = &job.bufs[ndx];
+    x0 = ndx % tilesX * CACHE_TILE - 1;
+    y0 = ndx / tilesX * CACHE_TILE - 1;
+    for(chunk = firstChunk(&buf->mesh); chunk; chunk = nextChunk(&buf->mesh, chunk))
+      for(tri = 0; tri < chunk->count; tri++) {
+        float *v[3] = { chunk->tris[tri].vertexA, chunk->tris[tri].vertexB, chunk->tris[tri].vertexC };
+        for(k = 0; k < 3; k++) {
+          v[k][0] = (x0 + v[k][0]) * opts->xScale;
+          v[k][1] = (y0 + v[k][1]) * opts->yScale;
+          v[k][2] = opts->base + v[k][2] * opts->zScale;
+        }
+      }
+    if((written = writeBuilder(out, &buf->mesh)) < 0)
+      job.cached[ndx] = -1;
+    else
+      triCount += written;
+    freeBuilder(&buf->mesh);
+    if(job.cached[ndx] < 0)
+      failed = 1;
+    else
+      reused += job.cached[ndx];
+  }
+  if(failed)
+    printf("Could not allocate tile heightmaps, rectangles or triangles\n");
+  else
+    printf("tile cache         : %d of %d tiles reused\n", reused, tiles);
+
+  // New tiles were stored, keep the directory within its cap
+  if(reused < tiles)
+    trimCache(opts->cacheDir, CACHE_MAX_BYTES);
+
+  free(job.bufs);
+  free(job.cached);
+  return failed ? -1 : triCount;
+}
+
+// Header and template through writer -> # of template triangles, -1 on failure
+int beginSTL(const extrude_opts *opts, FILE *out, stl_writer *writer) {
+  int triCount;
+
+  // Write header, quantized output is all written by endSTL
+  if(opts->output_mode == ASCII)
+    writeHeaderAscii(out);
+  else if(opts->output_mode == BINARY)
     writeHeaderBin(out, 0);
 
   // Copy in template
-  triCount = copyTemplate(out, addTo);
-  
-  // Parse (.hmp or .png)
-  data = malloc(sizeof(char) * pxCount);
-  if(strstr(source, ".hmp"))
-    parseHMP(in, data, pxCount, invert, imgWidth);
+  if(reuseWriter(writer, out, opts->output_mode) != 0) {
+    printf("Could not allocate writer\n");
+    return -1;
+  }
+  writer->format = opts->number_format;
+  beginPhase(opts->stats, writer);
+  if(opts->cacheDir && opts->output_mode != QUANTIZED)
+    triCount = cachedTemplate(writer, opts);
   else
-    parsePNG(in, data, pxCount, invert);
-
-  // Invert if necessary
-  if(invert)
-    invertData(data, pxCount);
+    triCount = copyTemplate(writer, opts->addTo);
+  if(triCount < 0)
+    return -1;
+  endPhase(opts->stats, PHASE_TEMPLATE, writer, triCount, 0);
+  return triCount;
+}
 
-  // Simple or complex extrude
-  triCount += simpleExtrude(out, data, imgWidth, imgHeight);
+// Base, footer and tri count after triCount triangles -> total, -1 on failure
+int endSTL(const extrude_opts *opts, FILE *out, stl_writer *writer, int triCount) {
+  int baseTris;
 
   // Add Base
-  triCount += addBase(out);
+  beginPhase(opts->stats, writer);
+  if((baseTris = addBase(opts, writer)) < 0)
+    return -1;
+  triCount += baseTris;
+  endPhase(opts->stats, PHASE_BASE, writer, baseTris, 0);
+  flushWriter(writer);
 
-  // Add ascii header or set tri count for binary
-  if(output_mode == ASCII)
+  // Add ascii header, encode quantized or set tri count for binary
+  if(opts->output_mode == ASCII)
     writeFooterAscii(out);
-  else
+  else if(opts->output_mode != QUANTIZED)
     setTriCount(out, triCount);
+  else if(finishQuantized(writer) != 0) {
+    printf("Could not allocate quantized mesh\n");
+    return -1;
+  }
+  endPhase(opts->stats, PHASE_FINISH, writer, 0, 0);
+  return triCount;
+}
+
+// Extrude one opened image into out with scaled opts: header, template,
+// faces, base and tri count. bufs keeps the heightmap, PNG decoder and
+// writer buffer for the next call -> # of triangles, -1 on failure
+int extrudeImage(const extrude_opts *opts, FILE *in, int isPNG, FILE *out,
+                 int imgWidth, int imgHeight, extrude_buffers *bufs) {
+  stl_writer *writer = &bufs->writer;
+  int triCount, result = 0, streamTris = 0, faceTris;
+
+  if(isPNG && !bufs->png && !(bufs->png = malloc(sizeof(png_reader)))) {
+    printf("Could not allocate PNG decoder\n");
+    return -1;
+  }
+  if((triCount = beginSTL(opts, out, writer)) < 0)
+    return -1;
+
+  // Grayscale relief from level planes
+  if(opts->levels > 2) {
+    heightmap *planes = calloc(opts->levels - 1, sizeof(heightmap));
+    int k, levelTris;
+    if(opts->stream || opts->threads != 1)
+      printf("--levels ignores --stream and --threads\n");
+    for(k = 0; k < opts->levels - 1 && result == 0; k++)
+      if(!planes || initHeightmap(&planes[k], imgWidth, imgHeight) != 0) {
+        printf("Could not allocate %d %dx%d level planes\n", opts->levels - 1, imgWidth, imgHeight);
+        result = -1;
+      }
+    if(result == 0) {
+      beginPhase(opts->stats, writer);
+      result = parseLevels(opts, in, isPNG, planes);
+      endPhase(opts->stats, PHASE_PARSE, writer, 0, 0);
+      if(result != 0 || (levelTris = complexExtrude(opts, writer, planes, opts->levels)) < 0)
+        result = -1;
+      else {
+        endPhase(opts->stats, PHASE_EXTRUDE, writer, levelTris, 0);
+        triCount += levelTris;
+      }
+    }
+    for(k = 0; planes && k < opts->levels - 1; k++)
+      freeHeightmap(&planes[k]);
+    free(planes);
+
+  // Streamed input never holds the whole image
+  } else if(opts->stream) {
+    if(opts->optimal || opts->threads != 1)
+      printf("--stream ignores --optimal and --threads\n");
+    beginPhase(opts->stats, writer);
+    if(isPNG && openPNG(bufs->png, in) != 0)
+      result = -1;
+    else if((streamTris = streamExtrude(opts, writer, in, isPNG ? bufs->png : NULL, imgWidth, imgHeight)) < 0)
+      result = -1;
+    else {
+      triCount += streamTris;
+      endPhase(opts->stats, PHASE_EXTRUDE, writer, streamTris, 0);
+    }
+    if(isPNG)
+      closePNG(bufs->png);
+
+  } else {
+    // Parse (.hmp or .png), invert/flip applied while reading
+    if(resizeHeightmap(&bufs->hm, imgWidth, imgHeight, &bufs->hmWords) != 0) {
+      printf("Could not allocate %dx%d heightmap\n", imgWidth, imgHeight);
+      result = -1;
+    } else {
+      beginPhase(opts->stats, writer);
+      if(isPNG)
+        result = parsePNG(opts, in, bufs->png, &bufs->hm);
+      else
+        parseHMP(opts, in, &bufs->hm);
+      endPhase(opts->stats, PHASE_PARSE, writer, 0, 0);
+
+      if(result != 0)
+        faceTris = -1;
+      else if(opts->incremental) {
+        faceTris = incrementalExtrude(opts, writer, &bufs->hm);
+        if(faceTris >= 0)
+          endPhase(opts->stats, PHASE_EXTRUDE, writer, faceTris, 0);
+      } else
+        faceTris = extrudeBits(opts, writer, &bufs->hm);
+      if(faceTris < 0)
+        result = -1;
+      else
+        triCount += faceTris;
+    }
+  }
+
+  triCount = endSTL(opts, out, writer, triCount);
+  return result == 0 ? triCount : -1;
+}
+
+// dest with .lod<factor> before its .stl extension
+void lodName(char *name, size_t size, const char *dest, int factor) {
+  const char *ext = strrchr(dest, '.');
+  int stem = ext && strcmp(ext, ".stl") == 0 ? (int)(ext - dest) : (int)strlen(dest);
+
+  snprintf(name, size, "%.*s.lod%d.stl", stem, dest, factor);
+}
+
+// Extrude 1/8, 1/4 and 1/2 resolution previews into their own complete
+// STLs named after dest, each closed before the next starts, then the
+// full resolution mesh into out. Previews keep the object size, their
+// pixels scaled up by the factor -> full # of triangles, -1 on failure
+int progressiveExtrude(const extrude_opts *opts, FILE *in, int isPNG, FILE *out, const char *dest,
+                       int imgWidth, int imgHeight, extrude_buffers *bufs) {
+  extrude_opts lodOpts;
+  heightmap lod;
+  struct timespec start, now;
+  char name[4096];
+  FILE *lodFile;
+  int factor, triCount, faceTris;
+
+  if(opts->levels > 2 || opts->stream)
+    printf("--progressive ignores --levels and --stream\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Whole image once, every level is downsampled from it
+  if(resizeHeightmap(&bufs->hm, imgWidth, imgHeight, &bufs->hmWords) != 0) {
+    printf("Could not allocate %dx%d heightmap\n", imgWidth, imgHeight);
+    return -1;
+  }
+  beginPhase(opts->stats, NULL);
+  if(isPNG) {
+    if(!bufs->png && !(bufs->png = malloc(sizeof(png_reader)))) {
+      printf("Could not allocate PNG decoder\n");
+      return -1;
+    }
+    if(parsePNG(opts, in, bufs->png, &bufs->hm) != 0)
+      return -1;
+  } else
+    parseHMP(opts, in, &bufs->hm);
+  endPhase(opts->stats, PHASE_PARSE, NULL, 0, 0);
+
+  for(factor = PROGRESSIVE_COARSEST; factor > 1; factor /= 2) {
+    if(imgWidth < factor * 2 && imgHeight < factor * 2)
+      continue;
+    lodName(name, sizeof(name), dest, factor);
+    if(!(lodFile = fopen(name, "w")) || downsampleHeightmap(&bufs->hm, factor, &lod) != 0) {
+      printf("Could not write %s\n", name);
+      if(lodFile)
+        fclose(lodFile);
+      return -1;
+    }
+
+    // Same object size from fewer, larger pixels
+    lodOpts = *opts;
+    lodOpts.xScale = opts->width / lod.width;
+    lodOpts.yScale = opts->height / lod.height;
+    triCount = beginSTL(&lodOpts, lodFile, &bufs->writer);
+    faceTris = triCount < 0 ? -1 : extrudeBits(&lodOpts, &bufs->writer, &lod);
+    triCount = faceTris < 0 ? -1 : endSTL(&lodOpts, lodFile, &bufs->writer, triCount + faceTris);
+    fclose(lodFile);
+    freeHeightmap(&lod);
+    if(triCount < 0)
+      return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("lod 1/%-2d          : %s (%dx%d, %d triangles, %.1f ms)\n", factor, name, lod.width, lod.height,
+           triCount, (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6);
+  }
+
+  if((triCount = beginSTL(opts, out, &bufs->writer)) < 0 ||
+     (faceTris = extrudeBits(opts, &bufs->writer, &bufs->hm)) < 0)
+    return -1;
+  return endSTL(opts, out, &bufs->writer, triCount + faceTris);
+}
+
+// Release what extrudeImage kept in bufs
+void freeExtrudeBuffers(extrude_buffers *bufs) {
+  freeHeightmap(&bufs->hm);
+  bufs->hmWords = 0;
+  free(bufs->png);
+  bufs->png = NULL;
+  free(bufs->writer.buf);
+  bufs->writer.buf = NULL;
+  if(bufs->writer.mesh) {
+    freeMesh(bufs->writer.mesh);
+    free(bufs->writer.mesh);
+    bufs->writer.mesh = NULL;
+  }
+}
+
+// --stats JSON line to stderr or appended to opts->statsFile -> 0 on success
+int reportStats(const extrude_opts *opts, const char *source, int imgWidth, int imgHeight, int triCount) {
+  FILE *out = stderr;
+  int result;
+
+  if(!opts->stats)
+    return 0;
+  if(opts->statsFile && !(out = fopen(opts->statsFile, "a"))) {
+    printf("Could not write stats to %s\n", opts->statsFile);
+    return -1;
+  }
+  result = writeStats(opts->stats, out, source, imgWidth, imgHeight, triCount);
+  if(out != stderr)
+    fclose(out);
+  return result;
+}
+
+#ifndef EXTRUDE_NO_MAIN
+int main(int argc, char *argv[]) {
+  extrude_opts opts;
+  extrude_buffers bufs;
+
+  // Persistent server: extrude --serve [socket] [--workers #]
+  defaultOpts(&opts);
+  parseArgs(&opts, argc, argv);
+  if(opts.serve) {
+    if(optind >= argc) {
+      printf("Usage: $ extrude --serve [socket] [--workers #]\n");
+      return 1;
+    }
+    return serveExtrude(argv[optind], opts.workers);
+  }
+
+  // getopt moved the positional arguments behind the options
+  if(argc - optind < 4) {
+    printf("Usage: $ extrude [input file (.png)] [width(px)] [height(px)] [output (.stl)] [options]\n");
+    return 1;
+  }
+
+  char *dest = argv[optind + 3];
+  char *source = argv[optind];
+  int imgWidth = atoi(argv[optind + 1]);
+  int imgHeight = atoi(argv[optind + 2]); 
+  int triCount;
+  
+  // Open files
+  FILE *in = fopen(source, "r");
+  FILE *out = fopen(dest, "w");
+
+  // Scale to the image
+  scaleOpts(&opts, imgWidth, imgHeight);
+  printState(&opts, dest, source, imgWidth, imgHeight);
+
+  memset(&bufs, 0, sizeof(extrude_buffers));
+  if(opts.stats)
+    startStats(opts.stats);
+  if(opts.progressive)
+    triCount = progressiveExtrude(&opts, in, !strstr(source, ".hmp"), out, dest, imgWidth, imgHeight, &bufs);
+  else
+    triCount = extrudeImage(&opts, in, !strstr(source, ".hmp"), out, imgWidth, imgHeight, &bufs);
+  reportStats(&opts, source, imgWidth, imgHeight, triCount);
+  freeExtrudeBuffers(&bufs);
+  freeOpts(&opts);
 
   // Free and close
   fclose(in);
   fclose(out);
-  free(data);
 
-  return 0;
+  return triCount < 0;
 }
+#endif
@@ -2,21 +2,103 @@
 // extrude.h - A tool for converting 2D images into 3D objects
 //
 // Usage: $ extrude [input file (.png)] [output (.stl)] [options]
-// Options: 
+//        $ extrude --serve [socket] [--workers #]
+// Options:
 //    --binary | --ascii                 STL output in binary or ASCII format
+//    --compact                          ASCII output with shortest numbers
+//    --quantized                        Compact indexed mesh for previews (convert expands it)
 //    --extrude | cut | semicut |overlay Extrusion yype
 //    --width [#]                        STL object width
 //    --height [#]                       STL object height
-//    --depth [#]                        Extrusion depth 
-//    --base [#]                         Base depth 
-//    --addto [filename]                 Add to existing STL 
-//    --invert                           Invert black/white on 2D img 
-
-void parseArgs(int argc, char *argv[]);
-int copyTemplate(FILE *out, char *filename);
-void parsePNG(FILE *png, char *data, int size);
-void parseHMP(FILE *hmp, char *data, int size, int iWidth);
-void invertData(char *data, int size);
-int simpleExtrude(FILE *out, char *data);
-int complexExtrude(stl_tri *tris, char *data);
-int addBase(FILE *out);
+//    --depth [#]                        Extrusion depth
+//    --base [#]                         Base depth
+//    --addto [filename]                 Add to existing STL
+//    --invert                           Invert black/white on 2D img
+//    --threads [#]                      Tiled extrusion on # threads (0: all cores)
+//    --optimal                          Near-minimal top/bottom rectangles
+//    --stream                           Extrude rows as read, O(width) memory
+//    --levels [#]                       Grayscale relief with # height levels
+//    --progressive                      1/8, 1/4, 1/2 previews as [output].lod#.stl first
+//    --cache [dir]                      Directory for cached meshes and templates
+//    --incremental                      Reuse cached faces of unchanged tiles
+//    --stats[=file]                     Per phase timings as a JSON line to stderr or appended to file
+//    --serve                            Run jobs from a UNIX socket (see serve.c)
+//    --workers [#]                      Server worker threads
+//    --data [#]                         Server jobs: # inline image bytes
+
+#ifndef __include_extrude
+#define __include_extrude
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "stl_util.h"
+#include "stl_io.h"
+#include "stl_builder.h"
+#include "heightmap.h"
+#include "png.h"
+#include "stats.h"
+
+// Everything one extrusion is configured by
+typedef struct extrude_opts_st {
+  stl_mode       output_mode;
+  ascii_format   number_format;
+  extrusion_mode extrude_mode;
+  int            invert, flip;
+  float          depth, width, height, base;
+  float          xScale, yScale, zScale;
+  char           *addTo;
+  int            threads, optimal, stream, levels, progressive;
+  char           *cacheDir;
+  int            incremental;
+  int            serve, workers;        // --serve only
+  long           dataBytes;             // server job image sent inline, -1: none
+  extrude_stats  *stats;                // --stats only
+  char           *statsFile;
+} extrude_opts;
+
+// Triangles being built, faces scaled by opts
+typedef struct tri_buffer_st {
+  tri_builder mesh;
+  const extrude_opts *opts;
+} tri_buffer;
+
+// Allocations kept from one extrusion to the next, zero before first use
+typedef struct extrude_buffers_st {
+  heightmap hm;
+  size_t hmWords;                       // words allocated for hm.rows
+  png_reader *png;
+  stl_writer writer;
+} extrude_buffers;
+
+void defaultOpts(extrude_opts *opts);
+void parseArgs(extrude_opts *opts, int argc, char *argv[]);
+void freeOpts(extrude_opts *opts);
+void scaleOpts(extrude_opts *opts, int imgWidth, int imgHeight);
+int copyTemplate(stl_writer *out, char *filename);
+int cachedTemplate(stl_writer *out, const extrude_opts *opts);
+int parsePNG(const extrude_opts *opts, FILE *file, png_reader *png, heightmap *hm);
+void rowOptions(const extrude_opts *opts, uint64_t *bits, int width);
+int readHMPLine(FILE *hmp, char *line, int width);
+void readHMPRow(const extrude_opts *opts, FILE *hmp, char *line, uint64_t *bits, int width);
+void parseHMP(const extrude_opts *opts, FILE *hmp, heightmap *hm);
+int readLevelRow(const extrude_opts *opts, FILE *in, png_reader *png, char *line, unsigned char *level, int width);
+int parseLevels(const extrude_opts *opts, FILE *in, int isPNG, heightmap *planes);
+int simpleExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm);
+int parallelExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm, int threads);
+int streamExtrude(const extrude_opts *opts, stl_writer *out, FILE *hmp, png_reader *png, int pxWidth, int pxHeight);
+int complexExtrude(const extrude_opts *opts, stl_writer *out, heightmap *planes, int levelCount);
+int addBase(const extrude_opts *opts, stl_writer *out);
+int beginSTL(const extrude_opts *opts, FILE *out, stl_writer *writer);
+int endSTL(const extrude_opts *opts, FILE *out, stl_writer *writer, int triCount);
+int extrudeBits(const extrude_opts *opts, stl_writer *out, heightmap *hm);
+int incrementalExtrude(const extrude_opts *opts, stl_writer *out, heightmap *hm);
+int extrudeImage(const extrude_opts *opts, FILE *in, int isPNG, FILE *out,
+                 int imgWidth, int imgHeight, extrude_buffers *bufs);
+int progressiveExtrude(const extrude_opts *opts, FILE *in, int isPNG, FILE *out, const char *dest,
+                       int imgWidth, int imgHeight, extrude_buffers *bufs);
+void freeExtrudeBuffers(extrude_buffers *bufs);
+int reportStats(const extrude_opts *opts, const char *source, int imgWidth, int imgHeight, int triCount);
+int serveExtrude(const char *path, int workers);
+
+#endif
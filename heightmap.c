@@ -0,0 +1,217 @@
+// Chris Polis
+// heightmap.c - bit-packed on/off images for extrusion
+
+#include <stdlib.h>
+#include <string.h>
+#include "heightmap.h"
+
+// Bits [start, end) of the word at bit offset base
+static uint64_t wordMask(int base, int start, int end) {
+  int lo = start > base ? start - base : 0;
+  int hi = end - base < 64 ? end - base : 64;
+  uint64_t mask = hi >= 64 ? ~0ULL : (1ULL << hi) - 1;
+  return mask & (~0ULL << lo);
+}
+
+// Zeroed width x height map -> 0 on success
+int initHeightmap(heightmap *hm, int width, int height) {
+  hm->width = width;
+  hm->height = height;
+  hm->rowWords = WORDS_FOR(width);
+  hm->rows = calloc((size_t)hm->rowWords * (height > 0 ? height : 1), sizeof(uint64_t));
+  return hm->rows ? 0 : -1;
+}
+
+// Zeroed width x height map reusing rows when *capacity words fit, else
+// reallocated and *capacity updated -> 0 on success
+int resizeHeightmap(heightmap *hm, int width, int height, size_t *capacity) {
+  size_t words = (size_t)WORDS_FOR(width) * (height > 0 ? height : 1);
+
+  if(!hm->rows || words > *capacity) {
+    free(hm->rows);
+    *capacity = 0;
+    if(initHeightmap(hm, width, height) != 0)
+      return -1;
+    *capacity = words;
+    return 0;
+  }
+  hm->width = width;
+  hm->height = height;
+  hm->rowWords = WORDS_FOR(width);
+  memset(hm->rows, 0, words * sizeof(uint64_t));
+  return 0;
+}
+
+// Release map
+void freeHeightmap(heightmap *hm) {
+  free(hm->rows);
+  hm->rows = NULL;
+}
+
+// Transpose into out (width rows of height bits) -> 0 on success
+int transposeHeightmap(heightmap *hm, heightmap *out) {
+  int row, word;
+  uint64_t bits;
+
+  if(initHeightmap(out, hm->height, hm->width) != 0)
+    return -1;
+
+  // Visit set bits only, cost follows the inked area
+  for(row = 0; row < hm->height; row++) {
+    uint64_t *src = HM_ROW(hm, row);
+    for(word = 0; word < hm->rowWords; word++)
+      for(bits = src[word]; bits; bits &= bits - 1)
+        HM_SET(out, (word << 6) + __builtin_ctzll(bits), row);
+  }
+  return 0;
+}
+
+// Flip bits [0, width) of a row
+void invertRow(uint64_t *row, int width) {
+  int word;
+  for(word = 0; word < WORDS_FOR(width); word++)
+    row[word] ^= wordMask(word << 6, 0, width);
+}
+
+// Bit order of v reversed
+static uint64_t reverseWord(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(v);
+}
+
+// Mirror bits [0, width) of a row in place
+void flipRow(uint64_t *row, int width) {
+  int words = WORDS_FOR(width), word, shift = (words << 6) - width;
+
+  // Reverse every word, swapping from both ends, then drop the padding
+  for(word = 0; word < words - 1 - word; word++) {
+    uint64_t v = row[word];
+    row[word] = reverseWord(row[words - 1 - word]);
+    row[words - 1 - word] = reverseWord(v);
+  }
+  if(word == words - 1 - word)
+    row[word] = reverseWord(row[word]);
+  if(shift)
+    for(word = 0; word < words; word++)
+      row[word] = row[word] >> shift | (word + 1 < words ? row[word + 1] << (64 - shift) : 0);
+}
+
+// Next run of set bits at or after from -> 1 and [*start, *end), 0 if none
+int nextRun(const uint64_t *bits, int bitCount, int from, int *start, int *end) {
+  int words = WORDS_FOR(bitCount), word = from >> 6;
+  uint64_t v;
+
+  if(from >= bitCount)
+    return 0;
+
+  // First set bit
+  v = bits[word] & (~0ULL << (from & 63));
+  while(!v) {
+    if(++word >= words)
+      return 0;
+    v = bits[word];
+  }
+  *start = (word << 6) + __builtin_ctzll(v);
+  if(*start >= bitCount)
+    return 0;
+
+  // First clear bit after it
+  v = ~bits[word] & (~0ULL << (*start & 63));
+  while(!v) {
+    if(++word >= words) {
+      *end = bitCount;
+      return 1;
+    }
+    v = ~bits[word];
+  }
+  *end = (word << 6) + __builtin_ctzll(v);
+  if(*end > bitCount)
+    *end = bitCount;
+  return 1;
+}
+
+// 1 if every bit in [start, end) is set
+int rangeSet(const uint64_t *bits, int start, int end) {
+  int word;
+  for(word = start >> 6; (word << 6) < end; word++) {
+    uint64_t mask = wordMask(word << 6, start, end);
+    if((bits[word] & mask) != mask)
+      return 0;
+  }
+  return 1;
+}
+
+// 1 if any bit in [start, end) is set
+int rangeAny(const uint64_t *bits, int start, int end) {
+  int word;
+  for(word = start >> 6; (word << 6) < end; word++)
+    if(bits[word] & wordMask(word << 6, start, end))
+      return 1;
+  return 0;
+}
+
+// Clear bits [start, end)
+void clearRange(uint64_t *bits, int start, int end) {
+  int word;
+  for(word = start >> 6; (word << 6) < end; word++)
+    bits[word] &= ~wordMask(word << 6, start, end);
+}
+
+// Bits [pos, pos + n) as the low n bits, 0 < n <= 64
+static uint64_t bitsAt(const uint64_t *bits, int pos, int n) {
+  int word = pos >> 6, shift = pos & 63;
+  uint64_t value = bits[word] >> shift;
+
+  if(shift && shift + n > 64)
+    value |= bits[word + 1] << (64 - shift);
+  return n == 64 ? value : value & ((1ULL << n) - 1);
+}
+
+// OR count bits of src from srcStart into dst from dstStart
+void copyRange(uint64_t *dst, int dstStart, const uint64_t *src, int srcStart, int count) {
+  int done, n, word, shift;
+  uint64_t value;
+
+  for(done = 0; done < count; done += n) {
+    n = count - done < 64 ? count - done : 64;
+    value = bitsAt(src, srcStart + done, n);
+    word = (dstStart + done) >> 6;
+    shift = (dstStart + done) & 63;
+    dst[word] |= value << shift;
+    if(shift && shift + n > 64)
+      dst[word + 1] |= value >> (64 - shift);
+  }
+}
+
+// # of set bits in [start, end)
+int rangeCount(const uint64_t *bits, int start, int end) {
+  int word, count = 0;
+  for(word = start >> 6; (word << 6) < end; word++)
+    count += __builtin_popcountll(bits[word] & wordMask(word << 6, start, end));
+  return count;
+}
+
+// factor x factor blocks of hm as pixels of out, set where at least half
+// of the block's pixels inside hm are set -> 0 on success
+int downsampleHeightmap(heightmap *hm, int factor, heightmap *out) {
+  int row, col, r, startRow, endRow, startCol, endCol, count;
+
+  if(initHeightmap(out, (hm->width + factor - 1) / factor, (hm->height + factor - 1) / factor) != 0)
+    return -1;
+
+  for(row = 0; row < out->height; row++) {
+    startRow = row * factor;
+    endRow = startRow + factor < hm->height ? startRow + factor : hm->height;
+    for(col = 0; col < out->width; col++) {
+      startCol = col * factor;
+      endCol = startCol + factor < hm->width ? startCol + factor : hm->width;
+      for(r = startRow, count = 0; r < endRow; r++)
+        count += rangeCount(HM_ROW(hm, r), startCol, endCol);
+      if(count * 2 >= (endRow - startRow) * (endCol - startCol))
+        HM_SET(out, row, col);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Chris Polis
+// heightmap.h - bit-packed on/off images for extrusion
+
+#ifndef __include_heightmap
+#define __include_heightmap
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One bit per pixel, 64 pixels per word, rows padded with zero bits
+typedef struct heightmap_st {
+  int width, height;
+  int rowWords;             // words per row
+  uint64_t *rows;           // height * rowWords, bit c of row r = pixel (r, c)
+} heightmap;
+
+#define HM_ROW(hm, r)     (&(hm)->rows[(size_t)(r) * (hm)->rowWords])
+#define HM_GET(hm, r, c)  ((HM_ROW(hm, r)[(c) >> 6] >> ((c) & 63)) & 1)
+#define HM_SET(hm, r, c)  (HM_ROW(hm, r)[(c) >> 6] |= 1ULL << ((c) & 63))
+#define WORDS_FOR(bits)   (((bits) + 63) >> 6)
+
+// Zeroed width x height map -> 0 on success
+int initHeightmap(heightmap *hm, int width, int height);
+
+// Zeroed width x height map reusing rows when *capacity words fit, else
+// reallocated and *capacity updated -> 0 on success
+int resizeHeightmap(heightmap *hm, int width, int height, size_t *capacity);
+
+// Release map
+void freeHeightmap(heightmap *hm);
+
+// Transpose into out (width rows of height bits) -> 0 on success
+int transposeHeightmap(heightmap *hm, heightmap *out);
+
+// Flip bits [0, width) of a row
+void invertRow(uint64_t *row, int width);
+
+// Mirror bits [0, width) of a row
+void flipRow(uint64_t *row, int width);
+
+// Next run of set bits at or after from -> 1 and [*start, *end), 0 if none
+int nextRun(const uint64_t *bits, int bitCount, int from, int *start, int *end);
+
+// 1 if every bit in [start, end) is set
+int rangeSet(const uint64_t *bits, int start, int end);
+
+// 1 if any bit in [start, end) is set
+int rangeAny(const uint64_t *bits, int start, int end);
+
+// Clear bits [start, end)
+void clearRange(uint64_t *bits, int start, int end);
+
+// OR count bits of src from srcStart into dst from dstStart
+void copyRange(uint64_t *dst, int dstStart, const uint64_t *src, int srcStart, int count);
+
+// # of set bits in [start, end)
+int rangeCount(const uint64_t *bits, int start, int end);
+
+// factor x factor blocks of hm as pixels of out, set where at least half
+// of the block's pixels inside hm are set -> 0 on success
+int downsampleHeightmap(heightmap *hm, int factor, heightmap *out);
+
+#endif
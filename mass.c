@@ -0,0 +1,214 @@
+// Chris Polis
+// mass.c - A tool for print material estimates: volume, area and mass properties
+//
+// Usage: $ mass [input (.stl)] [--density g/cm^3] [--json]
+//
+// Bounding box, surface area, signed volume, centroid and inertia tensor
+// (about the centroid) in one pass, units of the STL (mm assumed for the
+// mass in grams). Binary input is mapped and summed in fixed chunks on
+// worker threads (STL_THREADS overrides the count), merged in order so
+// the result does not depend on the thread count. ASCII input is parsed
+// as a stream, quantized input (extrude --quantized) is expanded.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stl_util.h"
+#include "stl_io.h"
+#include "stl_mesh.h"
+#include "stl_thread.h"
+
+#define CHUNK_TRIS (1 << 16)    // binary records per task
+#define BATCH_TRIS 4096         // tris unpacked at a time
+
+typedef struct mass_job_st {
+  stl_view *view;
+  float origin[3];
+  mass_sums *chunks;            // one per task
+} mass_job;
+
+// Sum one chunk of binary records
+void massChunk(void *ctx, int ndx) {
+  mass_job *job = ctx;
+  uint32_t first = (uint32_t)ndx * CHUNK_TRIS;
+  uint32_t last = job->view->triCount - first < CHUNK_TRIS ? job->view->triCount : first + CHUNK_TRIS;
+  stl_tri tris[BATCH_TRIS];
+  uint32_t tri, batch;
+
+  initMassSums(&job->chunks[ndx], job->origin);
+  for(tri = first; tri < last; tri += batch) {
+    for(batch = 0; batch < BATCH_TRIS && tri + batch < last; batch++)
+      viewTri(job->view, tri + batch, &tris[batch]);
+    addMassTris(&job->chunks[ndx], batch, tris);
+  }
+}
+
+// Binary view on threads -> sums, 0 on success
+int binaryMass(stl_view *view, mass_sums *sums, int threads) {
+  int tasks = (view->triCount + CHUNK_TRIS - 1) / CHUNK_TRIS, ndx;
+  mass_job job;
+  stl_tri first;
+
+  job.view = view;
+  if(!(job.chunks = malloc(sizeof(mass_sums) * (tasks + 1))))
+    return -1;
+  memset(job.origin, 0, sizeof(job.origin));
+  if(view->triCount > 0) {
+    viewTri(view, 0, &first);
+    memcpy(job.origin, first.vertexA, sizeof(job.origin));
+  }
+
+  runTasks(threads, tasks, massChunk, &job);
+  initMassSums(sums, job.origin);
+  for(ndx = 0; ndx < tasks; ndx++)
+    mergeMassSums(sums, &job.chunks[ndx]);
+  free(job.chunks);
+  return 0;
+}
+
+// ASCII facets as parsed -> sums, 0 on success
+int asciiMass(stl_parser *parser, mass_sums *sums) {
+  stl_tri *tris = malloc(sizeof(stl_tri) * BATCH_TRIS);
+  int batch, started = 0;
+
+  if(!tris)
+    return -1;
+  do {
+    for(batch = 0; batch < BATCH_TRIS && parseTriASCII(parser, &tris[batch]); batch++)
+      ;
+    if(!started) {
+      initMassSums(sums, batch > 0 ? tris[0].vertexA : NULL);
+      started = 1;
+    }
+    addMassTris(sums, batch, tris);
+  } while(batch == BATCH_TRIS);
+  free(tris);
+  return 0;
+}
+
+// Quantized mesh -> sums, 0 on success
+int meshMass(stl_mesh *mesh, mass_sums *sums) {
+  stl_tri *tris = malloc(sizeof(stl_tri) * BATCH_TRIS);
+  uint32_t ndx, batch;
+
+  if(!tris)
+    return -1;
+  initMassSums(sums, NULL);
+  if(mesh->vertCount > 0) {
+    float origin[3] = { mesh->x[0], mesh->y[0], mesh->z[0] };
+    initMassSums(sums, origin);
+  }
+  for(ndx = 0; ndx < mesh->triCount; ndx += batch) {
+    for(batch = 0; batch < BATCH_TRIS && ndx + batch < mesh->triCount; batch++)
+      meshTri(mesh, ndx + batch, &tris[batch]);
+    addMassTris(sums, batch, tris);
+  }
+  free(tris);
+  return 0;
+}
+
+// Print props as text or one json line, an empty mesh has no bounding box
+void printProps(const mass_props *p, double density, int json) {
+  double grams = p->volume / 1000.0 * density;
+  const bounding_box *b = &p->box;
+  char box[160];
+
+  if(json) {
+    if(p->triCount == 0)
+      strcpy(box, "null");
+    else
+      snprintf(box, sizeof(box), "[%g, %g, %g, %g, %g, %g]", b->minX, b->maxX, b->minY, b->maxY, b->minZ, b->maxZ);
+    printf("{ \"triangles\": %llu, \"bbox\": %s, \"area\": %.9g, \"volume\": %.9g, "
+           "\"density\": %g, \"mass_g\": %.9g, \"centroid\": [%.9g, %.9g, %.9g], "
+           "\"inertia\": [[%.9g, %.9g, %.9g], [%.9g, %.9g, %.9g], [%.9g, %.9g, %.9g]] }\n",
+           (unsigned long long)p->triCount, box, p->area, p->volume, density, grams, p->centroid[0], p->centroid[1], p->centroid[2],
+           p->inertia[0][0], p->inertia[0][1], p->inertia[0][2],
+           p->inertia[1][0], p->inertia[1][1], p->inertia[1][2],
+           p->inertia[2][0], p->inertia[2][1], p->inertia[2][2]);
+    return;
+  }
+  printf("triangles          : %llu\n", (unsigned long long)p->triCount);
+  if(p->triCount == 0)
+    printf("bounding box       : none\n");
+  else
+    printf("bounding box       : x %g to %g, y %g to %g, z %g to %g\n",
+           b->minX, b->maxX, b->minY, b->maxY, b->minZ, b->maxZ);
+  printf("surface area       : %.6f\n", p->area);
+  printf("volume             : %.6f%s\n", p->volume, p->volume < 0 ? " (inward winding)" : "");
+  printf("mass (%.3f g/cm3)  : %.3f g\n", density, grams);
+  printf("centroid           : %.6f %.6f %.6f\n", p->centroid[0], p->centroid[1], p->centroid[2]);
+  printf("inertia (unit rho) : %.6g %.6g %.6g\n", p->inertia[0][0], p->inertia[0][1], p->inertia[0][2]);
+  printf("                     %.6g %.6g %.6g\n", p->inertia[1][0], p->inertia[1][1], p->inertia[1][2]);
+  printf("                     %.6g %.6g %.6g\n", p->inertia[2][0], p->inertia[2][1], p->inertia[2][2]);
+}
+
+int main(int argc, char *argv[]) {
+  double density = 1.0;
+  int json = 0, ndx;
+
+  for(ndx = 2; ndx < argc; ndx++) {
+    if(strcmp(argv[ndx], "--json") == 0)
+      json = 1;
+    else if(strcmp(argv[ndx], "--density") == 0 && ndx + 1 < argc)
+      density = atof(argv[++ndx]);
+    else
+      argc = 0;
+  }
+  if(argc < 2) {
+    printf("Usage: $ mass [input (.stl)] [--density g/cm^3] [--json]\n");
+    return 1;
+  }
+
+  stl_view view;
+  stl_parser parser;
+  stl_mesh mesh;
+  mass_sums sums;
+  mass_props props;
+  stl_mode mode;
+  int result;
+  FILE *infile = fopen(argv[1], "r");
+
+  if(!infile) {
+    printf("Could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  mode = getFileMode(infile);
+  if(mode == QUANTIZED) {
+    initMesh(&mesh, 0.0f);
+    if(readQuantized(infile, &mesh) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
+    result = meshMass(&mesh, &sums);
+    freeMesh(&mesh);
+
+  } else if(mode == ASCII) {
+    if(openParser(&parser, infile) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
+    result = asciiMass(&parser, &sums);
+    closeParser(&parser);
+
+  } else {
+    if(openView(&view, infile) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
+    result = binaryMass(&view, &sums, getThreadCount());
+    closeView(&view);
+  }
+  fclose(infile);
+
+  if(result != 0) {
+    printf("Could not allocate triangle batches\n");
+    return 1;
+  }
+  props = getMassProps(&sums);
+  printProps(&props, density, json);
+  return 0;
+}
@@ -0,0 +1,190 @@
+// Chris Polis
+// meshcache.c - on-disk triangle cache keyed by content hash
+//
+// One file per key, <dir>/<key as hex><ext>. Entries are written to a
+// temporary name and renamed, so concurrent readers see a whole entry or
+// none. Triangle entries (.tris) hold 50 byte binary STL records without
+// a header. Reading an entry touches it, and trimCache removes the least
+// recently used entries once the directory outgrows its cap.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "stl_io.h"
+#include "meshcache.h"
+
+static int tempCounter;
+
+// Cache file seen by trimCache
+typedef struct cache_file_st {
+  char name[64];
+  struct timespec used;
+  off_t size;
+} cache_file;
+
+// FNV-1a over size bytes, continuing from hash
+uint64_t hashBytes(uint64_t hash, const void *bytes, size_t size) {
+  const unsigned char *b = bytes;
+  size_t ndx;
+
+  for(ndx = 0; ndx < size; ndx++)
+    hash = (hash ^ b[ndx]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Create the cache directory if missing -> 0 when usable
+int openCacheDir(const char *dir) {
+  struct stat st;
+
+  if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+    return -1;
+  return stat(dir, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+}
+
+// <dir>/<key as hex><ext>
+void cacheEntryName(char *name, size_t size, const char *dir, uint64_t key, const char *ext) {
+  snprintf(name, size, "%s/%016llx%s", dir, (unsigned long long)key, ext);
+}
+
+// New file at a temporary name next to name -> NULL on failure
+FILE *createCacheEntry(const char *name, char *temp, size_t size) {
+  snprintf(temp, size, "%s.%d.%d", name, (int)getpid(),
+           __atomic_fetch_add(&tempCounter, 1, __ATOMIC_RELAXED));
+  return fopen(temp, "w");
+}
+
+// Open entry name for reading and mark it used -> NULL on a miss
+FILE *openCacheEntry(const char *name) {
+  FILE *file = fopen(name, "r");
+
+  if(file)
+    futimens(fileno(file), NULL);
+  return file;
+}
+
+// Close file and rename it over name if ok, else remove it -> 0 on success
+int commitCacheEntry(FILE *file, const char *temp, const char *name, int ok) {
+  if(fclose(file) != 0)
+    ok = 0;
+  if(ok && rename(temp, name) == 0)
+    return 0;
+  unlink(temp);
+  return -1;
+}
+
+// Append the triangles stored under key to b -> # appended, -1 on a miss
+int loadCachedTris(const char *dir, uint64_t key, tri_builder *b) {
+  char name[4096];
+  unsigned char *recs;
+  struct stat st;
+  FILE *file;
+  stl_tri *tri;
+  int ndx, count = -1;
+
+  cacheEntryName(name, sizeof(name), dir, key, ".tris");
+  if(!(file = openCacheEntry(name)))
+    return -1;
+  if(fstat(fileno(file), &st) == 0 && st.st_size % STL_RECORD_SIZE == 0) {
+    recs = malloc(st.st_size + 1);
+    if(recs && fread(recs, 1, st.st_size, file) == (size_t)st.st_size) {
+      count = st.st_size / STL_RECORD_SIZE;
+      for(ndx = 0; ndx < count && count >= 0; ndx++)
+        if((tri = builderReserve(b, 1)))
+          unpackTriBin(recs + (size_t)ndx * STL_RECORD_SIZE, tri);
+        else
+          count = -1;
+    }
+    free(recs);
+  }
+  fclose(file);
+  return count;
+}
+
+// Store the triangles of b under key, replacing any entry -> 0 on success
+int storeCachedTris(const char *dir, uint64_t key, const tri_builder *b) {
+  char name[4096], temp[4096 + 32];
+  unsigned char rec[STL_RECORD_SIZE];
+  tri_chunk *chunk;
+  FILE *file;
+  int ndx, ok = 1;
+
+  if(b->failed)
+    return -1;
+  cacheEntryName(name, sizeof(name), dir, key, ".tris");
+  if(!(file = createCacheEntry(name, temp, sizeof(temp))))
+    return -1;
+  for(chunk = firstChunk(b); chunk && ok; chunk = nextChunk(b, chunk))
+    for(ndx = 0; ndx < chunk->count && ok; ndx++) {
+      packTriBin(rec, &chunk->tris[ndx]);
+      ok = fwrite(rec, STL_RECORD_SIZE, 1, file) == 1;
+    }
+  return commitCacheEntry(file, temp, name, ok);
+}
+
+// Entry or leftover temporary file: 16 hex digits and a '.'
+static int isCacheFile(const char *name) {
+  int ndx;
+
+  for(ndx = 0; ndx < 16; ndx++)
+    if(!((name[ndx] >= '0' && name[ndx] <= '9') || (name[ndx] >= 'a' && name[ndx] <= 'f')))
+      return 0;
+  return name[16] == '.' && strlen(name) < sizeof(((cache_file *)0)->name);
+}
+
+static int compareUsed(const void *a, const void *b) {
+  const struct timespec *x = &((const cache_file *)a)->used, *y = &((const cache_file *)b)->used;
+
+  if(x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Remove least recently used files until dir holds at most maxBytes -> # removed
+int trimCache(const char *dir, uint64_t maxBytes) {
+  char path[4096];
+  cache_file *files = NULL, *grown;
+  size_t count = 0, alloc = 0, ndx;
+  uint64_t total = 0;
+  struct dirent *ent;
+  struct stat st;
+  int removed = 0;
+  DIR *d;
+
+  if(!(d = opendir(dir)))
+    return 0;
+  while((ent = readdir(d))) {
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    if(!isCacheFile(ent->d_name) || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if(count == alloc) {
+      alloc = alloc ? alloc * 2 : 256;
+      if(!(grown = realloc(files, sizeof(cache_file) * alloc)))
+        break;
+      files = grown;
+    }
+    strcpy(files[count].name, ent->d_name);
+    files[count].used = st.st_mtim;
+    files[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+  closedir(d);
+
+  if(total > maxBytes) {
+    qsort(files, count, sizeof(cache_file), compareUsed);
+    for(ndx = 0; ndx < count && total > maxBytes; ndx++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, files[ndx].name);
+      if(unlink(path) == 0)
+        removed++;
+      total -= files[ndx].size;
+    }
+  }
+  free(files);
+  return removed;
+}
@@ -0,0 +1,42 @@
+// Chris Polis
+// meshcache.h - on-disk triangle cache keyed by content hash
+
+#ifndef __include_meshcache
+#define __include_meshcache
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "stl_builder.h"
+
+#define CACHE_HASH_SEED 0xcbf29ce484222325ULL   // FNV-1a offset basis
+#define CACHE_MAX_BYTES (256ULL << 20)          // cache dir size kept by trimCache
+
+// FNV-1a over size bytes, continuing from hash
+uint64_t hashBytes(uint64_t hash, const void *bytes, size_t size);
+
+// Create the cache directory if missing -> 0 when usable
+int openCacheDir(const char *dir);
+
+// <dir>/<key as hex><ext>
+void cacheEntryName(char *name, size_t size, const char *dir, uint64_t key, const char *ext);
+
+// New file at a temporary name next to name -> NULL on failure
+FILE *createCacheEntry(const char *name, char *temp, size_t size);
+
+// Open entry name for reading and mark it used -> NULL on a miss
+FILE *openCacheEntry(const char *name);
+
+// Close file and rename it over name if ok, else remove it -> 0 on success
+int commitCacheEntry(FILE *file, const char *temp, const char *name, int ok);
+
+// Append the triangles stored under key to b -> # appended, -1 on a miss
+int loadCachedTris(const char *dir, uint64_t key, tri_builder *b);
+
+// Store the triangles of b under key, replacing any entry -> 0 on success
+int storeCachedTris(const char *dir, uint64_t key, const tri_builder *b);
+
+// Remove least recently used files until dir holds at most maxBytes -> # removed
+int trimCache(const char *dir, uint64_t maxBytes);
+
+#endif
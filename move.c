@@ -1,49 +1,291 @@
 // Chris Polis
-// move.c - A tool for moving an STL model from the command line
+// move.c - A tool for moving, scaling and rotating an STL model from the command line
 //
 // Usage: $ move [in] [out] [x] [y] [z]
+//        $ move [in] [out] [operations...]
+//        $ move [in] --in-place [operations...]      Binary STL only
+// Operations (applied left to right, composed into one transform):
+//    --move [x] [y] [z]                 Translate
+//    --scale [s]                        Uniform scale
+//    --scale-xyz [x] [y] [z]            Per axis scale (negative mirrors)
+//    --rotate-x | -y | -z [degrees]     Rotate about an axis
+//
+// Binary input is transformed in parallel chunks (STL_THREADS overrides
+// the worker count), ASCII input in one streaming pass. --in-place maps
+// the file read-write and rewrites the vertex floats of each record.
+// Quantized input is decoded, moved and written quantized.
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 #include <sys/types.h>
 
 #include "stl_util.h"
 #include "stl_io.h"
+#include "stl_thread.h"
+
+#define CHUNK_TRIS 8192
+#define INPLACE_BYTES (1 << 20)   // page multiple handled per in-place task
+
+typedef struct move_job_st {
+  stl_view *view;
+  affine_transform *t;
+  unsigned char **bufs;         // packed output per chunk
+  stl_tri **tris;               // unpacked scratch per chunk
+  uint32_t first;               // first record of this round
+} move_job;
+
+// Transform one chunk of records into its buffer
+void moveChunk(void *ctx, int ndx) {
+  move_job *job = ctx;
+  uint32_t first = job->first + ndx * CHUNK_TRIS;
+  uint32_t last = job->view->triCount - first < CHUNK_TRIS ? job->view->triCount : first + CHUNK_TRIS;
+  stl_tri *tris = job->tris[ndx];
+  uint32_t tri;
+
+  for(tri = first; tri < last; tri++)
+    viewTri(job->view, tri, &tris[tri - first]);
+  transformTris(job->t, last - first, tris);
+  for(tri = first; tri < last; tri++)
+    packTriBin(job->bufs[ndx] + (size_t)(tri - first) * STL_RECORD_SIZE, &tris[tri - first]);
+}
+
+// Release the chunk buffers of a round
+void freeMoveJob(move_job *job, int chunks) {
+  int ndx;
+
+  for(ndx = 0; ndx < chunks; ndx++) {
+    free(job->bufs[ndx]);
+    free(job->tris[ndx]);
+  }
+  free(job->bufs);
+  free(job->tris);
+}
+
+// Allocate the output and scratch buffers of chunks per round -> 0 on success
+int initMoveJob(move_job *job, int chunks) {
+  int ndx;
+
+  job->bufs = calloc(chunks, sizeof(unsigned char *));
+  job->tris = calloc(chunks, sizeof(stl_tri *));
+  if(!job->bufs || !job->tris) {
+    freeMoveJob(job, 0);
+    return -1;
+  }
+  for(ndx = 0; ndx < chunks; ndx++) {
+    job->bufs[ndx] = malloc((size_t)CHUNK_TRIS * STL_RECORD_SIZE);
+    job->tris[ndx] = malloc(sizeof(stl_tri) * CHUNK_TRIS);
+    if(!job->bufs[ndx] || !job->tris[ndx]) {
+      freeMoveJob(job, ndx + 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// First record starting at or after byte offset
+uint32_t recordAt(stl_view *view, size_t offset) {
+  size_t ndx;
+
+  if(offset <= STL_HEADER_SIZE)
+    return 0;
+  ndx = (offset - STL_HEADER_SIZE + STL_RECORD_SIZE - 1) / STL_RECORD_SIZE;
+  return ndx < view->triCount ? ndx : view->triCount;
+}
+
+// Transform the records starting inside one page-aligned byte range
+void inPlaceChunk(void *ctx, int ndx) {
+  move_job *job = ctx;
+  uint32_t first = recordAt(job->view, (size_t)ndx * INPLACE_BYTES);
+  uint32_t last = recordAt(job->view, (size_t)(ndx + 1) * INPLACE_BYTES);
+  stl_tri tris[256];
+  uint32_t start, tri;
+  int batch;
+
+  for(start = first; start < last; start += batch) {
+    batch = last - start < 256 ? last - start : 256;
+    for(tri = 0; tri < batch; tri++)
+      viewTri(job->view, start + tri, &tris[tri]);
+    transformTris(job->t, batch, tris);
+
+    // Rewrite normal + vertices, keep the attribute bytes
+    for(tri = 0; tri < batch; tri++) {
+      unsigned char *rec = (unsigned char *)viewRecord(job->view, start + tri);
+      memcpy(rec,      tris[tri].normal,  12);
+      memcpy(rec + 12, tris[tri].vertexA, 12);
+      memcpy(rec + 24, tris[tri].vertexB, 12);
+      memcpy(rec + 36, tris[tri].vertexC, 12);
+    }
+  }
+}
+
+// Transform a binary STL inside its own file -> 0 on success
+int moveInPlace(char *filename, affine_transform *t, int threads) {
+  FILE *file = fopen(filename, "r+");
+  stl_view view;
+  move_job job;
+  size_t ranges;
+  int result;
+
+  if(!file || getFileMode(file) != BINARY || openViewRW(&view, file) != 0) {
+    printf("--in-place needs a writable binary STL: %s\n", filename);
+    if(file)
+      fclose(file);
+    return 1;
+  }
+
+  job.view = &view;
+  job.t = t;
+  ranges = (STL_HEADER_SIZE + (size_t)view.triCount * STL_RECORD_SIZE + INPLACE_BYTES - 1) / INPLACE_BYTES;
+  runTasks(threads, ranges, inPlaceChunk, &job);
+
+  result = syncView(&view);
+  if(result != 0)
+    perror("msync");
+  closeView(&view);
+  fclose(file);
+  return result != 0;
+}
+
+// Parse operations -> composed transform, 0 on bad arguments
+int parseOps(int argc, char *argv[], affine_transform *t) {
+  int ndx = 0;
+  float deg2rad = M_PI / 180.0;
+
+  *t = identityTransform();
+  while(ndx < argc) {
+    char *op = argv[ndx++];
+    if(strcmp(op, "--move") == 0 && ndx + 3 <= argc) {
+      *t = composeTransform(*t, translateTransform(atof(argv[ndx]), atof(argv[ndx+1]), atof(argv[ndx+2])));
+      ndx += 3;
+    } else if(strcmp(op, "--scale") == 0 && ndx + 1 <= argc) {
+      float s = atof(argv[ndx++]);
+      *t = composeTransform(*t, scaleTransform(s, s, s));
+    } else if(strcmp(op, "--scale-xyz") == 0 && ndx + 3 <= argc) {
+      *t = composeTransform(*t, scaleTransform(atof(argv[ndx]), atof(argv[ndx+1]), atof(argv[ndx+2])));
+      ndx += 3;
+    } else if(strncmp(op, "--rotate-", 9) == 0 && op[9] >= 'x' && op[9] <= 'z' && !op[10] && ndx + 1 <= argc) {
+      *t = composeTransform(*t, rotateTransform(op[9] - 'x', atof(argv[ndx++]) * deg2rad));
+    } else {
+      printf("Bad operation: %s\n", op);
+      return 0;
+    }
+  }
+  return 1;
+}
 
 int main(int argc, char *argv[]) {
 
-  if(argc != 6) {
-    printf("Usage: $ move [x] [y] [z]\n");
+  if(argc < 3) {
+    printf("Usage: $ move [in] [out] [x] [y] [z]\n"
+           "       $ move [in] [out | --in-place] [--move x y z | --scale s | --scale-xyz x y z | --rotate-x|y|z deg]...\n");
     return 1;
   }
 
-  FILE *infile = fopen(argv[1], "r");
-  FILE *outfile = fopen(argv[2], "w");
-  float x = atof(argv[3]);
-  float y = atof(argv[4]);
-  float z = atof(argv[5]);
-  int ndx, triCount = 0;
-  stl_tri tempTri;
+  FILE *infile, *outfile;
+  affine_transform t;
+  int triCount = 0, batch, ndx, count, threads = getThreadCount();
+  stl_view view;
+  stl_parser parser;
+  stl_writer writer;
+  stl_mesh mesh;
+  stl_mode mode;
+  stl_tri *tris;
+  move_job job;
+
+  // Legacy form: move [in] [out] [x] [y] [z]
+  if(argc == 6 && strncmp(argv[3], "--", 2) != 0)
+    t = translateTransform(atof(argv[3]), atof(argv[4]), atof(argv[5]));
+  else if(!parseOps(argc - 3, argv + 3, &t))
+    return 1;
+
+  if(strcmp(argv[2], "--in-place") == 0)
+    return moveInPlace(argv[1], &t, threads);
+
+  infile = fopen(argv[1], "r");
+  outfile = fopen(argv[2], "w");
 
-  if(getFileMode(infile) == ASCII) {
-    readASCIIHeader(infile);
+  if(!infile || !outfile) {
+    printf("Could not open %s\n", infile ? argv[2] : argv[1]);
+    return 1;
+  }
+
+  mode = getFileMode(infile);
+  if(mode == QUANTIZED) {
+    initMesh(&mesh, 0.0f);
+    if(readQuantized(infile, &mesh) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
+    transformMesh(&t, &mesh);
+    if(initWriter(&writer, outfile, QUANTIZED) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
+    }
+    if(writeQuantized(&writer, &mesh) != 0) {
+      printf("Could not allocate quantized mesh\n");
+      return 1;
+    }
+    freeWriter(&writer);
+    freeMesh(&mesh);
+
+  } else if(mode == ASCII) {
+    if(openParser(&parser, infile) != 0) {
+      printf("Could not read %s\n", argv[1]);
+      return 1;
+    }
     writeHeaderAscii(outfile);
-    while(readTriASCII(infile, &tempTri)) {
-      translateTri(&tempTri, x, y, z);
-      writeTriASCII(outfile, &tempTri);
+    if(initWriter(&writer, outfile, ASCII) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
+    }
+    if(!(tris = malloc(sizeof(stl_tri) * CHUNK_TRIS))) {
+      printf("Could not allocate %d triangles\n", CHUNK_TRIS);
+      return 1;
     }
+    do {
+      for(batch = 0; batch < CHUNK_TRIS && parseTriASCII(&parser, &tris[batch]); batch++)
+        ;
+      transformTris(&t, batch, tris);
+      writerTriArray(&writer, batch, tris);
+    } while(batch == CHUNK_TRIS);
+    free(tris);
+    closeParser(&parser);
+    freeWriter(&writer);
+    writeFooterAscii(outfile);
 
-  } else {
-    triCount = readBinaryHeader(infile);
+  } else if(openView(&view, infile) == 0) {
+    triCount = view.triCount;
     writeHeaderBin(outfile, triCount);
-    for(ndx = 0; ndx < triCount; ndx++) {
-      readTriBin(infile, &tempTri);
-      translateTri(&tempTri, x, y, z);
-      writeTriBin(outfile, &tempTri);
+    if(initWriter(&writer, outfile, BINARY) != 0) {
+      printf("Could not allocate writer\n");
+      return 1;
+    }
+
+    job.view = &view;
+    job.t = &t;
+    if(initMoveJob(&job, threads * 2) != 0) {
+      printf("Could not allocate %d chunk buffers\n", threads * 2);
+      return 1;
+    }
+
+    // Rounds of threads * 2 chunks, written in order
+    for(job.first = 0; job.first < view.triCount; job.first += count * CHUNK_TRIS) {
+      count = (view.triCount - job.first + CHUNK_TRIS - 1) / CHUNK_TRIS;
+      count = count < threads * 2 ? count : threads * 2;
+      runTasks(threads, count, moveChunk, &job);
+      for(ndx = 0; ndx < count; ndx++) {
+        uint32_t first = job.first + ndx * CHUNK_TRIS;
+        uint32_t chunkTris = view.triCount - first < CHUNK_TRIS ? view.triCount - first : CHUNK_TRIS;
+        writerBytes(&writer, job.bufs[ndx], (size_t)chunkTris * STL_RECORD_SIZE);
+      }
     }
 
+    freeMoveJob(&job, threads * 2);
+    freeWriter(&writer);
+    closeView(&view);
   }
 
   fclose(infile);
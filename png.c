@@ -0,0 +1,565 @@
+// Chris Polis
+// png.c - dependency free PNG scanline reader for extrusion input
+//
+// IDAT chunks are pulled from the file as the bit reader needs them and
+// inflated into a 32KB history window only as far as the next scanline,
+// so a whole image is never held in memory. Grayscale, RGB, palette and
+// alpha images of every bit depth are supported, interlaced ones are not.
+
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+
+#define PNG_BLOCK_NEW    0
+#define PNG_BLOCK_STORED 1
+#define PNG_BLOCK_CODED  2
+
+#define WINDOW_MASK (PNG_WINDOW_SIZE - 1)
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t lengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Next file byte, -1 at end of file
+static int inputByte(png_reader *png) {
+  if(png->inputPos == png->inputLen) {
+    png->inputLen = fread(png->input, 1, PNG_INPUT_SIZE, png->in);
+    png->inputPos = 0;
+    if(png->inputLen == 0)
+      return -1;
+  }
+  return png->input[png->inputPos++];
+}
+
+static int inputBytes(png_reader *png, unsigned char *dest, int count) {
+  int ndx, c;
+  for(ndx = 0; ndx < count; ndx++) {
+    if((c = inputByte(png)) < 0)
+      return -1;
+    if(dest)
+      dest[ndx] = c;
+  }
+  return 0;
+}
+
+static uint32_t bigEndian(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Chunk length and type -> 0 on success
+static int chunkHeader(png_reader *png, uint32_t *length, char *type) {
+  unsigned char head[8];
+  if(inputBytes(png, head, 8) != 0)
+    return -1;
+  *length = bigEndian(head);
+  memcpy(type, head + 4, 4);
+  return 0;
+}
+
+// Next byte of the concatenated IDAT data, -1 when it ends
+static int dataByte(png_reader *png) {
+  uint32_t length;
+  char type[4];
+
+  while(png->chunkLeft == 0) {
+    if(png->dataDone)
+      return -1;
+    // CRC of the last chunk, then the next header
+    if(inputBytes(png, NULL, 4) != 0 || chunkHeader(png, &length, type) != 0 || memcmp(type, "IDAT", 4) != 0) {
+      png->dataDone = 1;
+      return -1;
+    }
+    png->chunkLeft = length;
+  }
+  png->chunkLeft--;
+  return inputByte(png);
+}
+
+// Top up the bit buffer as far as the data allows
+static void fillBits(png_reader *png) {
+  int c;
+  while(png->bitCount <= 56 && (c = dataByte(png)) >= 0) {
+    png->bitBuf |= (uint64_t)c << png->bitCount;
+    png->bitCount += 8;
+  }
+}
+
+// count bits LSB first -> value, -1 if the data ran out
+static int getBits(png_reader *png, int count) {
+  int value;
+
+  if(png->bitCount < count)
+    fillBits(png);
+  if(png->bitCount < count)
+    return -1;
+  value = png->bitBuf & ((1ULL << count) - 1);
+  png->bitBuf >>= count;
+  png->bitCount -= count;
+  return value;
+}
+
+// Canonical code from code lengths
+static void buildHuffman(png_huffman *h, const uint8_t *lengths, int n) {
+  uint16_t offset[16], next[16];
+  int sym, len, code = 0, ndx;
+
+  memset(h->count, 0, sizeof(h->count));
+  memset(h->fast, 0, sizeof(h->fast));
+  for(sym = 0; sym < n; sym++)
+    h->count[lengths[sym]]++;
+  h->count[0] = 0;
+
+  offset[1] = 0;
+  for(len = 1; len < 15; len++)
+    offset[len + 1] = offset[len] + h->count[len];
+  for(len = 1; len < 16; len++) {
+    code = (code + h->count[len - 1]) << 1;
+    next[len] = code;
+  }
+
+  for(sym = 0; sym < n; sym++) {
+    if(!(len = lengths[sym]))
+      continue;
+    h->symbol[offset[len]++] = sym;
+
+    // Short codes fill every table slot their reversed bits prefix
+    code = next[len]++;
+    if(len <= PNG_FAST_BITS) {
+      int rev = 0;
+      for(ndx = 0; ndx < len; ndx++)
+        rev |= ((code >> ndx) & 1) << (len - 1 - ndx);
+      for(; rev < (1 << PNG_FAST_BITS); rev += 1 << len)
+        h->fast[rev] = sym << 4 | len;
+    }
+  }
+}
+
+// Next symbol of code h, -1 on bad or missing data
+static int decodeSymbol(png_reader *png, png_huffman *h) {
+  int entry, len, code = 0, first = 0, index = 0, count;
+
+  if(png->bitCount < 15)
+    fillBits(png);
+
+  entry = h->fast[png->bitBuf & ((1 << PNG_FAST_BITS) - 1)];
+  if(entry && (entry & 15) <= png->bitCount) {
+    png->bitBuf >>= entry & 15;
+    png->bitCount -= entry & 15;
+    return entry >> 4;
+  }
+
+  // Longer codes one bit at a time
+  for(len = 1; len < 16 && len <= png->bitCount; len++) {
+    code |= (png->bitBuf >> (len - 1)) & 1;
+    count = h->count[len];
+    if(code - first < count) {
+      png->bitBuf >>= len;
+      png->bitCount -= len;
+      return h->symbol[index + code - first];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static void fixedTables(png_reader *png) {
+  uint8_t lengths[288];
+  int sym;
+
+  for(sym = 0; sym < 288; sym++)
+    lengths[sym] = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+  buildHuffman(&png->lit, lengths, 288);
+  for(sym = 0; sym < 30; sym++)
+    lengths[sym] = 5;
+  buildHuffman(&png->dist, lengths, 30);
+}
+
+// Code lengths of a dynamic block -> 0 on success
+static int dynamicTables(png_reader *png) {
+  uint8_t lengths[288 + 32];
+  png_huffman *lens = &png->dist;     // free until the block tables are built
+  int litCount, distCount, lenCount, ndx, sym, repeat, value;
+
+  if((litCount = getBits(png, 5)) < 0 || (distCount = getBits(png, 5)) < 0 || (lenCount = getBits(png, 4)) < 0)
+    return -1;
+  litCount += 257;
+  distCount += 1;
+  lenCount += 4;
+
+  memset(lengths, 0, 19);
+  for(ndx = 0; ndx < lenCount; ndx++) {
+    if((value = getBits(png, 3)) < 0)
+      return -1;
+    lengths[lengthOrder[ndx]] = value;
+  }
+  buildHuffman(lens, lengths, 19);
+
+  for(ndx = 0; ndx < litCount + distCount; ) {
+    if((sym = decodeSymbol(png, lens)) < 0)
+      return -1;
+    if(sym < 16) {
+      lengths[ndx++] = sym;
+      continue;
+    }
+    if(sym == 16) {
+      if(ndx == 0 || (repeat = getBits(png, 2)) < 0)
+        return -1;
+      value = lengths[ndx - 1];
+      repeat += 3;
+    } else {
+      if((repeat = getBits(png, sym == 17 ? 3 : 7)) < 0)
+        return -1;
+      value = 0;
+      repeat += sym == 17 ? 3 : 11;
+    }
+    if(ndx + repeat > litCount + distCount)
+      return -1;
+    while(repeat--)
+      lengths[ndx++] = value;
+  }
+
+  buildHuffman(&png->lit, lengths, litCount);
+  buildHuffman(&png->dist, lengths + litCount, distCount);
+  return 0;
+}
+
+static void emitByte(png_reader *png, unsigned char byte) {
+  png->window[png->windowPos++ & WINDOW_MASK] = byte;
+}
+
+// Inflate the next count bytes into out -> 0 on success
+static int inflateBytes(png_reader *png, unsigned char *out, int count) {
+  int produced = 0, sym, value, header;
+
+  while(produced < count) {
+    // Pending match from the window
+    if(png->copyLen) {
+      while(png->copyLen && produced < count) {
+        unsigned char byte = png->window[(png->windowPos - png->copyDist) & WINDOW_MASK];
+        emitByte(png, byte);
+        out[produced++] = byte;
+        png->copyLen--;
+      }
+      continue;
+    }
+
+    if(png->blockMode == PNG_BLOCK_NEW) {
+      if(png->lastBlock || (header = getBits(png, 3)) < 0)
+        return -1;
+      png->lastBlock = header & 1;
+      if((header >> 1) == 0) {
+        unsigned char lens[4];
+        int ndx;
+        // Stored block: byte aligned length and its complement
+        getBits(png, png->bitCount & 7);
+        for(ndx = 0; ndx < 4; ndx++)
+          if((value = getBits(png, 8)) < 0)
+            return -1;
+          else
+            lens[ndx] = value;
+        png->storedLeft = lens[0] | lens[1] << 8;
+        if((png->storedLeft ^ (lens[2] | lens[3] << 8)) != 0xffff)
+          return -1;
+        png->blockMode = PNG_BLOCK_STORED;
+      } else if((header >> 1) == 1) {
+        fixedTables(png);
+        png->blockMode = PNG_BLOCK_CODED;
+      } else if((header >> 1) == 2) {
+        if(dynamicTables(png) != 0)
+          return -1;
+        png->blockMode = PNG_BLOCK_CODED;
+      } else
+        return -1;
+      continue;
+    }
+
+    if(png->blockMode == PNG_BLOCK_STORED) {
+      if(png->storedLeft == 0) {
+        png->blockMode = PNG_BLOCK_NEW;
+        continue;
+      }
+      if((value = getBits(png, 8)) < 0)
+        return -1;
+      emitByte(png, value);
+      out[produced++] = value;
+      png->storedLeft--;
+      continue;
+    }
+
+    // Literal, end of block or length/distance pair
+    if((sym = decodeSymbol(png, &png->lit)) < 0)
+      return -1;
+    if(sym < 256) {
+      emitByte(png, sym);
+      out[produced++] = sym;
+    } else if(sym == 256)
+      png->blockMode = PNG_BLOCK_NEW;
+    else {
+      sym -= 257;
+      if(sym >= 29 || (value = getBits(png, lengthExtra[sym])) < 0)
+        return -1;
+      png->copyLen = lengthBase[sym] + value;
+      if((sym = decodeSymbol(png, &png->dist)) < 0 || sym >= 30 || (value = getBits(png, distExtra[sym])) < 0)
+        return -1;
+      png->copyDist = distBase[sym] + value;
+      if(png->copyDist > png->windowPos)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static int paeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// Undo the scanline filter in place against the previous scanline
+static int unfilter(int filter, unsigned char *row, const unsigned char *prev, int length, int bpp) {
+  int ndx;
+
+  switch(filter) {
+    case 0: break;
+    case 1:
+      for(ndx = bpp; ndx < length; ndx++)
+        row[ndx] += row[ndx - bpp];
+      break;
+    case 2:
+      for(ndx = 0; ndx < length; ndx++)
+        row[ndx] += prev[ndx];
+      break;
+    case 3:
+      for(ndx = 0; ndx < length; ndx++)
+        row[ndx] += ((ndx >= bpp ? row[ndx - bpp] : 0) + prev[ndx]) >> 1;
+      break;
+    case 4:
+      for(ndx = 0; ndx < length; ndx++)
+        row[ndx] += paeth(ndx >= bpp ? row[ndx - bpp] : 0, prev[ndx], ndx >= bpp ? prev[ndx - bpp] : 0);
+      break;
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+// Raw sample ndx of a scanline
+static int sampleAt(const unsigned char *row, int ndx, int depth) {
+  if(depth == 8)
+    return row[ndx];
+  if(depth == 16)
+    return row[2 * ndx] << 8 | row[2 * ndx + 1];
+  return (row[(ndx * depth) >> 3] >> (8 - depth - ((ndx * depth) & 7))) & ((1 << depth) - 1);
+}
+
+// Sample scaled to 0..255
+static int sample8(int value, int depth) {
+  if(depth == 16)
+    return value >> 8;
+  return depth == 8 ? value : value * 255 / ((1 << depth) - 1);
+}
+
+// Signature, header chunks and zlib header, scanline buffers allocated
+static int startPNG(png_reader *png, FILE *in) {
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  unsigned char head[13], buf[8], rgb[3];
+  uint32_t length, ndx;
+  char type[4];
+  int interlace = 0, cmf, flg, seenHeader = 0;
+
+  memset(png, 0, sizeof(png_reader));
+  png->in = in;
+  memset(png->paletteAlpha, 255, sizeof(png->paletteAlpha));
+
+  if(inputBytes(png, buf, 8) != 0 || memcmp(buf, signature, 8) != 0) {
+    printf("Not a PNG file\n");
+    return -1;
+  }
+
+  // Header chunks up to the first IDAT
+  for(;;) {
+    if(chunkHeader(png, &length, type) != 0) {
+      printf("PNG has no image data\n");
+      return -1;
+    }
+    if(memcmp(type, "IDAT", 4) == 0)
+      break;
+
+    if(memcmp(type, "IHDR", 4) == 0 && length == 13) {
+      if(inputBytes(png, head, 13) != 0)
+        return -1;
+      png->width = bigEndian(head);
+      png->height = bigEndian(head + 4);
+      png->bitDepth = head[8];
+      png->colorType = head[9];
+      interlace = head[12];
+      seenHeader = 1;
+    } else if(memcmp(type, "PLTE", 4) == 0 && length % 3 == 0 && length <= 768) {
+      for(ndx = 0; ndx < length / 3; ndx++) {
+        if(inputBytes(png, rgb, 3) != 0)
+          return -1;
+        png->paletteGray[ndx] = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8;
+      }
+    } else if(memcmp(type, "tRNS", 4) == 0 && length <= 256) {
+      for(ndx = 0; ndx < length; ndx++) {
+        int c = inputByte(png);
+        if(c < 0)
+          return -1;
+        if(png->colorType == 3)
+          png->paletteAlpha[ndx] = c;
+        else if(ndx < 6 && (ndx & 1))
+          png->key[ndx >> 1] |= c;
+        else if(ndx < 6)
+          png->key[ndx >> 1] = c << 8;
+      }
+      png->hasKey = png->colorType == 0 || png->colorType == 2;
+    } else if(inputBytes(png, NULL, length) != 0)
+      return -1;
+
+    // CRC
+    if(inputBytes(png, NULL, 4) != 0)
+      return -1;
+  }
+  png->chunkLeft = length;
+
+  if(!seenHeader || png->width <= 0 || png->height <= 0) {
+    printf("PNG header missing or invalid\n");
+    return -1;
+  }
+  if(interlace) {
+    printf("Interlaced PNG is not supported, save it without interlacing\n");
+    return -1;
+  }
+  switch(png->colorType) {
+    case 0: png->channels = 1; break;
+    case 2: png->channels = 3; break;
+    case 3: png->channels = 1; break;
+    case 4: png->channels = 2; break;
+    case 6: png->channels = 4; break;
+    default:
+      printf("Unknown PNG color type %d\n", png->colorType);
+      return -1;
+  }
+  if(png->bitDepth != 1 && png->bitDepth != 2 && png->bitDepth != 4 && png->bitDepth != 8 && png->bitDepth != 16) {
+    printf("Unsupported PNG bit depth %d\n", png->bitDepth);
+    return -1;
+  }
+
+  png->rowBytes = ((size_t)png->width * png->channels * png->bitDepth + 7) / 8;
+  png->pixelBytes = (png->channels * png->bitDepth + 7) / 8;
+  png->prev = calloc(png->rowBytes + 1, 1);
+  png->cur = calloc(png->rowBytes + 1, 1);
+  if(!png->prev || !png->cur) {
+    printf("Could not allocate PNG scanlines\n");
+    return -1;
+  }
+
+  // zlib header: deflate, no preset dictionary
+  cmf = dataByte(png);
+  flg = dataByte(png);
+  if(cmf < 0 || flg < 0 || (cmf & 15) != 8 || (flg & 32) || (cmf << 8 | flg) % 31) {
+    printf("Bad PNG data stream\n");
+    return -1;
+  }
+  png->blockMode = PNG_BLOCK_NEW;
+  return 0;
+}
+
+// Read signature and header chunks up to the image data -> 0 on success,
+// on failure nothing is left allocated
+int openPNG(png_reader *png, FILE *in) {
+  if(startPNG(png, in) == 0)
+    return 0;
+  closePNG(png);
+  return -1;
+}
+
+// Inflate and unfilter the next scanline, left in prev -> 0 on success
+static int nextScanline(png_reader *png) {
+  unsigned char *swap;
+
+  if(png->row >= png->height)
+    return -1;
+  if(inflateBytes(png, png->cur, png->rowBytes + 1) != 0 ||
+     unfilter(png->cur[0], png->cur + 1, png->prev + 1, png->rowBytes, png->pixelBytes) != 0) {
+    printf("Corrupt PNG data at row %d\n", png->row);
+    png->row = png->height;
+    return -1;
+  }
+  swap = png->prev;
+  png->prev = png->cur;
+  png->cur = swap;
+  png->row++;
+  return 0;
+}
+
+// Darkness of pixel x of the current scanline, 0 for transparent
+static int pixelInk(png_reader *png, int x) {
+  const unsigned char *line = png->prev + 1;
+  int ndx = x * png->channels, depth = png->bitDepth, gray, alpha;
+
+  switch(png->colorType) {
+    case 3:
+      gray = png->paletteGray[sampleAt(line, ndx, depth)];
+      alpha = png->paletteAlpha[sampleAt(line, ndx, depth)];
+      break;
+    case 0:
+    case 4:
+      gray = sampleAt(line, ndx, depth);
+      alpha = png->colorType == 4 ? sample8(sampleAt(line, ndx + 1, depth), depth)
+                                  : (png->hasKey && gray == png->key[0] ? 0 : 255);
+      gray = sample8(gray, depth);
+      break;
+    default: {
+      int r = sampleAt(line, ndx, depth), g = sampleAt(line, ndx + 1, depth), b = sampleAt(line, ndx + 2, depth);
+      alpha = png->colorType == 6 ? sample8(sampleAt(line, ndx + 3, depth), depth)
+              : (png->hasKey && r == png->key[0] && g == png->key[1] && b == png->key[2] ? 0 : 255);
+      gray = (77 * sample8(r, depth) + 150 * sample8(g, depth) + 29 * sample8(b, depth)) >> 8;
+      break;
+    }
+  }
+  return alpha >= 128 ? 255 - gray : 0;
+}
+
+int readPNGRow(png_reader *png, uint64_t *bits, int width) {
+  int x, count = width < png->width ? width : png->width;
+
+  memset(bits, 0, sizeof(uint64_t) * ((width + 63) >> 6));
+  if(nextScanline(png) != 0)
+    return -1;
+
+  // Dark, opaque pixels are ink
+  for(x = 0; x < count; x++)
+    if(pixelInk(png, x) >= 128)
+      bits[x >> 6] |= 1ULL << (x & 63);
+  return 0;
+}
+
+int readPNGInk(png_reader *png, unsigned char *ink, int width) {
+  int x, count = width < png->width ? width : png->width;
+
+  memset(ink, 0, width);
+  if(nextScanline(png) != 0)
+    return -1;
+  for(x = 0; x < count; x++)
+    ink[x] = pixelInk(png, x);
+  return 0;
+}
+
+void closePNG(png_reader *png) {
+  free(png->prev);
+  free(png->cur);
+  png->prev = png->cur = NULL;
+}
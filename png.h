@@ -0,0 +1,61 @@
+// Chris Polis
+// png.h - dependency free PNG scanline reader for extrusion input
+
+#ifndef __include_png
+#define __include_png
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PNG_WINDOW_SIZE (1 << 15)     // deflate history
+#define PNG_INPUT_SIZE  (1 << 16)     // file read buffer
+#define PNG_FAST_BITS   9             // huffman codes decoded by one lookup
+
+// Canonical huffman code: one table lookup for short codes, else by length
+typedef struct png_huffman_st {
+  uint16_t fast[1 << PNG_FAST_BITS];  // symbol << 4 | length, 0: longer code
+  uint16_t count[16];                 // codes per length
+  uint16_t symbol[288];               // symbols in code order
+} png_huffman;
+
+// Decoder state, inflate resumes wherever the last scanline stopped
+typedef struct png_reader_st {
+  FILE *in;
+  unsigned char input[PNG_INPUT_SIZE];
+  size_t inputPos, inputLen;
+  uint32_t chunkLeft;                 // IDAT bytes not yet read
+  int dataDone;                       // past the last IDAT
+
+  int width, height, bitDepth, colorType, channels;
+  int pixelBytes, rowBytes;           // filter unit, bytes per scanline
+  int row;
+  unsigned char *prev, *cur;          // filter byte + scanline
+  unsigned char paletteGray[256], paletteAlpha[256];
+  int hasKey;                         // tRNS colour key for gray/RGB
+  uint16_t key[3];
+
+  uint64_t bitBuf;
+  int bitCount;
+  unsigned char window[PNG_WINDOW_SIZE];
+  uint32_t windowPos;
+  int blockMode, lastBlock;           // PNG_BLOCK_* below
+  uint32_t storedLeft, copyLen, copyDist;
+  png_huffman lit, dist;
+} png_reader;
+
+// Read signature and header chunks up to the image data -> 0 on success,
+// on failure nothing is left allocated
+int openPNG(png_reader *png, FILE *in);
+
+// Next scanline thresholded into bits [0, width): dark opaque pixels set.
+// Pixels past the image width are left clear -> 0 on success
+int readPNGRow(png_reader *png, uint64_t *bits, int width);
+
+// Next scanline as darkness 0..255 per pixel (255 - luma, 0 where the
+// pixel is transparent), zero past the image width -> 0 on success
+int readPNGInk(png_reader *png, unsigned char *ink, int width);
+
+// Release scanline buffers
+void closePNG(png_reader *png);
+
+#endif
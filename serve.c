@@ -0,0 +1,369 @@
+// Chris Polis
+// serve.c - persistent extrusion server on a UNIX domain socket
+//
+// Usage: $ extrude --serve [socket] [--workers #]
+//
+// One job per connection. The client sends a line of extrude arguments:
+//    [input file | -] [width(px)] [height(px)] [output (.stl) | -] [options]
+// With input "-", --data [#] bytes of .png or .hmp image follow the line.
+// With output "-", the STL comes back on the connection (not with
+// --progressive, whose previews are written next to the output). Replies:
+//    OK [triangles] [output file]\n
+//    OK [triangles] [bytes]\n followed by the STL
+//    ERR [message]\n
+// Jobs queue on the listening thread and run on the worker pool, each
+// worker keeping its heightmap, PNG decoder, writer and image buffers.
+// The socket is only open to the server's user. File paths in a job
+// (input, output, --addto, --cache, --stats=file) must be relative to
+// the server's directory and may not contain "..". A client has
+// SERVE_TIMEOUT seconds for each read of its request line and image
+// bytes, and --data is at most SERVE_MAX_DATA bytes.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+#include "extrude.h"
+
+#define SERVE_QUEUE_SIZE 256      // connections waiting for a worker
+#define SERVE_LINE_SIZE  4096     // longest request line
+#define SERVE_MAX_ARGS   64
+#define SERVE_TIMEOUT    30       // seconds a stalled client holds a worker
+#define SERVE_MAX_DATA   (64L << 20) // largest --data image
+
+typedef struct serve_queue_st {
+  int fds[SERVE_QUEUE_SIZE];
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, room;
+} serve_queue;
+
+// Per worker state reused by every job it runs
+typedef struct serve_worker_st {
+  serve_queue *queue;
+  extrude_buffers bufs;
+  char *data;                     // inline image bytes
+  size_t dataAlloc;
+  FILE *result;                   // temp file for streamed output
+} serve_worker;
+
+// getopt keeps global state
+static pthread_mutex_t argsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Socket file, removed when the server stops
+static char socketPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// Send a whole buffer -> 0 on success
+static int sendAll(int fd, const char *bytes, size_t size) {
+  ssize_t sent;
+
+  while(size > 0) {
+    if((sent = write(fd, bytes, size)) <= 0)
+      return -1;
+    bytes += sent;
+    size -= sent;
+  }
+  return 0;
+}
+
+static void reply(int fd, const char *msg) {
+  sendAll(fd, msg, strlen(msg));
+}
+
+// Split line into argv after a leading "extrude", return argc
+static int splitArgs(char *line, char **argv) {
+  int argc = 0;
+  char *tok;
+
+  argv[argc++] = "extrude";
+  for(tok = strtok(line, " \t\r\n"); tok && argc < SERVE_MAX_ARGS; tok = strtok(NULL, " \t\r\n"))
+    argv[argc++] = tok;
+  argv[argc] = NULL;
+  return argc;
+}
+
+// 1 for "-" or a relative path without ".." components
+static int allowedPath(const char *path) {
+  const char *part;
+
+  if(!path || strcmp(path, "-") == 0)
+    return 1;
+  if(path[0] == '/')
+    return 0;
+  for(part = path; part; part = strchr(part, '/') ? strchr(part, '/') + 1 : NULL)
+    if(strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+      return 0;
+  return 1;
+}
+
+// First path of the job outside the server's directory, NULL if none
+static const char *forbiddenPath(const extrude_opts *opts, const char *source, const char *dest) {
+  const char *paths[5] = { source, dest, opts->addTo, opts->cacheDir, opts->statsFile };
+  int ndx;
+
+  for(ndx = 0; ndx < 5; ndx++)
+    if(!allowedPath(paths[ndx]))
+      return paths[ndx];
+  return NULL;
+}
+
+// Stream the finished STL in result back -> 0 on success
+static int sendResult(int fd, FILE *result, int triCount) {
+  char head[64];
+  off_t offset = 0;
+  long size;
+  ssize_t sent;
+
+  fflush(result);
+  fseek(result, 0, SEEK_END);
+  size = ftell(result);
+  snprintf(head, sizeof(head), "OK %d %ld\n", triCount, size);
+  if(sendAll(fd, head, strlen(head)) != 0)
+    return -1;
+  while(offset < size)
+    if((sent = sendfile(fd, fileno(result), &offset, size - offset)) <= 0)
+      return -1;
+  return 0;
+}
+
+// Run the job on one connection, req reads from it
+static void runJob(serve_worker *worker, FILE *req, int fd) {
+  char line[SERVE_LINE_SIZE], msg[SERVE_LINE_SIZE + 64];
+  char *argv[SERVE_MAX_ARGS + 1];
+  const char *forbidden;
+  char *source, *dest;
+  int argc, first, imgWidth, imgHeight, isPNG, triCount, c;
+  extrude_opts opts;
+  FILE *in = NULL, *out = NULL;
+
+  if(!fgets(line, sizeof(line), req) || (!strchr(line, '\n') && ferror(req))) {
+    reply(fd, "ERR empty request or timed out\n");
+    return;
+  }
+  if(!strchr(line, '\n') && strlen(line) == sizeof(line) - 1) {
+    while((c = getc(req)) != EOF && c != '\n')
+      ;
+    reply(fd, "ERR line too long\n");
+    return;
+  }
+  argc = splitArgs(line, argv);
+
+  pthread_mutex_lock(&argsLock);
+  defaultOpts(&opts);
+  optind = 0;
+  opterr = 0;
+  parseArgs(&opts, argc, argv);
+  first = optind;
+  pthread_mutex_unlock(&argsLock);
+
+  if(argc - first < 4 || opts.serve || (opts.progressive && strcmp(argv[first + 3], "-") == 0)) {
+    reply(fd, "ERR usage: [input | -] [width(px)] [height(px)] [output | -] [options], --progressive needs an output file\n");
+    freeOpts(&opts);
+    return;
+  }
+  source = argv[first];
+  imgWidth = atoi(argv[first + 1]);
+  imgHeight = atoi(argv[first + 2]);
+  dest = argv[first + 3];
+  if((forbidden = forbiddenPath(&opts, source, dest))) {
+    snprintf(msg, sizeof(msg), "ERR path not allowed: %s\n", forbidden);
+    reply(fd, msg);
+    freeOpts(&opts);
+    return;
+  }
+
+  // Image from the connection or from a file
+  if(strcmp(source, "-") == 0) {
+    if(opts.dataBytes <= 0 || opts.dataBytes > SERVE_MAX_DATA) {
+      snprintf(msg, sizeof(msg), "ERR input - needs --data [bytes], at most %ld\n", SERVE_MAX_DATA);
+      reply(fd, msg);
+      freeOpts(&opts);
+      return;
+    }
+    // The connection is closed unread on failure
+    if((size_t)opts.dataBytes > worker->dataAlloc) {
+      free(worker->data);
+      worker->dataAlloc = 0;
+      if(!(worker->data = malloc(opts.dataBytes))) {
+        reply(fd, "ERR could not allocate --data bytes\n");
+        freeOpts(&opts);
+        return;
+      }
+      worker->dataAlloc = opts.dataBytes;
+    }
+    if(fread(worker->data, 1, opts.dataBytes, req) != (size_t)opts.dataBytes) {
+      reply(fd, "ERR --data bytes short or timed out\n");
+      freeOpts(&opts);
+      return;
+    }
+    in = fmemopen(worker->data, opts.dataBytes, "r");
+    isPNG = in && opts.dataBytes >= 8 && memcmp(worker->data, "\x89PNG", 4) == 0;
+  } else {
+    in = fopen(source, "r");
+    isPNG = !strstr(source, ".hmp");
+  }
+
+  // Output to a file or the worker's temp file
+  if(strcmp(dest, "-") == 0) {
+    if(!worker->result)
+      worker->result = tmpfile();
+    if(worker->result && ftruncate(fileno(worker->result), 0) == 0) {
+      rewind(worker->result);
+      out = worker->result;
+    }
+  } else
+    out = fopen(dest, "w");
+
+  if(!in || !out || imgWidth <= 0 || imgHeight <= 0) {
+    snprintf(msg, sizeof(msg), "ERR could not open %s\n", !in ? source : !out ? dest : "image size");
+    reply(fd, msg);
+  } else {
+    scaleOpts(&opts, imgWidth, imgHeight);
+    if(opts.stats)
+      startStats(opts.stats);
+    if(opts.progressive)
+      triCount = progressiveExtrude(&opts, in, isPNG, out, dest, imgWidth, imgHeight, &worker->bufs);
+    else
+      triCount = extrudeImage(&opts, in, isPNG, out, imgWidth, imgHeight, &worker->bufs);
+    reportStats(&opts, source, imgWidth, imgHeight, triCount);
+    if(triCount < 0)
+      reply(fd, "ERR extrusion failed\n");
+    else if(out == worker->result)
+      sendResult(fd, out, triCount);
+    else {
+      fflush(out);
+      snprintf(msg, sizeof(msg), "OK %d %s\n", triCount, dest);
+      reply(fd, msg);
+    }
+  }
+
+  if(in)
+    fclose(in);
+  if(out && out != worker->result)
+    fclose(out);
+  freeOpts(&opts);
+}
+
+// Take queued connections until the server exits
+static void *serveWorker(void *arg) {
+  serve_worker *worker = arg;
+  serve_queue *queue = worker->queue;
+  struct timeval timeout = { SERVE_TIMEOUT, 0 };
+  FILE *req;
+  int fd;
+
+  for(;;) {
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == 0)
+      pthread_cond_wait(&queue->ready, &queue->lock);
+    fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % SERVE_QUEUE_SIZE;
+    queue->count--;
+    pthread_cond_signal(&queue->room);
+    pthread_mutex_unlock(&queue->lock);
+
+    // A client that stops sending gets an error instead of the worker
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(!(req = fdopen(fd, "r"))) {
+      close(fd);
+      continue;
+    }
+    runJob(worker, req, fd);
+    fclose(req);
+  }
+  return NULL;
+}
+
+// Remove the socket file and exit
+static void stopServer(int sig) {
+  unlink(socketPath);
+  _exit(128 + sig);
+}
+
+// Listen on path, queue connections for worker threads -> 1 on failure
+int serveExtrude(const char *path, int workers) {
+  struct sockaddr_un addr;
+  serve_queue queue;
+  serve_worker *pool;
+  pthread_t thread;
+  mode_t mask;
+  int listener, fd, ndx, bound, started = 0;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Socket path too long: %s\n", path);
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  // Socket file for the server's user only, gone when the server stops
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  mask = umask(0077);
+  bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if(!bound || listen(listener, SERVE_QUEUE_SIZE) != 0) {
+    perror(path);
+    if(bound)
+      unlink(path);
+    return 1;
+  }
+  strcpy(socketPath, path);
+  signal(SIGINT, stopServer);
+  signal(SIGTERM, stopServer);
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&queue, 0, sizeof(queue));
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.ready, NULL);
+  pthread_cond_init(&queue.room, NULL);
+
+  workers = workers < 1 ? 1 : workers;
+  pool = calloc(workers, sizeof(serve_worker));
+  for(ndx = 0; ndx < workers; ndx++) {
+    pool[ndx].queue = &queue;
+    if(pthread_create(&thread, NULL, serveWorker, &pool[ndx]) == 0) {
+      pthread_detach(thread);
+      started++;
+    }
+  }
+  if(started == 0) {
+    printf("Could not start workers\n");
+    unlink(path);
+    return 1;
+  }
+  printf("serving on %s with %d workers\n", path, started);
+  fflush(stdout);
+
+  // Accept and queue, waiting while every slot is taken
+  for(;;) {
+    if((fd = accept(listener, NULL, NULL)) < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    pthread_mutex_lock(&queue.lock);
+    while(queue.count == SERVE_QUEUE_SIZE)
+      pthread_cond_wait(&queue.room, &queue.lock);
+    queue.fds[(queue.head + queue.count) % SERVE_QUEUE_SIZE] = fd;
+    queue.count++;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+  }
+  perror("accept");
+  close(listener);
+  unlink(path);
+  return 1;
+}
@@ -0,0 +1,109 @@
+// Chris Polis
+// stats.c - per phase timers and counters for extrude --stats
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+static const char *phaseNames[PHASE_COUNT] = {
+  "template", "parse", "yz_walls", "xz_walls", "xy_faces", "extrude", "base", "finish"
+};
+
+double statsClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Peak resident set in KB
+static long peakRSS(void) {
+  struct rusage usage;
+  return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+// Bytes the writer has taken, flushed or not
+static uint64_t writerTotal(const stl_writer *w) {
+  return w ? w->bytes + w->len : 0;
+}
+
+void startStats(extrude_stats *s) {
+  memset(s, 0, sizeof(extrude_stats));
+  s->start = s->phaseStart = statsClock();
+}
+
+void beginPhase(extrude_stats *s, const stl_writer *w) {
+  if(!s)
+    return;
+  s->phaseStart = statsClock();
+  s->phaseBytes = writerTotal(w);
+}
+
+void endPhase(extrude_stats *s, stats_phase phase, const stl_writer *w, int tris, int runs) {
+  phase_stats *p;
+
+  if(!s)
+    return;
+  p = &s->phases[phase];
+  p->calls++;
+  p->seconds += statsClock() - s->phaseStart;
+  p->tris += tris;
+  p->runs += runs;
+  p->bytes += writerTotal(w) - s->phaseBytes;
+  p->peakRSS = peakRSS();
+
+  // Back to back phases need no beginPhase
+  s->phaseStart = statsClock();
+  s->phaseBytes = writerTotal(w);
+}
+
+// s as a JSON string
+static void writeString(FILE *out, const char *s) {
+  fputc('"', out);
+  for(; s && *s; s++) {
+    if(*s == '"' || *s == '\\')
+      fputc('\\', out);
+    if((unsigned char)*s >= 0x20)
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+// Jobs of a server report to the same stderr at once, so the line is
+// built in memory and written whole
+int writeStats(const extrude_stats *s, FILE *out, const char *source, int width, int height, int triCount) {
+  const phase_stats *p;
+  char *text = NULL;
+  size_t size = 0;
+  int ndx, first = 1, result;
+  FILE *line = open_memstream(&text, &size);
+
+  if(!line)
+    return -1;
+  fprintf(line, "{ \"source\": ");
+  writeString(line, source);
+  fprintf(line, ", \"width\": %d, \"height\": %d, \"triangles\": %d, \"seconds\": %.6f, "
+                "\"process_peak_rss_kb\": %ld, \"phases\": {",
+          width, height, triCount, statsClock() - s->start, peakRSS());
+  for(ndx = 0; ndx < PHASE_COUNT; ndx++) {
+    p = &s->phases[ndx];
+    if(!p->calls)
+      continue;
+    fprintf(line, "%s\"%s\": { \"calls\": %d, \"seconds\": %.6f, \"tris\": %llu, \"runs\": %llu, "
+                  "\"bytes\": %llu, \"process_peak_rss_kb\": %ld }",
+            first ? " " : ", ", phaseNames[ndx], p->calls, p->seconds, (unsigned long long)p->tris,
+            (unsigned long long)p->runs, (unsigned long long)p->bytes, p->peakRSS);
+    first = 0;
+  }
+  fprintf(line, " } }\n");
+  if(fclose(line) != 0) {
+    free(text);
+    return -1;
+  }
+
+  result = fwrite(text, 1, size, out) == size && fflush(out) == 0 ? 0 : -1;
+  free(text);
+  return result;
+}
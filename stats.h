@@ -0,0 +1,56 @@
+// Chris Polis
+// stats.h - per phase timers and counters for extrude --stats
+
+#ifndef __include_stats
+#define __include_stats
+
+#include <stdio.h>
+#include <stdint.h>
+#include "stl_io.h"
+
+// Phases of one extrusion. Modes that interleave parsing and the face
+// passes (--stream, --levels, --incremental) count them as PHASE_EXTRUDE
+typedef enum stats_phase_en {
+  PHASE_TEMPLATE,
+  PHASE_PARSE,
+  PHASE_YZ,
+  PHASE_XZ,
+  PHASE_XY,
+  PHASE_EXTRUDE,
+  PHASE_BASE,
+  PHASE_FINISH,
+  PHASE_COUNT
+} stats_phase;
+
+typedef struct phase_stats_st {
+  int calls;
+  double seconds;
+  uint64_t tris;
+  uint64_t runs;            // wall runs, or rectangles for PHASE_XY
+  uint64_t bytes;           // taken by the writer (quantized output is encoded in finish)
+  long peakRSS;             // KB, whole process high water mark when it last ended,
+                            // not per job under --serve
+} phase_stats;
+
+typedef struct extrude_stats_st {
+  phase_stats phases[PHASE_COUNT];
+  double start, phaseStart;
+  uint64_t phaseBytes;      // writer bytes when the phase began
+} extrude_stats;
+
+// Monotonic clock in seconds
+double statsClock(void);
+
+// Clear counters and start the job clock
+void startStats(extrude_stats *s);
+
+// Phase begins, w (may be NULL) counts its bytes. s NULL: no-op
+void beginPhase(extrude_stats *s, const stl_writer *w);
+
+// Phase ends with tris and runs emitted. s NULL: no-op
+void endPhase(extrude_stats *s, stats_phase phase, const stl_writer *w, int tris, int runs);
+
+// JSON report of the job, one line handed to out in a single write -> 0 on success
+int writeStats(const extrude_stats *s, FILE *out, const char *source, int width, int height, int triCount);
+
+#endif
@@ -0,0 +1,125 @@
+// Chris Polis
+// stl_builder.c - growable triangle lists on a chunked arena
+
+#include <stdlib.h>
+#include <string.h>
+#include "stl_builder.h"
+
+// Room for n contiguous triangles at the end, return the first. NULL and
+// failed set when out of memory: face writers append without checking and
+// the failure comes back from writeBuilder
+stl_tri *builderReserve(tri_builder *b, int n) {
+  tri_chunk *chunk = b->last;
+
+  if(!chunk || chunk->count + n > chunk->alloc) {
+    // Next spare chunk if it fits, else a new one linked in before the spares
+    if(chunk && chunk->next && chunk->next->alloc >= n)
+      chunk = chunk->next;
+    else if(!chunk && b->first && b->first->alloc >= n)
+      chunk = b->first;
+    else {
+      int alloc = n > TRI_ALLOC_SIZE ? n : TRI_ALLOC_SIZE;
+      tri_chunk *fresh = malloc(sizeof(tri_chunk) + sizeof(stl_tri) * alloc);
+      if(!fresh) {
+        b->failed = 1;
+        return NULL;
+      }
+      fresh->alloc = alloc;
+      if(chunk) {
+        fresh->next = chunk->next;
+        chunk->next = fresh;
+      } else {
+        fresh->next = b->first;
+        b->first = fresh;
+      }
+      chunk = fresh;
+    }
+    chunk->count = 0;
+    b->last = chunk;
+  }
+  chunk->count += n;
+  b->count += n;
+  return chunk->tris + chunk->count - n;
+}
+
+// Append a copy of n triangles -> 0 on success
+int builderAppend(tri_builder *b, const stl_tri *tris, int n) {
+  stl_tri *room;
+  int part;
+
+  while(n > 0) {
+    part = b->last ? b->last->alloc - b->last->count : 0;
+    part = part > 0 ? (part < n ? part : n) : (n < TRI_ALLOC_SIZE ? n : TRI_ALLOC_SIZE);
+    if(!(room = builderReserve(b, part)))
+      return -1;
+    memcpy(room, tris, sizeof(stl_tri) * part);
+    tris += part;
+    n -= part;
+  }
+  return 0;
+}
+
+// Chunks in use: for(c = firstChunk(b); c; c = nextChunk(b, c))
+tri_chunk *firstChunk(const tri_builder *b) {
+  return b->last ? b->first : NULL;
+}
+tri_chunk *nextChunk(const tri_builder *b, tri_chunk *chunk) {
+  return chunk == b->last ? NULL : chunk->next;
+}
+
+// Empty, keeping every chunk for reuse, O(1)
+void resetBuilder(tri_builder *b) {
+  b->last = NULL;
+  b->count = 0;
+}
+
+// Release all chunks
+void freeBuilder(tri_builder *b) {
+  tri_chunk *chunk, *next;
+
+  for(chunk = b->first; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  b->first = b->last = NULL;
+  b->count = 0;
+  b->failed = 0;
+}
+
+// Write the triangles in order and reset, return # written, -1 without
+// writing anything once an append has failed
+int writeBuilder(stl_writer *out, tri_builder *b) {
+  int count = b->count;
+  tri_chunk *chunk;
+
+  if(b->failed) {
+    resetBuilder(b);
+    return -1;
+  }
+  for(chunk = firstChunk(b); chunk; chunk = nextChunk(b, chunk))
+    writerTriArray(out, chunk->count, chunk->tris);
+  resetBuilder(b);
+  return count;
+}
+
+// Face and solid constructors of stl_util appending to b
+void appendXYFace(tri_builder *b, float *vertexA, float *vertexB, float *normal) {
+  stl_tri *tris = builderReserve(b, 2);
+  if(tris)
+    createXYFace(tris, vertexA, vertexB, normal);
+}
+void appendXZFace(tri_builder *b, float *vertexA, float *vertexB, float *normal) {
+  stl_tri *tris = builderReserve(b, 2);
+  if(tris)
+    createXZFace(tris, vertexA, vertexB, normal);
+}
+void appendYZFace(tri_builder *b, float *vertexA, float *vertexB, float *normal) {
+  stl_tri *tris = builderReserve(b, 2);
+  if(tris)
+    createYZFace(tris, vertexA, vertexB, normal);
+}
+void appendRectPrism(tri_builder *b, float *root, float x, float y, float z) {
+  stl_tri *tris = builderReserve(b, 12);
+  if(tris)
+    createRectPrism(tris, root, x, y, z);
+}
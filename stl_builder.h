@@ -0,0 +1,57 @@
+// Chris Polis
+// stl_builder.h - growable triangle lists on a chunked arena
+
+#ifndef __include_stl_builder
+#define __include_stl_builder
+
+#include "stl_util.h"
+#include "stl_io.h"
+
+#define TRI_ALLOC_SIZE 20000      // triangles per arena chunk
+
+// Contiguous run of triangles, chunks are kept for reuse after a reset
+typedef struct tri_chunk_st {
+  struct tri_chunk_st *next;
+  int count, alloc;
+  stl_tri tris[];
+} tri_chunk;
+
+// Triangles in append order over a list of chunks: first .. last are in
+// use, chunks after last are spare. Zeroed is empty (TRI_BUILDER_INIT)
+typedef struct tri_builder_st {
+  tri_chunk *first, *last;
+  int count;                      // triangles in use
+  int failed;                     // an append ran out of memory, kept until freeBuilder
+} tri_builder;
+
+#define TRI_BUILDER_INIT { NULL, NULL, 0, 0 }
+
+// Room for n contiguous triangles at the end, return the first. NULL and
+// failed set when out of memory: face writers append without checking and
+// the failure comes back from writeBuilder
+stl_tri *builderReserve(tri_builder *b, int n);
+
+// Append a copy of n triangles -> 0 on success
+int builderAppend(tri_builder *b, const stl_tri *tris, int n);
+
+// Chunks in use: for(c = firstChunk(b); c; c = nextChunk(b, c))
+tri_chunk *firstChunk(const tri_builder *b);
+tri_chunk *nextChunk(const tri_builder *b, tri_chunk *chunk);
+
+// Empty, keeping every chunk for reuse, O(1)
+void resetBuilder(tri_builder *b);
+
+// Release all chunks
+void freeBuilder(tri_builder *b);
+
+// Write the triangles in order and reset, return # written, -1 without
+// writing anything once an append has failed
+int writeBuilder(stl_writer *out, tri_builder *b);
+
+// Face and solid constructors of stl_util appending to b
+void appendXYFace(tri_builder *b, float *vertexA, float *vertexB, float *normal);
+void appendXZFace(tri_builder *b, float *vertexA, float *vertexB, float *normal);
+void appendYZFace(tri_builder *b, float *vertexA, float *vertexB, float *normal);
+void appendRectPrism(tri_builder *b, float *root, float x, float y, float z);
+
+#endif
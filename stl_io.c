@@ -1,12 +1,23 @@
 // Chris Polis
 // stl_io.h - tools for input and output from STL files
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "stl_io.h"
 
+static void packTriArrayBin(unsigned char *recs, int triCount, const stl_tri *tris);
+
 //////////////////////////////////////////////////////
 // Input
 //////////////////////////////////////////////////////
@@ -16,19 +27,39 @@ stl_mode getFileMode(FILE *in) {
   char firstChar;
   stl_mode mode;
 
+  char magic[4] = { 0 };
+
   fseek(in, 0L, SEEK_SET);
-  fread(&firstChar, 1, 1, in);
+  fread(magic, 1, 4, in);
+  firstChar = magic[0];
   mode = firstChar == 's' ? ASCII : BINARY;
+  if(memcmp(magic, STL_QUANT_MAGIC, 4) == 0)
+    mode = QUANTIZED;
   fseek(in, 0L, SEEK_SET);
   return mode;
 }
 
+// Clamp declared tri count to the records that fit in size bytes
+static uint32_t checkTriCount(uint32_t declared, size_t size) {
+  size_t present = size < STL_HEADER_SIZE ? 0 : (size - STL_HEADER_SIZE) / STL_RECORD_SIZE;
+
+  if(declared > present) {
+    fprintf(stderr, "warning: header declares %u tris, file holds %zu\n", declared, present);
+    return (uint32_t)present;
+  }
+  return declared;
+}
+
 // Read bin header -> triCount
 uint32_t readBinaryHeader(FILE *in) {
-  uint32_t triCount;
+  uint32_t triCount = 0;
+  struct stat st;
 
   fseek(in, 80L, SEEK_SET);
-  fread(&triCount, 4, 1, in);
+  if(fread(&triCount, 4, 1, in) != 1)
+    return 0;
+  if(fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode))
+    triCount = checkTriCount(triCount, st.st_size);
   return triCount;
 }
 
@@ -42,22 +73,10 @@ void readASCIIHeader(FILE *in) {
 
 // Read tri from binary
 void readTriBin(FILE *in, stl_tri *tri) {
-  fread(&tri->normal[0], 4, 1, in);
-  fread(&tri->normal[1], 4, 1, in);
-  fread(&tri->normal[2], 4, 1, in);
+  unsigned char rec[STL_RECORD_SIZE];
 
-  fread(&tri->vertexA[0], 4, 1, in);
-  fread(&tri->vertexA[1], 4, 1, in);
-  fread(&tri->vertexA[2], 4, 1, in);
-
-  fread(&tri->vertexB[0], 4, 1, in);
-  fread(&tri->vertexB[1], 4, 1, in);
-  fread(&tri->vertexB[2], 4, 1, in);
-
-  fread(&tri->vertexC[0], 4, 1, in);
-  fread(&tri->vertexC[1], 4, 1, in);
-  fread(&tri->vertexC[2], 4, 1, in);
-  fseek(in, 2L, SEEK_CUR);
+  if(fread(rec, STL_RECORD_SIZE, 1, in) == 1)
+    unpackTriBin(rec, tri);
 }
 
 // Read tri from ASCII
@@ -90,6 +109,564 @@ int readTriASCII(FILE *in, stl_tri *tri) {
   return 1;
 }
 
+// Map whole file -> 0 on success, -1 on error
+static int mapFile(FILE *in, unsigned char **data, size_t *size, int *mapped) {
+  struct stat st;
+  size_t got, alloc;
+  unsigned char *grown;
+
+  *data = NULL;
+  *size = 0;
+  *mapped = 0;
+  if(!in)
+    return -1;
+
+  if(fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    *size = st.st_size;
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if(*data == MAP_FAILED) {
+      *data = NULL;
+    } else {
+      *mapped = 1;
+      madvise(*data, *size, MADV_SEQUENTIAL);
+      return 0;
+    }
+  }
+
+  // Pipes and other unmappable input -> read into memory
+  alloc = 1 << 20;
+  *size = 0;
+  *data = malloc(alloc);
+  fseek(in, 0L, SEEK_SET);
+  while(*data && (got = fread(*data + *size, 1, alloc - *size, in)) > 0) {
+    *size += got;
+    if(*size == alloc) {
+      if(!(grown = realloc(*data, alloc * 2))) {
+        free(*data);
+        *data = NULL;
+        *size = 0;
+        return -1;
+      }
+      *data = grown;
+      alloc *= 2;
+    }
+  }
+  return *data ? 0 : -1;
+}
+
+// Release mapFile data
+static void unmapFile(unsigned char *data, size_t size, int mapped) {
+  if(!data)
+    return;
+  if(mapped)
+    munmap(data, size);
+  else
+    free(data);
+}
+
+// Map binary STL -> 0 on success, -1 on error
+int openView(stl_view *view, FILE *in) {
+  uint32_t declared;
+
+  memset(view, 0, sizeof(stl_view));
+  if(mapFile(in, &view->data, &view->size, &view->mapped) != 0)
+    return -1;
+
+  if(view->size < STL_HEADER_SIZE) {
+    closeView(view);
+    return -1;
+  }
+  memcpy(&declared, view->data + 80, 4);
+  view->triCount = checkTriCount(declared, view->size);
+  return 0;
+}
+
+// Map binary STL read-write (shared), in must be opened "r+" -> 0 on success
+int openViewRW(stl_view *view, FILE *in) {
+  struct stat st;
+  uint32_t declared;
+
+  memset(view, 0, sizeof(stl_view));
+  if(!in || fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < STL_HEADER_SIZE)
+    return -1;
+
+  view->size = st.st_size;
+  view->data = mmap(NULL, view->size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(in), 0);
+  if(view->data == MAP_FAILED) {
+    view->data = NULL;
+    return -1;
+  }
+  view->mapped = 1;
+  memcpy(&declared, view->data + 80, 4);
+  view->triCount = checkTriCount(declared, view->size);
+  return 0;
+}
+
+// Flush changes of a read-write view to the file
+int syncView(stl_view *view) {
+  return msync(view->data, view->size, MS_SYNC);
+}
+
+// Unmap/free view
+void closeView(stl_view *view) {
+  unmapFile(view->data, view->size, view->mapped);
+  memset(view, 0, sizeof(stl_view));
+}
+
+// Unpack 50 byte record -> tri
+void unpackTriBin(const unsigned char *rec, stl_tri *tri) {
+  memcpy(tri->normal,  rec,      12);
+  memcpy(tri->vertexA, rec + 12, 12);
+  memcpy(tri->vertexB, rec + 24, 12);
+  memcpy(tri->vertexC, rec + 36, 12);
+}
+
+//////////////////////////////////////////////////////
+// Fast ASCII parser
+//////////////////////////////////////////////////////
+
+#define IS_SPACE(ch) ((ch) == ' ' || (ch) == '\n' || (ch) == '\t' || (ch) == '\r')
+
+// Skip whitespace, 16 bytes at a time where possible
+static void skipSpace(stl_parser *p) {
+  const char *cur = p->cur;
+
+#ifdef __SSE2__
+  const __m128i sp = _mm_set1_epi8(' '), nl = _mm_set1_epi8('\n');
+  const __m128i tb = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+  while(cur + 16 <= p->end) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+    __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, sp), _mm_cmpeq_epi8(chunk, nl)),
+                              _mm_or_si128(_mm_cmpeq_epi8(chunk, tb), _mm_cmpeq_epi8(chunk, cr)));
+    unsigned mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+    if(mask) {
+      p->cur = cur + __builtin_ctz(mask);
+      return;
+    }
+    cur += 16;
+  }
+#endif
+  while(cur < p->end && IS_SPACE(*cur))
+    cur++;
+  p->cur = cur;
+}
+
+// Skip past the next newline
+static void skipLine(stl_parser *p) {
+  const char *cur = p->cur;
+
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  while(cur + 16 <= p->end) {
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)cur), nl));
+    if(mask) {
+      p->cur = cur + __builtin_ctz(mask) + 1;
+      return;
+    }
+    cur += 16;
+  }
+#endif
+  while(cur < p->end && *cur != '\n')
+    cur++;
+  p->cur = cur < p->end ? cur + 1 : cur;
+}
+
+// Consume keyword followed by whitespace/end -> 1 on match
+static int expectWord(stl_parser *p, const char *word, size_t len) {
+  skipSpace(p);
+  if((size_t)(p->end - p->cur) < len || memcmp(p->cur, word, len) != 0)
+    return 0;
+  if(p->cur + len < p->end && !IS_SPACE(p->cur[len]))
+    return 0;
+  p->cur += len;
+  return 1;
+}
+
+// Float values of 10^0 .. 10^10, all exact in single precision
+static const float pow10f[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+// Scan one float -> 1 on success. Rounds exactly like strtof: short
+// mantissas with small exponents are a single correctly rounded float
+// operation, everything else falls back to strtof.
+static int scanFloat(stl_parser *p, float *value) {
+  const char *cur, *start;
+  uint64_t mantissa = 0;
+  int digits = 0, exp10 = 0, expValue = 0, negative = 0, expNegative = 0, sawDigit = 0;
+  char token[64];
+
+  skipSpace(p);
+  cur = start = p->cur;
+  if(cur < p->end && (*cur == '-' || *cur == '+'))
+    negative = *cur++ == '-';
+
+  for(; cur < p->end && (unsigned)(*cur - '0') < 10; cur++) {
+    sawDigit = 1;
+    if(digits < 19) {
+      mantissa = mantissa * 10 + (*cur - '0');
+      digits += mantissa != 0;
+    } else {
+      exp10++;
+      digits++;
+    }
+  }
+  if(cur < p->end && *cur == '.') {
+    for(cur++; cur < p->end && (unsigned)(*cur - '0') < 10; cur++) {
+      sawDigit = 1;
+      if(digits < 19) {
+        mantissa = mantissa * 10 + (*cur - '0');
+        digits += mantissa != 0;
+        exp10--;
+      } else {
+        digits++;
+      }
+    }
+  }
+  if(!sawDigit)
+    goto slow;
+  if(cur < p->end && (*cur == 'e' || *cur == 'E')) {
+    cur++;
+    if(cur < p->end && (*cur == '-' || *cur == '+'))
+      expNegative = *cur++ == '-';
+    if(cur >= p->end || (unsigned)(*cur - '0') >= 10)
+      goto slow;
+    for(; cur < p->end && (unsigned)(*cur - '0') < 10; cur++)
+      if(expValue < 10000)
+        expValue = expValue * 10 + (*cur - '0');
+    exp10 += expNegative ? -expValue : expValue;
+  }
+  if(cur < p->end && !IS_SPACE(*cur))
+    goto slow;
+
+  if(mantissa == 0) {
+    *value = negative ? -0.0f : 0.0f;
+  } else if(digits <= 19 && mantissa <= (1 << 24) && exp10 >= -10 && exp10 <= 10) {
+    float f = (float)mantissa;
+    f = exp10 < 0 ? f / pow10f[-exp10] : f * pow10f[exp10];
+    *value = negative ? -f : f;
+  } else {
+    goto slow;
+  }
+  p->cur = cur;
+  return 1;
+
+slow:
+  for(cur = start; cur < p->end && !IS_SPACE(*cur) && cur - start < 63; cur++)
+    ;
+  memcpy(token, start, cur - start);
+  token[cur - start] = '\0';
+  {
+    char *stop;
+    *value = strtof(token, &stop);
+    if(stop == token)
+      return 0;
+    p->cur = start + (stop - token);
+  }
+  return 1;
+}
+
+// Scan three floats
+static int scanVector(stl_parser *p, float *v) {
+  return scanFloat(p, &v[0]) && scanFloat(p, &v[1]) && scanFloat(p, &v[2]);
+}
+
+// Parse ASCII STL in [start, end), data is not owned
+void initParserRange(stl_parser *p, const char *start, const char *end) {
+  memset(p, 0, sizeof(stl_parser));
+  p->cur = start;
+  p->end = end;
+}
+
+// Map ASCII STL and skip the 'solid name' line -> 0 on success
+int openParser(stl_parser *p, FILE *in) {
+  memset(p, 0, sizeof(stl_parser));
+  if(mapFile(in, &p->data, &p->size, &p->mapped) != 0)
+    return -1;
+  p->cur = (const char *)p->data;
+  p->end = p->cur + p->size;
+  if(expectWord(p, "solid", 5) || (p->end - p->cur >= 5 && memcmp(p->cur, "solid", 5) == 0))
+    skipLine(p);
+  return 0;
+}
+
+// Unmap/free parser input
+void closeParser(stl_parser *p) {
+  unmapFile(p->data, p->size, p->mapped);
+  memset(p, 0, sizeof(stl_parser));
+}
+
+// Parse next facet -> 1 on success, 0 at end or on malformed input
+int parseTriASCII(stl_parser *p, stl_tri *tri) {
+  // 'endsolid' may be followed by another solid in the same file
+  while(expectWord(p, "endsolid", 8)) {
+    skipLine(p);
+    if(!expectWord(p, "solid", 5))
+      return 0;
+    skipLine(p);
+  }
+
+  if(!expectWord(p, "facet", 5) || !expectWord(p, "normal", 6) || !scanVector(p, tri->normal))
+    return 0;
+  if(!expectWord(p, "outer", 5) || !expectWord(p, "loop", 4))
+    return 0;
+  if(!expectWord(p, "vertex", 6) || !scanVector(p, tri->vertexA) ||
+     !expectWord(p, "vertex", 6) || !scanVector(p, tri->vertexB) ||
+     !expectWord(p, "vertex", 6) || !scanVector(p, tri->vertexC))
+    return 0;
+  if(!expectWord(p, "endloop", 7) || !expectWord(p, "endfacet", 8))
+    return 0;
+  return 1;
+}
+
+//////////////////////////////////////////////////////
+// Float formatting
+//////////////////////////////////////////////////////
+
+// 10^-50 .. 10^60 as doubles, pow10d[50] == 1
+static const double pow10d[111] = {
+  1e-50, 1e-49, 1e-48, 1e-47, 1e-46, 1e-45, 1e-44, 1e-43,
+  1e-42, 1e-41, 1e-40, 1e-39, 1e-38, 1e-37, 1e-36, 1e-35,
+  1e-34, 1e-33, 1e-32, 1e-31, 1e-30, 1e-29, 1e-28, 1e-27,
+  1e-26, 1e-25, 1e-24, 1e-23, 1e-22, 1e-21, 1e-20, 1e-19,
+  1e-18, 1e-17, 1e-16, 1e-15, 1e-14, 1e-13, 1e-12, 1e-11,
+  1e-10, 1e-9, 1e-8, 1e-7, 1e-6, 1e-5, 1e-4, 1e-3,
+  1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5,
+  1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+  1e22, 1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29,
+  1e30, 1e31, 1e32, 1e33, 1e34, 1e35, 1e36, 1e37,
+  1e38, 1e39, 1e40, 1e41, 1e42, 1e43, 1e44, 1e45,
+  1e46, 1e47, 1e48, 1e49, 1e50, 1e51, 1e52, 1e53,
+  1e54, 1e55, 1e56, 1e57, 1e58, 1e59, 1e60
+};
+
+// Round d (positive, finite) to a digits-long integer -> decimal exponent
+// of the leading digit, -1000 when the result sits on a rounding tie that
+// double precision cannot settle
+static int roundDigits(double d, int digits, uint64_t *out) {
+  uint64_t n, limit = 1;
+  double scaled, frac;
+  int k, ndx;
+
+  for(ndx = 1; ndx < digits; ndx++)
+    limit *= 10;
+
+  // frexp exponent * log10(2) is within one of the decimal exponent
+  frexp(d, &k);
+  k = (int)floor((k - 1) * 0.30102999566398);
+  if(d >= pow10d[50 + k + 1])
+    k++;
+
+  for(;;) {
+    scaled = d * pow10d[50 + digits - 1 - k];
+    n = (uint64_t)scaled;
+    frac = scaled - (double)n;
+    if(fabs(frac - 0.5) < 1e-6)
+      return -1000;
+    n += frac > 0.5;
+    if(n >= limit * 10) {
+      k++;
+    } else if(n < limit) {
+      k--;
+    } else {
+      *out = n;
+      return k;
+    }
+  }
+}
+
+// Write 'E+dd' exponent
+static char *formatExponent(char *out, int k) {
+  *out++ = 'E';
+  *out++ = k < 0 ? '-' : '+';
+  k = abs(k);
+  if(k >= 100)
+    *out++ = '0' + k / 100;
+  *out++ = '0' + (k / 10) % 10;
+  *out++ = '0' + k % 10;
+  return out;
+}
+
+// printf("%E") compatible: d.ddddddE+dd
+static int formatExact(char *buf, float f) {
+  char *out = buf;
+  uint64_t n;
+  double d = f;
+  int k, ndx;
+
+  if(!isfinite(d))
+    return sprintf(buf, "%E", d);
+  if(signbit(d)) {
+    *out++ = '-';
+    d = -d;
+  }
+  if(d == 0.0) {
+    memcpy(out, "0.000000E+00", 12);
+    return out - buf + 12;
+  }
+  if((k = roundDigits(d, 7, &n)) == -1000)
+    return sprintf(buf, "%E", (double)f);
+
+  for(ndx = 7; ndx > 1; ndx--, n /= 10)
+    out[ndx] = '0' + n % 10;
+  out[0] = '0' + n;
+  out[1] = '.';
+  return formatExponent(out + 8, k) - buf;
+}
+
+// n * 10^exp10 reads back as f (same rounding rules as scanFloat)
+static int readsBack(uint64_t n, int exp10, float f) {
+  char text[48];
+  float back;
+
+  if(n <= (1 << 24) && exp10 >= -10 && exp10 <= 10) {
+    back = (float)n;
+    back = exp10 < 0 ? back / pow10f[-exp10] : back * pow10f[exp10];
+  } else {
+    snprintf(text, sizeof(text), "%lluE%d", (unsigned long long)n, exp10);
+    back = strtof(text, NULL);
+  }
+  return back == f;
+}
+
+// Shortest digits that read back as f
+static int formatCompact(char *buf, float f) {
+  char digits[24], *out = buf;
+  uint64_t n;
+  double d = f;
+  int k = 0, count, ndx, len;
+
+  if(!isfinite(d))
+    return sprintf(buf, "%G", d);
+  if(signbit(d)) {
+    *out++ = '-';
+    d = -d;
+  }
+  if(d == 0.0) {
+    *out++ = '0';
+    return out - buf;
+  }
+
+  // Leading digit exponent, then round to 1, 2, ... digits at that scale
+  if((k = roundDigits(d, 9, &n)) == -1000)
+    k = (int)floor(log10(d));
+  for(count = 1; count <= 9; count++) {
+    int digitK = k;
+    double scaled = d * pow10d[50 + count - 1 - k];
+    double frac;
+
+    n = (uint64_t)scaled;
+    frac = scaled - (double)n;
+    if(fabs(frac - 0.5) < 1e-6) {
+      snprintf(digits, sizeof(digits), "%.*E", count - 1, d);
+      digitK = atoi(strchr(digits, 'E') + 1);
+      n = digits[0] - '0';
+      for(ndx = 2; ndx <= count; ndx++)
+        n = n * 10 + digits[ndx] - '0';
+    } else {
+      n += frac > 0.5;
+    }
+    // Rounded up to the next power of ten
+    if(n >= (uint64_t)pow10d[50 + count]) {
+      n /= 10;
+      digitK++;
+    }
+    if(readsBack(n, digitK - count + 1, (float)d)) {
+      k = digitK;
+      break;
+    }
+  }
+  if(count > 9) {
+    count = 9;
+    roundDigits(d, 9, &n);
+  }
+
+  // Digits of n, trailing zeros dropped
+  for(len = count, ndx = count - 1; ndx >= 0; ndx--, n /= 10)
+    digits[ndx] = '0' + n % 10;
+  while(len > 1 && digits[len - 1] == '0')
+    len--;
+
+  if(k >= -4 && k < 7) {
+    if(k < 0) {
+      *out++ = '0';
+      *out++ = '.';
+      for(ndx = -1; ndx > k; ndx--)
+        *out++ = '0';
+      memcpy(out, digits, len);
+      out += len;
+    } else if(len <= k + 1) {
+      memcpy(out, digits, len);
+      out += len;
+      for(ndx = len; ndx <= k; ndx++)
+        *out++ = '0';
+    } else {
+      memcpy(out, digits, k + 1);
+      out += k + 1;
+      *out++ = '.';
+      memcpy(out, digits + k + 1, len - k - 1);
+      out += len - k - 1;
+    }
+  } else {
+    *out++ = digits[0];
+    if(len > 1) {
+      *out++ = '.';
+      memcpy(out, digits + 1, len - 1);
+      out += len - 1;
+    }
+    out = formatExponent(out, k);
+  }
+  return out - buf;
+}
+
+// Format float -> length written (at most 16 bytes)
+int formatFloat(char *buf, float f, ascii_format format) {
+  return format == ASCII_COMPACT ? formatCompact(buf, f) : formatExact(buf, f);
+}
+
+// Copy literal text
+#define EMIT(out, text) (memcpy(out, text, sizeof(text) - 1), out += sizeof(text) - 1)
+
+// Three floats separated by spaces
+static char *formatVector(char *out, float *v, ascii_format format) {
+  out += formatFloat(out, v[0], format);
+  *out++ = ' ';
+  out += formatFloat(out, v[1], format);
+  *out++ = ' ';
+  out += formatFloat(out, v[2], format);
+  *out++ = '\n';
+  return out;
+}
+
+// Format facet -> length written (at most STL_FACET_MAX bytes)
+int formatTriASCII(char *buf, stl_tri *tri, ascii_format format) {
+  char *out = buf;
+
+  if(format == ASCII_COMPACT) {
+    EMIT(out, "facet normal ");
+    out = formatVector(out, tri->normal, format);
+    EMIT(out, "outer loop\nvertex ");
+    out = formatVector(out, tri->vertexA, format);
+    EMIT(out, "vertex ");
+    out = formatVector(out, tri->vertexB, format);
+    EMIT(out, "vertex ");
+    out = formatVector(out, tri->vertexC, format);
+    EMIT(out, "endloop\nendfacet\n");
+  } else {
+    EMIT(out, "  facet normal ");
+    out = formatVector(out, tri->normal, format);
+    EMIT(out, "    outer loop\n      vertex ");
+    out = formatVector(out, tri->vertexA, format);
+    EMIT(out, "      vertex ");
+    out = formatVector(out, tri->vertexB, format);
+    EMIT(out, "      vertex ");
+    out = formatVector(out, tri->vertexC, format);
+    EMIT(out, "    endloop\n  endfacet\n");
+  }
+  return out - buf;
+}
+
 //////////////////////////////////////////////////////
 // Output
 //////////////////////////////////////////////////////
@@ -124,47 +701,29 @@ void writeFooterAscii(FILE *out) {
 
 // Write single tri in binary
 void writeTriBin(FILE *out, stl_tri *tri) {
-  char *filler = "zz";
-
-  fwrite(&tri->normal[0], 4, 1, out);
-  fwrite(&tri->normal[1], 4, 1, out);
-  fwrite(&tri->normal[2], 4, 1, out);
-
-  fwrite(&tri->vertexA[0], 4, 1, out);
-  fwrite(&tri->vertexA[1], 4, 1, out);
-  fwrite(&tri->vertexA[2], 4, 1, out);
+  unsigned char rec[STL_RECORD_SIZE];
 
-  fwrite(&tri->vertexB[0], 4, 1, out);
-  fwrite(&tri->vertexB[1], 4, 1, out);
-  fwrite(&tri->vertexB[2], 4, 1, out);
-
-  fwrite(&tri->vertexC[0], 4, 1, out);
-  fwrite(&tri->vertexC[1], 4, 1, out);
-  fwrite(&tri->vertexC[2], 4, 1, out);
-  fwrite(filler, 2, 1, out);
+  packTriBin(rec, tri);
+  fwrite(rec, STL_RECORD_SIZE, 1, out);
 }
 
 // Write tri array in binary
-// UNTESTED
 void writeTriArrayBin(FILE *out, int triCount, stl_tri *tris) {
-  int ndx;
-  for(ndx = 0; ndx < triCount; ndx++)
-    writeTriBin(out, &tris[ndx]);  
+  unsigned char recs[STL_RECORD_SIZE * 256];
+  int ndx, batch;
+
+  for(ndx = 0; ndx < triCount; ndx += batch) {
+    batch = triCount - ndx < 256 ? triCount - ndx : 256;
+    packTriArrayBin(recs, batch, &tris[ndx]);
+    fwrite(recs, STL_RECORD_SIZE, batch, out);
+  }
 }
 
 // Write single tri in ASCII
 void writeTriASCII(FILE *out, stl_tri *tri) {
-  fprintf(out, "  facet normal %E %E %E\n"
-               "    outer loop\n"
-               "      vertex %E %E %E\n"
-               "      vertex %E %E %E\n"
-               "      vertex %E %E %E\n"
-               "    endloop\n"
-               "  endfacet\n", 
-               tri->normal[0],  tri->normal[1],  tri->normal[2],
-               tri->vertexA[0], tri->vertexA[1], tri->vertexA[2],
-               tri->vertexB[0], tri->vertexB[1], tri->vertexB[2],
-               tri->vertexC[0], tri->vertexC[1], tri->vertexC[2]);
+  char facet[STL_FACET_MAX];
+
+  fwrite(facet, 1, formatTriASCII(facet, tri, ASCII_EXACT), out);
 }
 
 // Write tri array in ASCII
@@ -174,3 +733,429 @@ void writeTriArrayASCII(FILE *out, int triCount, stl_tri *tris) {
   for(ndx = 0; ndx < triCount; ndx++)
     writeTriASCII(out, &tris[ndx]);  
 }
+
+// Pack tri -> 50 byte record
+void packTriBin(unsigned char *rec, const stl_tri *tri) {
+  memcpy(rec,      tri->normal,  12);
+  memcpy(rec + 12, tri->vertexA, 12);
+  memcpy(rec + 24, tri->vertexB, 12);
+  memcpy(rec + 36, tri->vertexC, 12);
+  rec[48] = 'z';
+  rec[49] = 'z';
+}
+
+// Pack tri array -> consecutive records
+static void packTriArrayBin(unsigned char *recs, int triCount, const stl_tri *tris) {
+  int ndx;
+  for(ndx = 0; ndx < triCount; ndx++, recs += STL_RECORD_SIZE)
+    packTriBin(recs, &tris[ndx]);
+}
+
+//////////////////////////////////////////////////////
+// Buffered writer
+//////////////////////////////////////////////////////
+
+// Start buffered writing to out (flushes out first) -> 0 on success, -1 out of memory
+int initWriter(stl_writer *w, FILE *out, stl_mode mode) {
+  w->buf = NULL;
+  w->mesh = NULL;
+  return reuseWriter(w, out, mode);
+}
+
+// Point a flushed writer at a new output, keeping its buffer -> 0 on success
+int reuseWriter(stl_writer *w, FILE *out, stl_mode mode) {
+  unsigned char *buf = w->buf;
+  stl_mesh *mesh = w->mesh;
+
+  if(!buf)
+    buf = malloc(STL_WRITER_SIZE);
+  // Quantized output keeps its mesh allocations, others release them
+  if(mode == QUANTIZED && !mesh) {
+    if((mesh = malloc(sizeof(stl_mesh))))
+      initMesh(mesh, 0.0f);
+  } else if(mode == QUANTIZED)
+    clearMesh(mesh);
+  else if(mesh) {
+    freeMesh(mesh);
+    free(mesh);
+    mesh = NULL;
+  }
+  memset(w, 0, sizeof(stl_writer));
+  w->mesh = mesh;
+  fflush(out);
+  w->out = out;
+  w->fd = fileno(out);
+  w->mode = mode;
+  w->format = ASCII_EXACT;
+  w->cap = buf ? STL_WRITER_SIZE : 0;
+  w->buf = buf;
+  return buf && (mode != QUANTIZED || mesh) ? 0 : -1;
+}
+
+// Send bytes to the output, bypassing the buffer
+static void writeAll(stl_writer *w, const void *bytes, size_t size) {
+  size_t done = 0;
+  ssize_t got;
+
+  if(w->fd < 0) {
+    done = fwrite(bytes, 1, size, w->out);
+  } else {
+    while(done < size) {
+      got = write(w->fd, (const char *)bytes + done, size - done);
+      if(got <= 0) {
+        perror("write");
+        break;
+      }
+      done += got;
+    }
+  }
+  w->bytes += done;
+}
+
+// Write out pending bytes
+void flushWriter(stl_writer *w) {
+  writeAll(w, w->buf, w->len);
+  w->len = 0;
+}
+
+// Flush and release buffer, out stays open
+void freeWriter(stl_writer *w) {
+  flushWriter(w);
+  free(w->buf);
+  w->buf = NULL;
+  if(w->mesh) {
+    freeMesh(w->mesh);
+    free(w->mesh);
+    w->mesh = NULL;
+  }
+}
+
+//////////////////////////////////////////////////////
+// Quantized meshes
+//////////////////////////////////////////////////////
+
+#define QUANT_VERSION 1
+
+// Staged output bytes, handed to the writer when nearly full
+typedef struct quant_out_st {
+  stl_writer *w;
+  unsigned char buf[4096];
+  int len;
+} quant_out;
+
+static void putBytes(quant_out *q, const void *bytes, int size) {
+  if(q->len + size > (int)sizeof(q->buf)) {
+    writerBytes(q->w, q->buf, q->len);
+    q->len = 0;
+  }
+  memcpy(q->buf + q->len, bytes, size);
+  q->len += size;
+}
+
+static void putVarint(quant_out *q, uint64_t value) {
+  unsigned char bytes[10];
+  int size = 0;
+
+  while(value >= 0x80) {
+    bytes[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  bytes[size++] = value;
+  putBytes(q, bytes, size);
+}
+
+static uint64_t zigzag(int64_t value) {
+  return value < 0 ? ((uint64_t)-value << 1) - 1 : (uint64_t)value << 1;
+}
+
+static int compareFloat(const void *a, const void *b) {
+  float fa = *(const float *)a, fb = *(const float *)b;
+  return fa < fb ? -1 : fa > fb;
+}
+
+// Sorted distinct values of count coordinates -> table, returns its size
+static uint32_t axisTable(const float *values, uint32_t count, float *table) {
+  uint32_t ndx, size = 0;
+
+  memcpy(table, values, sizeof(float) * count);
+  for(ndx = 0; ndx < count; ndx++)
+    if(table[ndx] == 0.0f)
+      table[ndx] = 0.0f;
+  qsort(table, count, sizeof(float), compareFloat);
+  for(ndx = 0; ndx < count; ndx++)
+    if(size == 0 || table[ndx] != table[size-1])
+      table[size++] = table[ndx];
+  return size;
+}
+
+// Index of value in table
+static int64_t axisIndex(const float *table, uint32_t size, float value) {
+  const float *found = bsearch(&value, table, size, sizeof(float), compareFloat);
+  return found - table;
+}
+
+// Encode mesh as a quantized mesh through w -> 0 on success, -1 (nothing
+// written) if the mesh failed or the axis tables can't be allocated
+int writeQuantized(stl_writer *w, stl_mesh *mesh) {
+  const float *coords[3] = { mesh->x, mesh->y, mesh->z };
+  uint32_t count = mesh->vertCount, sizes[3], ndx;
+  int64_t prev[3] = { 0, 0, 0 }, cur, first = 0;
+  float *tables[3];
+  uint32_t *face, *last = NULL;
+  unsigned char mask;
+  quant_out q;
+  int axis;
+
+  if(mesh->failed)
+    return -1;
+  for(axis = 0; axis < 3; axis++)
+    tables[axis] = malloc(sizeof(float) * (count + 1));
+  if(!tables[0] || !tables[1] || !tables[2]) {
+    for(axis = 0; axis < 3; axis++)
+      free(tables[axis]);
+    return -1;
+  }
+
+  q.w = w;
+  q.len = 0;
+  putBytes(&q, STL_QUANT_MAGIC, 4);
+  putVarint(&q, QUANT_VERSION);
+
+  for(axis = 0; axis < 3; axis++) {
+    sizes[axis] = axisTable(coords[axis], count, tables[axis]);
+    putVarint(&q, sizes[axis]);
+    for(ndx = 0; ndx < sizes[axis]; ndx++)
+      putBytes(&q, &tables[axis][ndx], sizeof(float));
+  }
+
+  putVarint(&q, count);
+  for(ndx = 0; ndx < count; ndx++) {
+    int64_t index[3];
+    for(axis = 0, mask = 0; axis < 3; axis++) {
+      index[axis] = axisIndex(tables[axis], sizes[axis], coords[axis][ndx] == 0.0f ? 0.0f : coords[axis][ndx]);
+      mask |= (index[axis] != prev[axis]) << axis;
+    }
+    putBytes(&q, &mask, 1);
+    for(axis = 0; axis < 3; axis++)
+      if(mask & (1 << axis)) {
+        putVarint(&q, zigzag(index[axis] - prev[axis]));
+        prev[axis] = index[axis];
+      }
+  }
+
+  putVarint(&q, mesh->triCount);
+  for(ndx = 0; ndx < mesh->triCount; ndx++) {
+    face = &mesh->indices[3 * ndx];
+    cur = face[0];
+    if(last && face[1] == last[2] && face[2] == last[1])
+      putVarint(&q, zigzag(cur - first) << 1 | 1);
+    else {
+      putVarint(&q, zigzag(cur - first) << 1);
+      putVarint(&q, zigzag((int64_t)face[1] - cur));
+      putVarint(&q, zigzag((int64_t)face[2] - cur));
+    }
+    first = cur;
+    last = face;
+  }
+
+  writerBytes(w, q.buf, q.len);
+  for(axis = 0; axis < 3; axis++)
+    free(tables[axis]);
+  return 0;
+}
+
+// Encode the tris a QUANTIZED writer collected and empty its mesh -> 0 on success
+int finishQuantized(stl_writer *w) {
+  int result = writeQuantized(w, w->mesh);
+
+  flushWriter(w);
+  clearMesh(w->mesh);
+  return result;
+}
+
+// Input bytes being decoded, ok drops to 0 past the end
+typedef struct quant_in_st {
+  const unsigned char *pos, *end;
+  int ok;
+} quant_in;
+
+static uint64_t getVarint(quant_in *q) {
+  uint64_t value = 0;
+  int shift;
+
+  for(shift = 0; q->pos < q->end && shift < 64; shift += 7) {
+    value |= (uint64_t)(*q->pos & 0x7f) << shift;
+    if(!(*q->pos++ & 0x80))
+      return value;
+  }
+  q->ok = 0;
+  return 0;
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return (value & 1) ? -(int64_t)(value >> 1) - 1 : (int64_t)(value >> 1);
+}
+
+// Decode a quantized mesh from in (at its start) -> 0 on success
+int readQuantized(FILE *in, stl_mesh *mesh) {
+  unsigned char *data;
+  float *tables[3] = { NULL, NULL, NULL }, v[3];
+  uint64_t sizes[3], count, ndx;
+  int64_t index[3] = { 0, 0, 0 }, face[3], last[3] = { 0, 0, 0 }, first = 0;
+  quant_in q;
+  struct stat st;
+  unsigned char mask;
+  uint64_t code;
+  int axis, k;
+
+  if(fstat(fileno(in), &st) != 0 || st.st_size < 5)
+    return -1;
+  if(!(data = malloc(st.st_size)))
+    return -1;
+  fseek(in, 0L, SEEK_SET);
+  q.ok = fread(data, 1, st.st_size, in) == (size_t)st.st_size && memcmp(data, STL_QUANT_MAGIC, 4) == 0;
+  q.pos = data + 4;
+  q.end = data + st.st_size;
+  if(q.ok && getVarint(&q) != QUANT_VERSION)
+    q.ok = 0;
+
+  for(axis = 0; axis < 3 && q.ok; axis++) {
+    sizes[axis] = getVarint(&q);
+    if(sizes[axis] > (uint64_t)(q.end - q.pos) / sizeof(float)) {
+      q.ok = 0;
+      break;
+    }
+    if(!(tables[axis] = malloc(sizeof(float) * (sizes[axis] + 1)))) {
+      q.ok = 0;
+      break;
+    }
+    memcpy(tables[axis], q.pos, sizeof(float) * sizes[axis]);
+    q.pos += sizeof(float) * sizes[axis];
+  }
+
+  count = q.ok ? getVarint(&q) : 0;
+  if(count > (uint64_t)(q.end - q.pos))
+    q.ok = 0;
+  if(q.ok && reserveMesh(mesh, 0, count) != 0)
+    q.ok = 0;
+  for(ndx = 0; ndx < count && q.ok; ndx++) {
+    mask = q.pos < q.end ? *q.pos++ : (q.ok = 0);
+    for(axis = 0; axis < 3; axis++) {
+      if(mask & (1 << axis))
+        index[axis] += unzigzag(getVarint(&q));
+      if(index[axis] < 0 || (uint64_t)index[axis] >= sizes[axis]) {
+        q.ok = 0;
+        break;
+      }
+      v[axis] = tables[axis][index[axis]];
+    }
+    if(q.ok)
+      addVertex(mesh, v);
+  }
+
+  count = q.ok ? getVarint(&q) : 0;
+  if(count > (uint64_t)(q.end - q.pos))
+    q.ok = 0;
+  if(q.ok && reserveMesh(mesh, count, 0) != 0)
+    q.ok = 0;
+  for(ndx = 0; ndx < count && q.ok; ndx++) {
+    code = getVarint(&q);
+    face[0] = first + unzigzag(code >> 1);
+    if(code & 1) {
+      face[1] = last[2];
+      face[2] = last[1];
+    } else {
+      face[1] = face[0] + unzigzag(getVarint(&q));
+      face[2] = face[0] + unzigzag(getVarint(&q));
+    }
+    for(k = 0; k < 3; k++)
+      if(face[k] < 0 || face[k] >= mesh->vertCount)
+        q.ok = 0;
+    if(q.ok)
+      addIndexedTri(mesh, face[0], face[1], face[2]);
+    first = face[0];
+    memcpy(last, face, sizeof(last));
+  }
+
+  for(axis = 0; axis < 3; axis++)
+    free(tables[axis]);
+  free(data);
+  return q.ok && !mesh->failed ? 0 : -1;
+}
+
+// Append size bytes of file fd from offset, copied in the kernel where
+// possible (copy_file_range, then sendfile), else read -> 0 on success
+int writerSplice(stl_writer *w, int fd, off_t offset, size_t size) {
+  char chunk[1 << 16];
+  ssize_t got;
+
+  flushWriter(w);
+  while(w->fd >= 0 && size > 0 && (got = copy_file_range(fd, &offset, w->fd, NULL, size, 0)) > 0) {
+    w->bytes += got;
+    size -= got;
+  }
+  while(w->fd >= 0 && size > 0 && (got = sendfile(w->fd, fd, &offset, size)) > 0) {
+    w->bytes += got;
+    size -= got;
+  }
+  while(size > 0 && (got = pread(fd, chunk, size < sizeof(chunk) ? size : sizeof(chunk), offset)) > 0) {
+    writeAll(w, chunk, got);
+    offset += got;
+    size -= got;
+  }
+  return size == 0 ? 0 : -1;
+}
+
+// Append raw bytes
+void writerBytes(stl_writer *w, const void *bytes, size_t size) {
+  size_t part;
+
+  // Large blocks go straight out without a copy
+  if(size >= w->cap / 2) {
+    flushWriter(w);
+    writeAll(w, bytes, size);
+    return;
+  }
+  while(size > 0) {
+    if(w->len == w->cap)
+      flushWriter(w);
+    part = w->cap - w->len < size ? w->cap - w->len : size;
+    memcpy(w->buf + w->len, bytes, part);
+    w->len += part;
+    bytes = (const char *)bytes + part;
+    size -= part;
+  }
+}
+
+// Append single tri
+void writerTri(stl_writer *w, stl_tri *tri) {
+  writerTriArray(w, 1, tri);
+}
+
+// Append tri array
+void writerTriArray(stl_writer *w, int triCount, stl_tri *tris) {
+  int ndx, batch;
+  size_t room;
+
+  w->triCount += triCount;
+  if(w->mode == QUANTIZED) {
+    meshFromTris(w->mesh, triCount, tris);
+  } else if(w->mode == BINARY) {
+    for(ndx = 0; ndx < triCount; ndx += batch) {
+      room = (w->cap - w->len) / STL_RECORD_SIZE;
+      if(room == 0) {
+        flushWriter(w);
+        room = w->cap / STL_RECORD_SIZE;
+      }
+      batch = (size_t)(triCount - ndx) < room ? triCount - ndx : (int)room;
+      packTriArrayBin(w->buf + w->len, batch, &tris[ndx]);
+      w->len += (size_t)batch * STL_RECORD_SIZE;
+    }
+  } else {
+    for(ndx = 0; ndx < triCount; ndx++) {
+      if(w->cap - w->len < STL_FACET_MAX)
+        flushWriter(w);
+      w->len += formatTriASCII((char *)w->buf + w->len, &tris[ndx], w->format);
+    }
+  }
+}
@@ -1,15 +1,77 @@
 // Chris Polis
 // stl_io.h - tools for input and output from STL files
 
+#ifndef __include_stl_io
+#define __include_stl_io
+
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
 #include "stl_util.h"
+#include "stl_mesh.h"
+
+// Binary layout: 80 byte header, uint32 count, then 50 byte records of
+// normal, vertexA, vertexB, vertexC (12 floats) + 2 byte attribute
+#define STL_HEADER_SIZE 84
+#define STL_RECORD_SIZE 50
 
 typedef enum stl_mode_en {
   BINARY, 
-  ASCII
+  ASCII,
+  QUANTIZED               // compact indexed mesh, see writeQuantized
 } stl_mode;
 
+#define STL_QUANT_MAGIC "QSTL"
+
+// Memory-mapped binary STL, records are read in place
+typedef struct stl_view_st {
+  unsigned char *data;    // whole file, header included
+  size_t size;            // bytes in data
+  uint32_t triCount;      // records actually present in data
+  int mapped;             // 1 -> munmap, 0 -> free (unmappable input)
+} stl_view;
+
+// ASCII number style: ASCII_EXACT matches printf %E, ASCII_COMPACT is
+// the shortest text that reads back to the same float
+typedef enum ascii_format_en {
+  ASCII_EXACT,
+  ASCII_COMPACT
+} ascii_format;
+
+// Longest facet formatTriASCII can produce
+#define STL_FACET_MAX 512
+
+// Buffered triangle writer, flushes in large write() calls
+#define STL_WRITER_SIZE (8 << 20)
+typedef struct stl_writer_st {
+  FILE *out;
+  int fd;                 // -1 -> fwrite through out (memory streams)
+  stl_mode mode;
+  ascii_format format;    // number style for ASCII mode
+  unsigned char *buf;
+  size_t len;             // bytes pending in buf
+  size_t cap;
+  uint64_t bytes;         // bytes flushed so far
+  uint32_t triCount;      // tris written through the writer
+  stl_mesh *mesh;         // QUANTIZED: tris welded here until finishQuantized
+} stl_writer;
+
+// ASCII STL parser over a mapped buffer
+typedef struct stl_parser_st {
+  unsigned char *data;    // owned input, NULL for ranges
+  size_t size;
+  int mapped;
+  const char *cur;        // next unparsed byte
+  const char *end;
+} stl_parser;
+
+// Forward iterator over the records of a view
+typedef struct stl_view_iter_st {
+  const unsigned char *rec;
+  const unsigned char *end;
+} stl_view_iter;
+
 //////////////////////////////////////////////////////
 // Input
 //////////////////////////////////////////////////////
@@ -29,6 +91,65 @@ void readTriBin(FILE *in, stl_tri *tri);
 // Read tri from ASCII
 int readTriASCII(FILE *in, stl_tri *tri);
 
+// Map ASCII STL and skip the 'solid name' line -> 0 on success
+int openParser(stl_parser *p, FILE *in);
+
+// Parse ASCII STL in [start, end), data is not owned
+void initParserRange(stl_parser *p, const char *start, const char *end);
+
+// Unmap/free parser input
+void closeParser(stl_parser *p);
+
+// Parse next facet -> 1 on success, 0 at end or on malformed input
+int parseTriASCII(stl_parser *p, stl_tri *tri);
+
+// Map binary STL -> 0 on success, -1 on error
+int openView(stl_view *view, FILE *in);
+
+// Map binary STL read-write (shared), in must be opened "r+" -> 0 on success
+int openViewRW(stl_view *view, FILE *in);
+
+// Flush changes of a read-write view to the file
+int syncView(stl_view *view);
+
+// Unmap/free view
+void closeView(stl_view *view);
+
+// Unpack 50 byte record -> tri
+void unpackTriBin(const unsigned char *rec, stl_tri *tri);
+
+// Random access: pointer to record ndx
+static inline const unsigned char *viewRecord(const stl_view *view, uint32_t ndx) {
+  return view->data + STL_HEADER_SIZE + (size_t)ndx * STL_RECORD_SIZE;
+}
+
+// Random access: record ndx -> tri
+static inline void viewTri(const stl_view *view, uint32_t ndx, stl_tri *tri) {
+  unpackTriBin(viewRecord(view, ndx), tri);
+}
+
+// Iterate records [first, last)
+static inline stl_view_iter viewRange(const stl_view *view, uint32_t first, uint32_t last) {
+  stl_view_iter it = { viewRecord(view, first), viewRecord(view, last) };
+  return it;
+}
+
+// Next record or NULL at end
+static inline const unsigned char *viewNext(stl_view_iter *it) {
+  const unsigned char *rec = it->rec;
+  if(rec >= it->end)
+    return NULL;
+  it->rec += STL_RECORD_SIZE;
+  return rec;
+}
+
+// Float field of a record (0-2 normal, 3-5 A, 6-8 B, 9-11 C)
+static inline float recordFloat(const unsigned char *rec, int field) {
+  float f;
+  memcpy(&f, rec + 4 * field, 4);
+  return f;
+}
+
 //////////////////////////////////////////////////////
 // Output
 //////////////////////////////////////////////////////
@@ -57,3 +178,56 @@ void writeTriASCII(FILE *out, stl_tri *tri);
 // Write tri array in ASCII
 void writeTriArrayASCII(FILE *out, int triCount, stl_tri *tris);
 
+// Format float -> length written (at most 16 bytes)
+int formatFloat(char *buf, float f, ascii_format format);
+
+// Format facet -> length written (at most STL_FACET_MAX bytes)
+int formatTriASCII(char *buf, stl_tri *tri, ascii_format format);
+
+// Pack tri -> 50 byte record
+void packTriBin(unsigned char *rec, const stl_tri *tri);
+
+// Start buffered writing to out (flushes out first) -> 0 on success, -1 out of memory
+int initWriter(stl_writer *w, FILE *out, stl_mode mode);
+
+// Point a flushed writer at a new output, keeping its buffer -> 0 on success
+int reuseWriter(stl_writer *w, FILE *out, stl_mode mode);
+
+// Append single tri
+void writerTri(stl_writer *w, stl_tri *tri);
+
+// Append tri array
+void writerTriArray(stl_writer *w, int triCount, stl_tri *tris);
+
+// Append raw bytes
+void writerBytes(stl_writer *w, const void *bytes, size_t size);
+
+// Append size bytes of file fd from offset, copied in the kernel where
+// possible (copy_file_range, then sendfile), else read -> 0 on success
+int writerSplice(stl_writer *w, int fd, off_t offset, size_t size);
+
+// Write out pending bytes
+void flushWriter(stl_writer *w);
+
+// Flush and release buffer, out stays open
+void freeWriter(stl_writer *w);
+
+// Quantized mesh: "QSTL", version byte, then varints. Per axis a sorted
+// table of the distinct coordinates (count, raw floats); vertices in first
+// use order as a mask byte of the axes whose table index changed from the
+// previous vertex, each followed by its zigzag delta; triangles as the
+// zigzag delta of the first index from the previous triangle's first,
+// shifted left one, low bit set when the other two are the previous
+// triangle's third and second (a quad's second half), else the zigzag
+// deltas of the other two from the first. Normals are dropped and come
+// back from the winding. Lossless apart from -0 -> 0. Returns 0 on
+// success, -1 (nothing written) if mesh failed or its tables can't be allocated
+int writeQuantized(stl_writer *w, stl_mesh *mesh);
+
+// Encode the tris a QUANTIZED writer collected and empty its mesh -> 0 on success
+int finishQuantized(stl_writer *w);
+
+// Decode a quantized mesh from in (at its start) -> 0 on success
+int readQuantized(FILE *in, stl_mesh *mesh);
+
+#endif
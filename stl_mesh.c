@@ -0,0 +1,238 @@
+// Chris Polis
+// stl_mesh.c - indexed triangle meshes with welded vertices
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "stl_mesh.h"
+
+// Grid cell of a coordinate
+static int64_t quantize(float value, float quantum) {
+  uint32_t bits;
+
+  if(quantum > 0.0f)
+    return (int64_t)llroundf(value / quantum);
+  if(value == 0.0f)   // -0 welds with 0
+    return 0;
+  memcpy(&bits, &value, 4);
+  return bits;
+}
+
+// 64 bit mix of a grid cell
+static uint64_t hashCell(int64_t qx, int64_t qy, int64_t qz) {
+  uint64_t h = (uint64_t)qx * 0x9E3779B97F4A7C15ULL;
+  h ^= (uint64_t)qy * 0xC2B2AE3D27D4EB4FULL;
+  h ^= (uint64_t)qz * 0x165667B19E3779F9ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 32);
+}
+
+// Empty mesh, vertices closer than quantum on a grid are welded
+void initMesh(stl_mesh *mesh, float quantum) {
+  memset(mesh, 0, sizeof(stl_mesh));
+  mesh->quantum = quantum;
+}
+
+// Release mesh arrays
+void freeMesh(stl_mesh *mesh) {
+  free(mesh->x);
+  free(mesh->y);
+  free(mesh->z);
+  free(mesh->indices);
+  free(mesh->slots);
+  initMesh(mesh, mesh->quantum);
+}
+
+// Drop all tris/vertices and any failure, keep allocations
+void clearMesh(stl_mesh *mesh) {
+  mesh->vertCount = 0;
+  mesh->triCount = 0;
+  mesh->failed = 0;
+  if(mesh->slots)
+    memset(mesh->slots, 0, sizeof(uint32_t) * (mesh->slotMask + 1));
+}
+
+// Rebuild weld table with room for vertCount vertices at <= 50% load
+// -> 0 on success, -1 (old table kept) out of memory
+static int growSlots(stl_mesh *mesh, uint32_t vertCount) {
+  uint32_t size = 1024, ndx, slot, *slots;
+  float v[3];
+
+  while(size < vertCount * 2)
+    size *= 2;
+  if(mesh->slots && size <= mesh->slotMask + 1)
+    return 0;
+
+  if(!(slots = calloc(size, sizeof(uint32_t))))
+    return -1;
+  free(mesh->slots);
+  mesh->slots = slots;
+  mesh->slotMask = size - 1;
+  for(ndx = 0; ndx < mesh->vertCount; ndx++) {
+    v[0] = mesh->x[ndx]; v[1] = mesh->y[ndx]; v[2] = mesh->z[ndx];
+    slot = hashCell(quantize(v[0], mesh->quantum), quantize(v[1], mesh->quantum),
+                    quantize(v[2], mesh->quantum)) & mesh->slotMask;
+    while(mesh->slots[slot])
+      slot = (slot + 1) & mesh->slotMask;
+    mesh->slots[slot] = ndx + 1;
+  }
+  return 0;
+}
+
+// Reserve room for triCount more tris and vertCount more vertices -> 0 on
+// success, -1 out of memory: the mesh is marked failed, its arrays kept
+int reserveMesh(stl_mesh *mesh, uint32_t triCount, uint32_t vertCount) {
+  uint32_t alloc, *indices;
+  float *grown = NULL;
+
+  if(mesh->triCount + triCount > mesh->triAlloc) {
+    for(alloc = mesh->triAlloc ? mesh->triAlloc : 1024; alloc < mesh->triCount + triCount; )
+      alloc *= 2;
+    if(!(indices = realloc(mesh->indices, sizeof(uint32_t) * 3 * alloc))) {
+      mesh->failed = 1;
+      return -1;
+    }
+    mesh->indices = indices;
+    mesh->triAlloc = alloc;
+  }
+  if(mesh->vertCount + vertCount > mesh->vertAlloc) {
+    for(alloc = mesh->vertAlloc ? mesh->vertAlloc : 1024; alloc < mesh->vertCount + vertCount; )
+      alloc *= 2;
+    // vertAlloc only grows once all three axes have
+    if((grown = realloc(mesh->x, sizeof(float) * alloc)))
+      mesh->x = grown;
+    if(grown && (grown = realloc(mesh->y, sizeof(float) * alloc)))
+      mesh->y = grown;
+    if(grown && (grown = realloc(mesh->z, sizeof(float) * alloc)))
+      mesh->z = grown;
+    if(!grown) {
+      mesh->failed = 1;
+      return -1;
+    }
+    mesh->vertAlloc = alloc;
+  }
+  if(growSlots(mesh, mesh->vertCount + vertCount) != 0) {
+    mesh->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+// Welded vertex -> index
+uint32_t addVertex(stl_mesh *mesh, const float *v) {
+  int64_t qx = quantize(v[0], mesh->quantum);
+  int64_t qy = quantize(v[1], mesh->quantum);
+  int64_t qz = quantize(v[2], mesh->quantum);
+  uint32_t slot, ndx;
+
+  if(mesh->failed)
+    return 0;
+  if((mesh->vertCount + 1 > mesh->vertAlloc || (mesh->vertCount + 1) * 2 > mesh->slotMask + 1) &&
+     reserveMesh(mesh, 0, 1) != 0)
+    return 0;
+
+  // Probe until the cell is found or an empty slot is hit
+  for(slot = hashCell(qx, qy, qz) & mesh->slotMask; mesh->slots[slot]; slot = (slot + 1) & mesh->slotMask) {
+    ndx = mesh->slots[slot] - 1;
+    if(quantize(mesh->x[ndx], mesh->quantum) == qx &&
+       quantize(mesh->y[ndx], mesh->quantum) == qy &&
+       quantize(mesh->z[ndx], mesh->quantum) == qz)
+      return ndx;
+  }
+
+  ndx = mesh->vertCount++;
+  mesh->x[ndx] = v[0];
+  mesh->y[ndx] = v[1];
+  mesh->z[ndx] = v[2];
+  mesh->slots[slot] = ndx + 1;
+  return ndx;
+}
+
+// Append tri by vertex indices
+void addIndexedTri(stl_mesh *mesh, uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t *tri;
+
+  if(mesh->failed || (mesh->triCount + 1 > mesh->triAlloc && reserveMesh(mesh, 1, 0) != 0))
+    return;
+  tri = &mesh->indices[3 * mesh->triCount++];
+  tri[0] = a;
+  tri[1] = b;
+  tri[2] = c;
+}
+
+// Append tri array, welding vertices -> 0 on success, -1 out of memory
+int meshFromTris(stl_mesh *mesh, int triCount, stl_tri *tris) {
+  int ndx;
+
+  // Closed meshes have about half as many vertices as tris
+  if(reserveMesh(mesh, triCount, triCount / 2 + 3) != 0)
+    return -1;
+  for(ndx = 0; ndx < triCount; ndx++)
+    addIndexedTri(mesh, addVertex(mesh, tris[ndx].vertexA),
+                        addVertex(mesh, tris[ndx].vertexB),
+                        addVertex(mesh, tris[ndx].vertexC));
+  return mesh->failed ? -1 : 0;
+}
+
+// Tri ndx -> stl_tri with normal from winding
+void meshTri(stl_mesh *mesh, uint32_t ndx, stl_tri *tri) {
+  uint32_t *face = &mesh->indices[3 * ndx];
+  float u[3], w[3], len;
+  int axis;
+
+  tri->vertexA[0] = mesh->x[face[0]]; tri->vertexA[1] = mesh->y[face[0]]; tri->vertexA[2] = mesh->z[face[0]];
+  tri->vertexB[0] = mesh->x[face[1]]; tri->vertexB[1] = mesh->y[face[1]]; tri->vertexB[2] = mesh->z[face[1]];
+  tri->vertexC[0] = mesh->x[face[2]]; tri->vertexC[1] = mesh->y[face[2]]; tri->vertexC[2] = mesh->z[face[2]];
+
+  for(axis = 0; axis < 3; axis++) {
+    u[axis] = tri->vertexB[axis] - tri->vertexA[axis];
+    w[axis] = tri->vertexC[axis] - tri->vertexA[axis];
+  }
+  tri->normal[0] = u[1] * w[2] - u[2] * w[1];
+  tri->normal[1] = u[2] * w[0] - u[0] * w[2];
+  tri->normal[2] = u[0] * w[1] - u[1] * w[0];
+  len = sqrtf(tri->normal[0] * tri->normal[0] + tri->normal[1] * tri->normal[1] +
+              tri->normal[2] * tri->normal[2]);
+  for(axis = 0; axis < 3; axis++)
+    tri->normal[axis] = len > 0.0f ? tri->normal[axis] / len : 0.0f;
+}
+
+// Expand mesh -> tris (room for mesh->triCount), returns tri count
+int meshToTris(stl_mesh *mesh, stl_tri *tris) {
+  uint32_t ndx;
+
+  for(ndx = 0; ndx < mesh->triCount; ndx++)
+    meshTri(mesh, ndx, &tris[ndx]);
+  return mesh->triCount;
+}
+
+// Transform every vertex once, mirroring transforms flip winding back;
+// marks the mesh failed if its weld table can't be rebuilt
+void transformMesh(const affine_transform *t, stl_mesh *mesh) {
+  const float (*m)[4] = t->m;
+  float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+              m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+              m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  uint32_t ndx, swap;
+
+  transformPoints(t, mesh->vertCount, mesh->x, mesh->y, mesh->z);
+  if(det < 0.0f) {
+    for(ndx = 0; ndx < mesh->triCount; ndx++) {
+      swap = mesh->indices[3*ndx + 1];
+      mesh->indices[3*ndx + 1] = mesh->indices[3*ndx + 2];
+      mesh->indices[3*ndx + 2] = swap;
+    }
+  }
+
+  // Coordinates moved, rebuild the weld table
+  free(mesh->slots);
+  mesh->slots = NULL;
+  if(growSlots(mesh, mesh->vertAlloc) != 0)
+    mesh->failed = 1;
+}
+
+// Bounding box of all vertices
+bounding_box getMeshBoundingBox(stl_mesh *mesh) {
+  return getPointsBoundingBox(mesh->vertCount, mesh->x, mesh->y, mesh->z);
+}
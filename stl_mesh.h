@@ -0,0 +1,59 @@
+// Chris Polis
+// stl_mesh.h - indexed triangle meshes with welded vertices
+
+#ifndef __include_stl_mesh
+#define __include_stl_mesh
+
+#include <stdint.h>
+#include "stl_util.h"
+
+// Shared vertices (structure of arrays) + 3 indices per tri
+typedef struct stl_mesh_st {
+  float *x, *y, *z;
+  uint32_t vertCount, vertAlloc;
+  uint32_t *indices;
+  uint32_t triCount, triAlloc;
+
+  // Weld table: open addressing, slot = vertex index + 1, 0 = empty
+  uint32_t *slots;
+  uint32_t slotMask;
+  float quantum;            // weld grid size, 0 -> exact matches only
+  int failed;               // an allocation failed, later tris/vertices dropped
+} stl_mesh;
+
+// Empty mesh, vertices closer than quantum on a grid are welded
+void initMesh(stl_mesh *mesh, float quantum);
+
+// Release mesh arrays
+void freeMesh(stl_mesh *mesh);
+
+// Drop all tris/vertices and any failure, keep allocations
+void clearMesh(stl_mesh *mesh);
+
+// Reserve room for triCount more tris and vertCount more vertices -> 0 on
+// success, -1 out of memory: the mesh is marked failed, its arrays kept
+int reserveMesh(stl_mesh *mesh, uint32_t triCount, uint32_t vertCount);
+
+// Welded vertex -> index, 0 once the mesh has failed
+uint32_t addVertex(stl_mesh *mesh, const float *v);
+
+// Append tri by vertex indices, dropped once the mesh has failed
+void addIndexedTri(stl_mesh *mesh, uint32_t a, uint32_t b, uint32_t c);
+
+// Append tri array, welding vertices -> 0 on success, -1 out of memory
+int meshFromTris(stl_mesh *mesh, int triCount, stl_tri *tris);
+
+// Tri ndx -> stl_tri with normal from winding
+void meshTri(stl_mesh *mesh, uint32_t ndx, stl_tri *tri);
+
+// Expand mesh -> tris (room for mesh->triCount), returns tri count
+int meshToTris(stl_mesh *mesh, stl_tri *tris);
+
+// Transform every vertex once, mirroring transforms flip winding back;
+// marks the mesh failed if its weld table can't be rebuilt
+void transformMesh(const affine_transform *t, stl_mesh *mesh);
+
+// Bounding box of all vertices
+bounding_box getMeshBoundingBox(stl_mesh *mesh);
+
+#endif
@@ -0,0 +1,118 @@
+// Chris Polis
+// stl_thread.c - worker threads for chunked STL processing
+//
+// Pool threads are started on first use and kept for the life of the
+// process. Each runTasks call lists its batch in the pool, the calling
+// thread and up to threadCount - 1 pool threads claim its tasks, and the
+// call returns once its helpers have left. Calls from several threads
+// (server jobs) share the pool.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "stl_thread.h"
+
+#define MAX_THREADS 256
+
+// One runTasks call, on the caller's stack while it runs
+typedef struct task_batch_st {
+  task_fn fn;
+  void *ctx;
+  int taskCount;
+  int next;                     // next unclaimed task, shared by workers
+  int helpers;                  // pool threads still wanted
+  int active;                   // pool threads working on it
+  struct task_batch_st *link;
+} task_batch;
+
+typedef struct task_pool_st {
+  pthread_mutex_t lock;
+  pthread_cond_t work, idle;
+  task_batch *batches;          // listed batches, newest first
+  int threads;
+} task_pool;
+
+static task_pool pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                          PTHREAD_COND_INITIALIZER, NULL, 0 };
+
+// Worker count: STL_THREADS from the environment or online CPUs
+int getThreadCount(void) {
+  char *env = getenv("STL_THREADS");
+  long count = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(count < 1)
+    return 1;
+  return count > MAX_THREADS ? MAX_THREADS : (int)count;
+}
+
+// Claim tasks until none are left
+static void runBatch(task_batch *batch) {
+  int ndx;
+
+  while((ndx = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->taskCount)
+    batch->fn(batch->ctx, ndx);
+}
+
+// Help any listed batch that wants more threads, else sleep
+static void *poolWorker(void *arg) {
+  task_batch *batch;
+
+  pthread_mutex_lock(&pool.lock);
+  for(;;) {
+    for(batch = pool.batches; batch && batch->helpers == 0; batch = batch->link)
+      ;
+    if(!batch) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+      continue;
+    }
+    batch->helpers--;
+    batch->active++;
+    pthread_mutex_unlock(&pool.lock);
+    runBatch(batch);
+    pthread_mutex_lock(&pool.lock);
+    if(--batch->active == 0)
+      pthread_cond_broadcast(&pool.idle);
+  }
+  return NULL;
+}
+
+// Run taskCount tasks on the calling thread and up to threadCount - 1
+// persistent pool threads, return when all finish
+void runTasks(int threadCount, int taskCount, task_fn fn, void *ctx) {
+  task_batch batch = { fn, ctx, taskCount, 0, 0, 0, NULL };
+  task_batch **link;
+  pthread_t thread;
+
+  if(threadCount > taskCount)
+    threadCount = taskCount;
+  if(threadCount > MAX_THREADS)
+    threadCount = MAX_THREADS;
+  if(threadCount <= 1) {
+    runBatch(&batch);
+    return;
+  }
+
+  // Grow the pool to the most helpers any call has asked for
+  pthread_mutex_lock(&pool.lock);
+  while(pool.threads < threadCount - 1 && pthread_create(&thread, NULL, poolWorker, NULL) == 0) {
+    pthread_detach(thread);
+    pool.threads++;
+  }
+  batch.helpers = threadCount - 1;
+  batch.link = pool.batches;
+  pool.batches = &batch;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  // Calling thread works too
+  runBatch(&batch);
+
+  // Unlist the batch, then wait for helpers still running its tasks
+  pthread_mutex_lock(&pool.lock);
+  for(link = &pool.batches; *link != &batch; link = &(*link)->link)
+    ;
+  *link = batch.link;
+  while(batch.active > 0)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,17 @@
+// Chris Polis
+// stl_thread.h - worker threads for chunked STL processing
+
+#ifndef __include_stl_thread
+#define __include_stl_thread
+
+// Task callback, taskNdx in [0, taskCount)
+typedef void (*task_fn)(void *ctx, int taskNdx);
+
+// Worker count: STL_THREADS from the environment or online CPUs
+int getThreadCount(void);
+
+// Run taskCount tasks on the calling thread and up to threadCount - 1
+// persistent pool threads, return when all finish
+void runTasks(int threadCount, int taskCount, task_fn fn, void *ctx);
+
+#endif
@@ -2,8 +2,17 @@
 // stl_util.c - library for creating and editing STL files 
 
 #include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "stl_util.h"
 
+// Tris moved through the structure-of-arrays scratch at a time
+#define SOA_BLOCK 1024
+
+static void gatherVertices(stl_tri *tris, int triCount, float *x, float *y, float *z);
+
 // Leg of 45/45/90 tri with c=1
 # define LEG45 0.70710678118 //= sqrt(2.0)/2
 
@@ -143,19 +152,470 @@ void translateTri(stl_tri *tri, float x, float y, float z) {
 }
 
 // Scale (float)
-//void scaleSolid(float scale, int triCount, stl_tri *tris);
+void scaleSolid(float scale, int triCount, stl_tri *tris) {
+  affine_transform t = scaleTransform(scale, scale, scale);
+  transformTris(&t, triCount, tris);
+}
 
-// Rotate (theta, phi)
-//void rotateSolid(float theta, float phi, int triCount, stl_tri *tris);
+// Rotate (theta, phi): theta radians about Z, then phi radians about X
+void rotateSolid(float theta, float phi, int triCount, stl_tri *tris) {
+  affine_transform t = composeTransform(rotateTransform(2, theta), rotateTransform(0, phi));
+  transformTris(&t, triCount, tris);
+}
 
 // Move (x, y, z)
-//void moveSolid(float x, float y, float z, int triCount, stl_tri *tris);
+void moveSolid(float x, float y, float z, int triCount, stl_tri *tris) {
+  affine_transform t = translateTransform(x, y, z);
+  transformTris(&t, triCount, tris);
+}
 
 // Get Bounding Box -> xMin, xMax, yMin, yMax, zMin, zMax
-//bounding_box getBoundingBox(int triCount, stl_tri *tris);
+bounding_box getBoundingBox(int triCount, stl_tri *tris) {
+  float x[3 * SOA_BLOCK], y[3 * SOA_BLOCK], z[3 * SOA_BLOCK];
+  bounding_box box = { INFINITY, -INFINITY, INFINITY, -INFINITY, INFINITY, -INFINITY };
+  bounding_box part;
+  int ndx, batch;
+
+  for(ndx = 0; ndx < triCount; ndx += batch) {
+    batch = triCount - ndx < SOA_BLOCK ? triCount - ndx : SOA_BLOCK;
+    gatherVertices(&tris[ndx], batch, x, y, z);
+    part = getPointsBoundingBox(3 * batch, x, y, z);
+    box.minX = fminf(box.minX, part.minX); box.maxX = fmaxf(box.maxX, part.maxX);
+    box.minY = fminf(box.minY, part.minY); box.maxY = fmaxf(box.maxY, part.maxY);
+    box.minZ = fminf(box.minZ, part.minZ); box.maxZ = fmaxf(box.maxZ, part.maxZ);
+  }
+  return box;
+}
+
+// Get Volume -> units^3, signed by the winding
+double getVolume(int triCount, stl_tri *tris) {
+  mass_sums sums;
+
+  initMassSums(&sums, triCount > 0 ? tris[0].vertexA : NULL);
+  addMassTris(&sums, triCount, tris);
+  return getMassProps(&sums).volume;
+}
+
+//////////////////////////////////////////////////////
+// Mass properties
+//////////////////////////////////////////////////////
+
+void initMassSums(mass_sums *sums, const float *origin) {
+  bounding_box empty = { INFINITY, -INFINITY, INFINITY, -INFINITY, INFINITY, -INFINITY };
+  int k;
+
+  memset(sums, 0, sizeof(mass_sums));
+  for(k = 0; k < 3; k++)
+    sums->origin[k] = origin ? origin[k] : 0.0;
+  sums->box = empty;
+}
+
+// Neumaier compensated add
+static void addTerm(mass_sums *sums, int term, double value) {
+  double total = sums->sum[term] + value;
+
+  if(fabs(sums->sum[term]) >= fabs(value))
+    sums->comp[term] += (sums->sum[term] - total) + value;
+  else
+    sums->comp[term] += (value - total) + sums->sum[term];
+  sums->sum[term] = total;
+}
+
+// Power sums of one coordinate over a tri's vertices (Eberly, polyhedral
+// mass properties): f1..f3 for the 1st..3rd moments, g for the products
+static void powerSums(double w0, double w1, double w2, double *f1, double *f2, double *f3, double *g) {
+  double temp0 = w0 + w1, temp1 = w0 * w0, temp2 = temp1 + w1 * temp0;
+
+  *f1 = temp0 + w2;
+  *f2 = temp2 + w2 * *f1;
+  *f3 = w0 * temp1 + w1 * temp2 + w2 * *f2;
+  g[0] = *f2 + w0 * (*f1 + w0);
+  g[1] = *f2 + w1 * (*f1 + w1);
+  g[2] = *f2 + w2 * (*f1 + w2);
+}
+
+// Each tri is the base of a tetrahedron with its apex at the origin,
+// volume integrals by the divergence theorem
+void addMassTris(mass_sums *sums, int triCount, const stl_tri *tris) {
+  double x[3], y[3], z[3], d[3], f1[3], f2[3], f3[3], gx[3], gy[3], gz[3];
+  double a1, b1, c1, a2, b2, c2;
+  const float *v[3];
+  int ndx, k;
+
+  for(ndx = 0; ndx < triCount; ndx++) {
+    v[0] = tris[ndx].vertexA;
+    v[1] = tris[ndx].vertexB;
+    v[2] = tris[ndx].vertexC;
+    for(k = 0; k < 3; k++) {
+      sums->box.minX = fminf(sums->box.minX, v[k][0]); sums->box.maxX = fmaxf(sums->box.maxX, v[k][0]);
+      sums->box.minY = fminf(sums->box.minY, v[k][1]); sums->box.maxY = fmaxf(sums->box.maxY, v[k][1]);
+      sums->box.minZ = fminf(sums->box.minZ, v[k][2]); sums->box.maxZ = fmaxf(sums->box.maxZ, v[k][2]);
+      x[k] = v[k][0] - sums->origin[0];
+      y[k] = v[k][1] - sums->origin[1];
+      z[k] = v[k][2] - sums->origin[2];
+    }
+
+    a1 = x[1] - x[0]; b1 = y[1] - y[0]; c1 = z[1] - z[0];
+    a2 = x[2] - x[0]; b2 = y[2] - y[0]; c2 = z[2] - z[0];
+    d[0] = b1 * c2 - b2 * c1;
+    d[1] = a2 * c1 - a1 * c2;
+    d[2] = a1 * b2 - a2 * b1;
+
+    powerSums(x[0], x[1], x[2], &f1[0], &f2[0], &f3[0], gx);
+    powerSums(y[0], y[1], y[2], &f1[1], &f2[1], &f3[1], gy);
+    powerSums(z[0], z[1], z[2], &f1[2], &f2[2], &f3[2], gz);
+
+    addTerm(sums, 0, sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]));
+    addTerm(sums, 1, d[0] * f1[0]);
+    for(k = 0; k < 3; k++) {
+      addTerm(sums, 2 + k, d[k] * f2[k]);
+      addTerm(sums, 5 + k, d[k] * f3[k]);
+    }
+    addTerm(sums, 8, d[0] * (y[0] * gx[0] + y[1] * gx[1] + y[2] * gx[2]));
+    addTerm(sums, 9, d[1] * (z[0] * gy[0] + z[1] * gy[1] + z[2] * gy[2]));
+    addTerm(sums, 10, d[2] * (x[0] * gz[0] + x[1] * gz[1] + x[2] * gz[2]));
+  }
+  sums->triCount += triCount;
+}
+
+void mergeMassSums(mass_sums *sums, const mass_sums *other) {
+  int term;
+
+  for(term = 0; term < MASS_TERMS; term++) {
+    addTerm(sums, term, other->sum[term]);
+    addTerm(sums, term, other->comp[term]);
+  }
+  sums->box.minX = fminf(sums->box.minX, other->box.minX); sums->box.maxX = fmaxf(sums->box.maxX, other->box.maxX);
+  sums->box.minY = fminf(sums->box.minY, other->box.minY); sums->box.maxY = fmaxf(sums->box.maxY, other->box.maxY);
+  sums->box.minZ = fminf(sums->box.minZ, other->box.minZ); sums->box.maxZ = fmaxf(sums->box.maxZ, other->box.maxZ);
+  sums->triCount += other->triCount;
+}
+
+mass_props getMassProps(const mass_sums *sums) {
+  static const double scale[MASS_TERMS] = { 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 24, 1.0 / 24,
+                                            1.0 / 60, 1.0 / 60, 1.0 / 60, 1.0 / 120, 1.0 / 120, 1.0 / 120 };
+  double v[MASS_TERMS], c[3], volume;
+  mass_props props;
+  int term, k;
+
+  memset(&props, 0, sizeof(mass_props));
+  for(term = 0; term < MASS_TERMS; term++)
+    v[term] = (sums->sum[term] + sums->comp[term]) * scale[term];
+  props.triCount = sums->triCount;
+  props.box = sums->box;
+  props.area = v[0];
+  props.volume = volume = v[1];
+  if(volume == 0.0)
+    return props;
+
+  // Centroid and inertia about it, relative to origin until the end
+  for(k = 0; k < 3; k++)
+    c[k] = v[2 + k] / volume;
+  props.inertia[0][0] = v[6] + v[7] - volume * (c[1] * c[1] + c[2] * c[2]);
+  props.inertia[1][1] = v[5] + v[7] - volume * (c[2] * c[2] + c[0] * c[0]);
+  props.inertia[2][2] = v[5] + v[6] - volume * (c[0] * c[0] + c[1] * c[1]);
+  props.inertia[0][1] = props.inertia[1][0] = volume * c[0] * c[1] - v[8];
+  props.inertia[1][2] = props.inertia[2][1] = volume * c[1] * c[2] - v[9];
+  props.inertia[0][2] = props.inertia[2][0] = volume * c[2] * c[0] - v[10];
+  for(k = 0; k < 3; k++)
+    props.centroid[k] = c[k] + sums->origin[k];
+  return props;
+}
+
+
+//////////////////////////////////////////////////////
+// Affine transforms
+//////////////////////////////////////////////////////
+affine_transform identityTransform(void) {
+  affine_transform t = {{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1} }};
+  return t;
+}
+
+affine_transform scaleTransform(float x, float y, float z) {
+  affine_transform t = identityTransform();
+  t.m[0][0] = x;
+  t.m[1][1] = y;
+  t.m[2][2] = z;
+  return t;
+}
+
+affine_transform translateTransform(float x, float y, float z) {
+  affine_transform t = identityTransform();
+  t.m[0][3] = x;
+  t.m[1][3] = y;
+  t.m[2][3] = z;
+  return t;
+}
+
+// Rotate angle radians about axis 0 (X), 1 (Y) or 2 (Z)
+affine_transform rotateTransform(int axis, float angle) {
+  affine_transform t = identityTransform();
+  int a = (axis + 1) % 3, b = (axis + 2) % 3;
+  float c = cosf(angle), s = sinf(angle);
+
+  t.m[a][a] = c;  t.m[a][b] = -s;
+  t.m[b][a] = s;  t.m[b][b] = c;
+  return t;
+}
+
+// first, then second
+affine_transform composeTransform(affine_transform first, affine_transform second) {
+  affine_transform t;
+  int row, col, k;
+
+  for(row = 0; row < 4; row++)
+    for(col = 0; col < 4; col++) {
+      t.m[row][col] = 0.0f;
+      for(k = 0; k < 4; k++)
+        t.m[row][col] += second.m[row][k] * first.m[k][col];
+    }
+  return t;
+}
+
+// Every kernel rounds ((m0 * x + m1 * y) + m2 * z) + m3 with no fused
+// multiply-add, so a vertex comes out the same whichever lane it lands in
+static void transformPointsScalar(const affine_transform *t, int count, float *x, float *y, float *z) {
+  int ndx;
+  float px, py, pz;
+
+  for(ndx = 0; ndx < count; ndx++) {
+    px = x[ndx]; py = y[ndx]; pz = z[ndx];
+    x[ndx] = t->m[0][0] * px + t->m[0][1] * py + t->m[0][2] * pz + t->m[0][3];
+    y[ndx] = t->m[1][0] * px + t->m[1][1] * py + t->m[1][2] * pz + t->m[1][3];
+    z[ndx] = t->m[2][0] * px + t->m[2][1] * py + t->m[2][2] * pz + t->m[2][3];
+  }
+}
+
+static bounding_box boundsScalar(int count, float *x, float *y, float *z) {
+  bounding_box box = { INFINITY, -INFINITY, INFINITY, -INFINITY, INFINITY, -INFINITY };
+  int ndx;
+
+  for(ndx = 0; ndx < count; ndx++) {
+    box.minX = x[ndx] < box.minX ? x[ndx] : box.minX;
+    box.maxX = x[ndx] > box.maxX ? x[ndx] : box.maxX;
+    box.minY = y[ndx] < box.minY ? y[ndx] : box.minY;
+    box.maxY = y[ndx] > box.maxY ? y[ndx] : box.maxY;
+    box.minZ = z[ndx] < box.minZ ? z[ndx] : box.minZ;
+    box.maxZ = z[ndx] > box.maxZ ? z[ndx] : box.maxZ;
+  }
+  return box;
+}
 
-// SKIP: Get Volume -> units^3
+#ifdef __SSE2__
+static void transformPointsSSE(const affine_transform *t, int count, float *x, float *y, float *z) {
+  __m128 m[3][4], px, py, pz;
+  int ndx, row, col;
 
+  for(row = 0; row < 3; row++)
+    for(col = 0; col < 4; col++)
+      m[row][col] = _mm_set1_ps(t->m[row][col]);
+
+  for(ndx = 0; ndx + 4 <= count; ndx += 4) {
+    px = _mm_loadu_ps(&x[ndx]);
+    py = _mm_loadu_ps(&y[ndx]);
+    pz = _mm_loadu_ps(&z[ndx]);
+    #define ROW_SSE(r) _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], px), _mm_mul_ps(m[r][1], py)), \
+                                             _mm_mul_ps(m[r][2], pz)), m[r][3])
+    _mm_storeu_ps(&x[ndx], ROW_SSE(0));
+    _mm_storeu_ps(&y[ndx], ROW_SSE(1));
+    _mm_storeu_ps(&z[ndx], ROW_SSE(2));
+    #undef ROW_SSE
+  }
+  transformPointsScalar(t, count - ndx, &x[ndx], &y[ndx], &z[ndx]);
+}
+
+// Horizontal min/max of 4 lanes
+static float minLanes(__m128 v) {
+  v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+  return _mm_cvtss_f32(_mm_min_ss(v, _mm_shuffle_ps(v, v, 1)));
+}
+static float maxLanes(__m128 v) {
+  v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+  return _mm_cvtss_f32(_mm_max_ss(v, _mm_shuffle_ps(v, v, 1)));
+}
+
+static bounding_box boundsSSE(int count, float *x, float *y, float *z) {
+  __m128 minX = _mm_set1_ps(INFINITY), minY = minX, minZ = minX;
+  __m128 maxX = _mm_set1_ps(-INFINITY), maxY = maxX, maxZ = maxX;
+  bounding_box box, tail;
+  int ndx;
+
+  for(ndx = 0; ndx + 4 <= count; ndx += 4) {
+    __m128 px = _mm_loadu_ps(&x[ndx]), py = _mm_loadu_ps(&y[ndx]), pz = _mm_loadu_ps(&z[ndx]);
+    minX = _mm_min_ps(minX, px); maxX = _mm_max_ps(maxX, px);
+    minY = _mm_min_ps(minY, py); maxY = _mm_max_ps(maxY, py);
+    minZ = _mm_min_ps(minZ, pz); maxZ = _mm_max_ps(maxZ, pz);
+  }
+  tail = boundsScalar(count - ndx, &x[ndx], &y[ndx], &z[ndx]);
+  box.minX = fminf(minLanes(minX), tail.minX); box.maxX = fmaxf(maxLanes(maxX), tail.maxX);
+  box.minY = fminf(minLanes(minY), tail.minY); box.maxY = fmaxf(maxLanes(maxY), tail.maxY);
+  box.minZ = fminf(minLanes(minZ), tail.minZ); box.maxZ = fmaxf(maxLanes(maxZ), tail.maxZ);
+  return box;
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void transformPointsAVX2(const affine_transform *t, int count, float *x, float *y, float *z) {
+  __m256 m[3][4], px, py, pz;
+  int ndx, row, col;
+
+  for(row = 0; row < 3; row++)
+    for(col = 0; col < 4; col++)
+      m[row][col] = _mm256_set1_ps(t->m[row][col]);
+
+  for(ndx = 0; ndx + 8 <= count; ndx += 8) {
+    px = _mm256_loadu_ps(&x[ndx]);
+    py = _mm256_loadu_ps(&y[ndx]);
+    pz = _mm256_loadu_ps(&z[ndx]);
+    #define ROW_AVX(r) _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], px), \
+                                 _mm256_mul_ps(m[r][1], py)), _mm256_mul_ps(m[r][2], pz)), m[r][3])
+    _mm256_storeu_ps(&x[ndx], ROW_AVX(0));
+    _mm256_storeu_ps(&y[ndx], ROW_AVX(1));
+    _mm256_storeu_ps(&z[ndx], ROW_AVX(2));
+    #undef ROW_AVX
+  }
+  transformPointsScalar(t, count - ndx, &x[ndx], &y[ndx], &z[ndx]);
+}
+
+__attribute__((target("avx2")))
+static bounding_box boundsAVX2(int count, float *x, float *y, float *z) {
+  __m256 minX = _mm256_set1_ps(INFINITY), minY = minX, minZ = minX;
+  __m256 maxX = _mm256_set1_ps(-INFINITY), maxY = maxX, maxZ = maxX;
+  float lo[8], hi[8];
+  bounding_box box;
+  int ndx;
+
+  for(ndx = 0; ndx + 8 <= count; ndx += 8) {
+    __m256 px = _mm256_loadu_ps(&x[ndx]), py = _mm256_loadu_ps(&y[ndx]), pz = _mm256_loadu_ps(&z[ndx]);
+    minX = _mm256_min_ps(minX, px); maxX = _mm256_max_ps(maxX, px);
+    minY = _mm256_min_ps(minY, py); maxY = _mm256_max_ps(maxY, py);
+    minZ = _mm256_min_ps(minZ, pz); maxZ = _mm256_max_ps(maxZ, pz);
+  }
+  box = boundsScalar(count - ndx, &x[ndx], &y[ndx], &z[ndx]);
+  #define REDUCE_AVX(vmin, vmax, fmin, fmax) \
+    _mm256_storeu_ps(lo, vmin); _mm256_storeu_ps(hi, vmax); \
+    for(ndx = 0; ndx < 8; ndx++) { \
+      box.fmin = lo[ndx] < box.fmin ? lo[ndx] : box.fmin; \
+      box.fmax = hi[ndx] > box.fmax ? hi[ndx] : box.fmax; \
+    }
+  REDUCE_AVX(minX, maxX, minX, maxX)
+  REDUCE_AVX(minY, maxY, minY, maxY)
+  REDUCE_AVX(minZ, maxZ, minZ, maxZ)
+  #undef REDUCE_AVX
+  return box;
+}
+#endif
+
+typedef void (*points_kernel)(const affine_transform *, int, float *, float *, float *);
+typedef bounding_box (*bounds_kernel)(int, float *, float *, float *);
+
+// Widest kernels this CPU runs
+static points_kernel pointsKernel;
+static bounds_kernel boundsKernel;
+
+static void pickKernels(void) {
+  points_kernel points = transformPointsScalar;
+  bounds_kernel bounds = boundsScalar;
+
+#ifdef __SSE2__
+  points = transformPointsSSE;
+  bounds = boundsSSE;
+#endif
+#ifdef HAVE_AVX2_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    points = transformPointsAVX2;
+    bounds = boundsAVX2;
+  }
+#endif
+  boundsKernel = bounds;
+  pointsKernel = points;
+}
+
+// Transform points stored as x/y/z arrays (AVX2/SSE/scalar picked at runtime)
+void transformPoints(const affine_transform *t, int count, float *x, float *y, float *z) {
+  if(!pointsKernel)
+    pickKernels();
+  pointsKernel(t, count, x, y, z);
+}
+
+// Bounding box of points stored as x/y/z arrays
+bounding_box getPointsBoundingBox(int count, float *x, float *y, float *z) {
+  if(!boundsKernel)
+    pickKernels();
+  return boundsKernel(count, x, y, z);
+}
+
+// Tri vertices -> x/y/z arrays (A, B, C of each tri in turn)
+static void gatherVertices(stl_tri *tris, int triCount, float *x, float *y, float *z) {
+  int ndx;
+  for(ndx = 0; ndx < triCount; ndx++) {
+    x[3*ndx] = tris[ndx].vertexA[0]; y[3*ndx] = tris[ndx].vertexA[1]; z[3*ndx] = tris[ndx].vertexA[2];
+    x[3*ndx+1] = tris[ndx].vertexB[0]; y[3*ndx+1] = tris[ndx].vertexB[1]; z[3*ndx+1] = tris[ndx].vertexB[2];
+    x[3*ndx+2] = tris[ndx].vertexC[0]; y[3*ndx+2] = tris[ndx].vertexC[1]; z[3*ndx+2] = tris[ndx].vertexC[2];
+  }
+}
+
+// x/y/z arrays -> tri vertices, B and C swapped when flip is set
+static void scatterVertices(stl_tri *tris, int triCount, float *x, float *y, float *z, int flip) {
+  int ndx, b = flip ? 2 : 1, c = flip ? 1 : 2;
+  for(ndx = 0; ndx < triCount; ndx++) {
+    tris[ndx].vertexA[0] = x[3*ndx]; tris[ndx].vertexA[1] = y[3*ndx]; tris[ndx].vertexA[2] = z[3*ndx];
+    tris[ndx].vertexB[0] = x[3*ndx+b]; tris[ndx].vertexB[1] = y[3*ndx+b]; tris[ndx].vertexB[2] = z[3*ndx+b];
+    tris[ndx].vertexC[0] = x[3*ndx+c]; tris[ndx].vertexC[1] = y[3*ndx+c]; tris[ndx].vertexC[2] = z[3*ndx+c];
+  }
+}
+
+// Cofactors of the 3x3 part (determinant * inverse transpose) -> determinant
+static float normalMatrix(const affine_transform *t, float n[3][3]) {
+  const float (*m)[4] = t->m;
+  n[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  n[0][1] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  n[0][2] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  n[1][0] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+  n[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+  n[1][2] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+  n[2][0] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+  n[2][1] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+  n[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+  return m[0][0] * n[0][0] + m[0][1] * n[0][1] + m[0][2] * n[0][2];
+}
+
+// Transform vertices, rotate normals (mirroring transforms keep winding outward)
+void transformTris(const affine_transform *t, int triCount, stl_tri *tris) {
+  float x[3 * SOA_BLOCK], y[3 * SOA_BLOCK], z[3 * SOA_BLOCK];
+  float n[3][3], v[3], len;
+  int ndx, batch, tri, flip = normalMatrix(t, n) < 0.0f;
+
+  for(ndx = 0; ndx < triCount; ndx += batch) {
+    batch = triCount - ndx < SOA_BLOCK ? triCount - ndx : SOA_BLOCK;
+    gatherVertices(&tris[ndx], batch, x, y, z);
+    transformPoints(t, 3 * batch, x, y, z);
+    scatterVertices(&tris[ndx], batch, x, y, z, flip);
+  }
+
+  // Pure translation leaves normals alone
+  if(t->m[0][0] == 1.0f && t->m[0][1] == 0.0f && t->m[0][2] == 0.0f &&
+     t->m[1][0] == 0.0f && t->m[1][1] == 1.0f && t->m[1][2] == 0.0f &&
+     t->m[2][0] == 0.0f && t->m[2][1] == 0.0f && t->m[2][2] == 1.0f)
+    return;
+
+  for(tri = 0; tri < triCount; tri++) {
+    float *normal = tris[tri].normal;
+    v[0] = n[0][0] * normal[0] + n[0][1] * normal[1] + n[0][2] * normal[2];
+    v[1] = n[1][0] * normal[0] + n[1][1] * normal[1] + n[1][2] * normal[2];
+    v[2] = n[2][0] * normal[0] + n[2][1] * normal[1] + n[2][2] * normal[2];
+    len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    len = flip ? -len : len;    // cofactors carry the determinant's sign
+    if(len != 0.0f) {
+      normal[0] = v[0] / len;
+      normal[1] = v[1] / len;
+      normal[2] = v[2] / len;
+    }
+  }
+}
 
 ///////////////////////////////////////////////////////
 // Misc
@@ -5,6 +5,7 @@
 #define __include_stl_util
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <math.h>
 
 // Leg of 45/45/90 tri with c=1
@@ -69,6 +70,31 @@ typedef struct bounding_box_st {
   float minX, maxX, minY, maxY, minZ, maxZ;
 } bounding_box;
 
+// Running sums for mass properties: area, then volume integrals about
+// origin (1, x, y, z, x^2, y^2, z^2, xy, yz, zx), each with its
+// compensation term
+#define MASS_TERMS 11
+typedef struct mass_sums_st {
+  double origin[3];
+  double sum[MASS_TERMS], comp[MASS_TERMS];
+  bounding_box box;
+  uint64_t triCount;
+} mass_sums;
+
+// Solid of uniform unit density bounded by the tris (outward winding)
+typedef struct mass_props_st {
+  uint64_t triCount;
+  bounding_box box;
+  double area, volume;      // volume < 0: inward winding
+  double centroid[3];
+  double inertia[3][3];     // about the centroid, times density for mass units
+} mass_props;
+
+// 4x4 affine transform, m[row][col], applied to column vectors (x, y, z, 1)
+typedef struct affine_transform_st {
+  float m[4][4];
+} affine_transform;
+
 
 //////////////////////////////////////////////////////
 // Face/solid construction
@@ -91,7 +117,7 @@ void translateTri(stl_tri *tri, float x, float y, float z);
 // Scale (float)
 void scaleSolid(float scale, int triCount, stl_tri *tris);
 
-// Rotate (theta, phi)
+// Rotate (theta, phi): theta radians about Z, then phi radians about X
 void rotateSolid(float theta, float phi, int triCount, stl_tri *tris);
 
 // Move (x, y, z)
@@ -100,7 +126,42 @@ void moveSolid(float x, float y, float z, int triCount, stl_tri *tris);
 // Get Bounding Box -> xMin, xMax, yMin, yMax, zMin, zMax
 bounding_box getBoundingBox(int triCount, stl_tri *tris);
 
-// SKIP: Get Volume -> units^3
+// Get Volume -> units^3, signed by the winding
+double getVolume(int triCount, stl_tri *tris);
+
+// Empty sums about origin (any point near the mesh keeps them precise)
+void initMassSums(mass_sums *sums, const float *origin);
+
+// Add tris to sums, one pass
+void addMassTris(mass_sums *sums, int triCount, const stl_tri *tris);
+
+// Add other's sums to sums, both about the same origin
+void mergeMassSums(mass_sums *sums, const mass_sums *other);
+
+// Bounding box, area, volume, centroid and inertia from sums
+mass_props getMassProps(const mass_sums *sums);
+
+//////////////////////////////////////////////////////
+// Affine transforms
+//////////////////////////////////////////////////////
+affine_transform identityTransform(void);
+affine_transform scaleTransform(float x, float y, float z);
+affine_transform translateTransform(float x, float y, float z);
+
+// Rotate angle radians about axis 0 (X), 1 (Y) or 2 (Z)
+affine_transform rotateTransform(int axis, float angle);
+
+// first, then second
+affine_transform composeTransform(affine_transform first, affine_transform second);
+
+// Transform points stored as x/y/z arrays (AVX2/SSE/scalar picked at runtime)
+void transformPoints(const affine_transform *t, int count, float *x, float *y, float *z);
+
+// Transform vertices, rotate normals (mirroring transforms keep winding outward)
+void transformTris(const affine_transform *t, int triCount, stl_tri *tris);
+
+// Bounding box of points stored as x/y/z arrays
+bounding_box getPointsBoundingBox(int count, float *x, float *y, float *z);
 
 
 //////////////////////////////////////////////
@@ -0,0 +1,427 @@
+// Chris Polis
+// stl_validate.c - watertightness and orientation checks on worker threads
+//
+// Vertices and then edges are hashed into shards: each chunk of tris
+// counts its records per shard, the counts give every chunk its place in
+// each shard, a second pass scatters the records there, then every shard
+// is welded or counted in its own hash table on its own thread.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "stl_validate.h"
+#include "stl_thread.h"
+
+#define VALIDATE_CHUNK (1 << 16)    // tris per task
+#define SHARD_BITS     10
+#define SHARDS         (1 << SHARD_BITS)
+#define LOCAL_BITS     21           // vertex id: shard << LOCAL_BITS | index in shard
+#define BATCH_TRIS     1024
+
+// A tri corner to weld
+typedef struct vert_rec_st {
+  uint32_t bits[3];
+  uint32_t corner;                  // tri * 3 + k
+} vert_rec;
+
+// Edge table slot, key 0 is empty (vertex ids make lo < hi, key > 0)
+typedef struct edge_slot_st {
+  uint64_t key;
+  uint32_t uses, forward;
+} edge_slot;
+
+// Counts of one edge shard
+typedef struct shard_report_st {
+  uint64_t edgeCount, boundary, nonManifold, flipped;
+  edge_sample samples[VALIDATE_SAMPLES];
+  int sampleCount;
+} shard_report;
+
+typedef struct validate_job_st {
+  uint32_t triCount;
+  int chunks;
+  tri_fetch fetch;
+  void *ctx;
+  float origin[3];
+
+  size_t *offsets;                  // chunks x SHARDS: counts, then write positions
+  size_t shardStart[SHARDS + 1];
+  vert_rec *verts;
+  uint32_t *cornerIds;
+  uint64_t *edges;                  // key << 1 | forward
+
+  uint32_t *coordBits[SHARDS];      // welded vertices, 3 per local index
+  uint32_t vertCount[SHARDS];
+  int overflow;
+
+  double *volume;                   // per chunk: 6 x volume, compensation
+  uint64_t *degenerate, *mismatched;
+  shard_report *shards;
+} validate_job;
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static void vertexBits(const float *v, uint32_t *bits) {
+  int k;
+
+  memcpy(bits, v, sizeof(uint32_t) * 3);
+  for(k = 0; k < 3; k++)
+    if(bits[k] == 0x80000000u)
+      bits[k] = 0;
+}
+
+static uint64_t vertexHash(const uint32_t *bits) {
+  return mix64(((uint64_t)bits[0] << 32 | bits[1]) ^ mix64(bits[2] + 0x9e3779b97f4a7c15ULL));
+}
+
+// Neumaier compensated add
+static void addCompensated(double *sum, double *comp, double value) {
+  double total = *sum + value;
+
+  if(fabs(*sum) >= fabs(value))
+    *comp += (*sum - total) + value;
+  else
+    *comp += (value - total) + *sum;
+  *sum = total;
+}
+
+static const float *corner(const stl_tri *tri, int k) {
+  return k == 0 ? tri->vertexA : k == 1 ? tri->vertexB : tri->vertexC;
+}
+
+// Tris [first, last) of chunk ndx
+static void chunkRange(validate_job *job, int ndx, uint32_t *first, uint32_t *last) {
+  *first = (uint32_t)ndx * VALIDATE_CHUNK;
+  *last = job->triCount - *first < VALIDATE_CHUNK ? job->triCount : *first + VALIDATE_CHUNK;
+}
+
+// Normals, area and volume of a chunk; its vertices counted per shard
+static void countVertsTask(void *ctx, int ndx) {
+  validate_job *job = ctx;
+  size_t *counts = &job->offsets[(size_t)ndx * SHARDS];
+  double *volume = &job->volume[2 * ndx], a[3], b[3], c[3];
+  uint32_t first, last, tri, bits[3];
+  float u[3], v[3], cross[3], *n;
+  stl_tri t;
+  int k;
+
+  chunkRange(job, ndx, &first, &last);
+  for(tri = first; tri < last; tri++) {
+    job->fetch(job->ctx, tri, &t);
+    for(k = 0; k < 3; k++) {
+      vertexBits(corner(&t, k), bits);
+      counts[vertexHash(bits) >> (64 - SHARD_BITS)]++;
+      u[k] = t.vertexB[k] - t.vertexA[k];
+      v[k] = t.vertexC[k] - t.vertexA[k];
+      a[k] = (double)t.vertexA[k] - job->origin[k];
+      b[k] = (double)t.vertexB[k] - job->origin[k];
+      c[k] = (double)t.vertexC[k] - job->origin[k];
+    }
+    cross[0] = u[1] * v[2] - u[2] * v[1];
+    cross[1] = u[2] * v[0] - u[0] * v[2];
+    cross[2] = u[0] * v[1] - u[1] * v[0];
+    n = t.normal;
+    if(cross[0] == 0.0f && cross[1] == 0.0f && cross[2] == 0.0f)
+      job->degenerate[ndx]++;
+    else if((n[0] != 0.0f || n[1] != 0.0f || n[2] != 0.0f) &&
+            n[0] * cross[0] + n[1] * cross[1] + n[2] * cross[2] <= 0.0f)
+      job->mismatched[ndx]++;
+
+    // Tetrahedron with the origin
+    addCompensated(&volume[0], &volume[1], a[0] * (b[1] * c[2] - b[2] * c[1]) +
+                                           a[1] * (b[2] * c[0] - b[0] * c[2]) +
+                                           a[2] * (b[0] * c[1] - b[1] * c[0]));
+  }
+}
+
+// Vertices of a chunk into their shards
+static void scatterVertsTask(void *ctx, int ndx) {
+  validate_job *job = ctx;
+  size_t *pos = &job->offsets[(size_t)ndx * SHARDS];
+  uint32_t first, last, tri;
+  vert_rec *rec;
+  stl_tri t;
+  int k;
+
+  chunkRange(job, ndx, &first, &last);
+  for(tri = first; tri < last; tri++) {
+    job->fetch(job->ctx, tri, &t);
+    for(k = 0; k < 3; k++) {
+      uint32_t bits[3];
+      vertexBits(corner(&t, k), bits);
+      rec = &job->verts[pos[vertexHash(bits) >> (64 - SHARD_BITS)]++];
+      memcpy(rec->bits, bits, sizeof(bits));
+      rec->corner = tri * 3 + k;
+    }
+  }
+}
+
+static uint32_t tableSize(size_t count) {
+  uint32_t size = 16;
+  while(size < count * 2)
+    size <<= 1;
+  return size;
+}
+
+// Weld one shard's vertices, every corner gets its vertex id
+static void weldTask(void *ctx, int shard) {
+  validate_job *job = ctx;
+  size_t count = job->shardStart[shard + 1] - job->shardStart[shard], ndx;
+  vert_rec *recs = &job->verts[job->shardStart[shard]];
+  uint32_t size = tableSize(count), mask = size - 1, slot, local;
+  uint32_t *slots = calloc(size, sizeof(uint32_t));
+  uint32_t *coords = malloc(sizeof(uint32_t) * 3 * (count + 1));
+
+  if(!slots || !coords) {
+    job->overflow = 1;
+    free(slots);
+    free(coords);
+    return;
+  }
+  for(ndx = 0; ndx < count; ndx++) {
+    for(slot = vertexHash(recs[ndx].bits) & mask; slots[slot]; slot = (slot + 1) & mask)
+      if(memcmp(&coords[3 * (slots[slot] - 1)], recs[ndx].bits, sizeof(uint32_t) * 3) == 0)
+        break;
+    if(!slots[slot]) {
+      local = job->vertCount[shard]++;
+      memcpy(&coords[3 * local], recs[ndx].bits, sizeof(uint32_t) * 3);
+      slots[slot] = local + 1;
+    }
+    local = slots[slot] - 1;
+    if(local >> LOCAL_BITS)
+      job->overflow = 1;
+    job->cornerIds[recs[ndx].corner] = (uint32_t)shard << LOCAL_BITS | local;
+  }
+  free(slots);
+  job->coordBits[shard] = coords;
+}
+
+// Edges of a tri with distinct vertex ids -> # written to recs
+static int triEdges(const uint32_t *ids, uint64_t *recs) {
+  int k;
+
+  if(ids[0] == ids[1] || ids[1] == ids[2] || ids[2] == ids[0])
+    return 0;
+  for(k = 0; k < 3; k++) {
+    uint32_t from = ids[k], to = ids[(k + 1) % 3];
+    uint64_t key = from < to ? (uint64_t)from << 31 | to : (uint64_t)to << 31 | from;
+    recs[k] = key << 1 | (from < to);
+  }
+  return 3;
+}
+
+static int edgeShard(uint64_t rec) {
+  return mix64(rec >> 1) >> (64 - SHARD_BITS);
+}
+
+static void countEdgesTask(void *ctx, int ndx) {
+  validate_job *job = ctx;
+  size_t *counts = &job->offsets[(size_t)ndx * SHARDS];
+  uint32_t first, last, tri;
+  uint64_t recs[3];
+  int k, count;
+
+  chunkRange(job, ndx, &first, &last);
+  for(tri = first; tri < last; tri++) {
+    count = triEdges(&job->cornerIds[(size_t)tri * 3], recs);
+    for(k = 0; k < count; k++)
+      counts[edgeShard(recs[k])]++;
+  }
+}
+
+static void scatterEdgesTask(void *ctx, int ndx) {
+  validate_job *job = ctx;
+  size_t *pos = &job->offsets[(size_t)ndx * SHARDS];
+  uint32_t first, last, tri;
+  uint64_t recs[3];
+  int k, count;
+
+  chunkRange(job, ndx, &first, &last);
+  for(tri = first; tri < last; tri++) {
+    count = triEdges(&job->cornerIds[(size_t)tri * 3], recs);
+    for(k = 0; k < count; k++)
+      job->edges[pos[edgeShard(recs[k])]++] = recs[k];
+  }
+}
+
+// Coordinates of vertex id
+static void vertexAt(validate_job *job, uint32_t id, float *v) {
+  memcpy(v, &job->coordBits[id >> LOCAL_BITS][3 * (id & ((1u << LOCAL_BITS) - 1))], sizeof(float) * 3);
+}
+
+// Count one shard's edge uses per direction, then classify each edge
+static void edgeTableTask(void *ctx, int shard) {
+  validate_job *job = ctx;
+  shard_report *report = &job->shards[shard];
+  size_t count = job->shardStart[shard + 1] - job->shardStart[shard], ndx;
+  uint64_t *recs = &job->edges[job->shardStart[shard]], key;
+  uint32_t size = tableSize(count), mask = size - 1, slot;
+  edge_slot *slots = calloc(size, sizeof(edge_slot)), *e;
+  edge_problem problem;
+
+  if(!slots) {
+    job->overflow = 1;
+    return;
+  }
+  for(ndx = 0; ndx < count; ndx++) {
+    key = recs[ndx] >> 1;
+    for(slot = mix64(key) & mask; slots[slot].key && slots[slot].key != key; slot = (slot + 1) & mask)
+      ;
+    slots[slot].key = key;
+    slots[slot].uses++;
+    slots[slot].forward += recs[ndx] & 1;
+  }
+
+  for(slot = 0; slot < size; slot++) {
+    e = &slots[slot];
+    if(!e->key)
+      continue;
+    report->edgeCount++;
+    if(e->uses == 1)
+      problem = EDGE_BOUNDARY, report->boundary++;
+    else if(e->uses > 2)
+      problem = EDGE_NONMANIFOLD, report->nonManifold++;
+    else if(e->forward != 1)
+      problem = EDGE_FLIPPED, report->flipped++;
+    else
+      continue;
+    if(report->sampleCount < VALIDATE_SAMPLES) {
+      edge_sample *s = &report->samples[report->sampleCount++];
+      s->problem = problem;
+      s->uses = e->uses;
+      vertexAt(job, e->key >> 31, s->a);
+      vertexAt(job, e->key & 0x7fffffff, s->b);
+    }
+  }
+  free(slots);
+}
+
+// Per chunk counts -> each chunk's write positions, shard starts
+static void placeShards(validate_job *job) {
+  size_t total = 0, count;
+  int shard, ndx;
+
+  for(shard = 0; shard < SHARDS; shard++) {
+    job->shardStart[shard] = total;
+    for(ndx = 0; ndx < job->chunks; ndx++) {
+      count = job->offsets[(size_t)ndx * SHARDS + shard];
+      job->offsets[(size_t)ndx * SHARDS + shard] = total;
+      total += count;
+    }
+  }
+  job->shardStart[SHARDS] = total;
+}
+
+int validateMesh(uint32_t triCount, tri_fetch fetch, void *ctx, int threads, mesh_report *report) {
+  validate_job job;
+  double volume[2] = { 0.0, 0.0 };
+  stl_tri first;
+  int ndx, shard, result = -1;
+
+  memset(report, 0, sizeof(mesh_report));
+  memset(&job, 0, sizeof(validate_job));
+  report->triCount = triCount;
+  if(triCount == 0)
+    return 0;
+  if(triCount > UINT32_MAX / 3)
+    return -1;
+
+  job.triCount = triCount;
+  job.chunks = (triCount + VALIDATE_CHUNK - 1) / VALIDATE_CHUNK;
+  job.fetch = fetch;
+  job.ctx = ctx;
+  fetch(ctx, 0, &first);
+  memcpy(job.origin, first.vertexA, sizeof(job.origin));
+  job.offsets = calloc((size_t)job.chunks * SHARDS, sizeof(size_t));
+  job.volume = calloc(2 * job.chunks, sizeof(double));
+  job.degenerate = calloc(job.chunks, sizeof(uint64_t));
+  job.mismatched = calloc(job.chunks, sizeof(uint64_t));
+  job.shards = calloc(SHARDS, sizeof(shard_report));
+  job.verts = malloc(sizeof(vert_rec) * 3 * (size_t)triCount);
+  job.cornerIds = malloc(sizeof(uint32_t) * 3 * (size_t)triCount);
+  if(!job.offsets || !job.volume || !job.degenerate || !job.mismatched || !job.shards ||
+     !job.verts || !job.cornerIds)
+    goto done;
+
+  // Weld vertices
+  runTasks(threads, job.chunks, countVertsTask, &job);
+  placeShards(&job);
+  runTasks(threads, job.chunks, scatterVertsTask, &job);
+  runTasks(threads, SHARDS, weldTask, &job);
+  free(job.verts);
+  job.verts = NULL;
+  if(job.overflow)
+    goto done;
+
+  // Count edges
+  memset(job.offsets, 0, sizeof(size_t) * job.chunks * SHARDS);
+  runTasks(threads, job.chunks, countEdgesTask, &job);
+  placeShards(&job);
+  if(!(job.edges = malloc(sizeof(uint64_t) * (job.shardStart[SHARDS] + 1))))
+    goto done;
+  runTasks(threads, job.chunks, scatterEdgesTask, &job);
+  runTasks(threads, SHARDS, edgeTableTask, &job);
+  if(job.overflow)
+    goto done;
+
+  // Chunks and shards merged in order
+  for(ndx = 0; ndx < job.chunks; ndx++) {
+    addCompensated(&volume[0], &volume[1], job.volume[2 * ndx]);
+    addCompensated(&volume[0], &volume[1], job.volume[2 * ndx + 1]);
+    report->degenerateTris += job.degenerate[ndx];
+    report->normalMismatches += job.mismatched[ndx];
+  }
+  report->volume = (volume[0] + volume[1]) / 6.0;
+  for(shard = 0; shard < SHARDS; shard++) {
+    shard_report *s = &job.shards[shard];
+    report->vertCount += job.vertCount[shard];
+    report->edgeCount += s->edgeCount;
+    report->boundaryEdges += s->boundary;
+    report->nonManifoldEdges += s->nonManifold;
+    report->flippedEdges += s->flipped;
+    for(ndx = 0; ndx < s->sampleCount && report->sampleCount < VALIDATE_SAMPLES; ndx++)
+      report->samples[report->sampleCount++] = s->samples[ndx];
+  }
+  result = 0;
+
+done:
+  for(shard = 0; shard < SHARDS; shard++)
+    free(job.coordBits[shard]);
+  free(job.offsets);
+  free(job.volume);
+  free(job.degenerate);
+  free(job.mismatched);
+  free(job.shards);
+  free(job.verts);
+  free(job.cornerIds);
+  free(job.edges);
+  return result;
+}
+
+static void fetchView(void *ctx, uint32_t ndx, stl_tri *tri) {
+  viewTri(ctx, ndx, tri);
+}
+
+static void fetchArray(void *ctx, uint32_t ndx, stl_tri *tri) {
+  *tri = ((stl_tri *)ctx)[ndx];
+}
+
+int validateView(stl_view *view, int threads, mesh_report *report) {
+  return validateMesh(view->triCount, fetchView, view, threads, report);
+}
+
+int validateTris(uint32_t triCount, stl_tri *tris, int threads, mesh_report *report) {
+  return validateMesh(triCount, fetchArray, tris, threads, report);
+}
+
+int meshIsSound(const mesh_report *report) {
+  return report->boundaryEdges == 0 && report->nonManifoldEdges == 0 && report->flippedEdges == 0 &&
+         report->normalMismatches == 0 && report->volume >= 0.0;
+}
@@ -0,0 +1,52 @@
+// Chris Polis
+// stl_validate.h - watertightness and orientation checks on worker threads
+
+#ifndef __include_stl_validate
+#define __include_stl_validate
+
+#include <stdint.h>
+#include "stl_util.h"
+#include "stl_io.h"
+
+#define VALIDATE_SAMPLES 16       // problem edges kept for the report
+
+typedef enum edge_problem_en {
+  EDGE_BOUNDARY,                  // used by one tri: hole or T-junction
+  EDGE_NONMANIFOLD,               // used by more than two tris
+  EDGE_FLIPPED                    // two tris walk it the same way
+} edge_problem;
+
+typedef struct edge_sample_st {
+  edge_problem problem;
+  uint32_t uses;
+  float a[3], b[3];
+} edge_sample;
+
+// Vertices are welded on exact coordinates (-0 = 0), edges are the
+// vertex pairs of each tri in winding order
+typedef struct mesh_report_st {
+  uint64_t triCount, vertCount, edgeCount;
+  uint64_t boundaryEdges, nonManifoldEdges, flippedEdges;
+  uint64_t degenerateTris;        // zero area, edges of tris with a repeated vertex skipped
+  uint64_t normalMismatches;      // stored normal against the winding (zero normals pass)
+  double volume;                  // signed, < 0: closed mesh wound inward
+  edge_sample samples[VALIDATE_SAMPLES];
+  int sampleCount;
+} mesh_report;
+
+// Fill tri with tri ndx of a source
+typedef void (*tri_fetch)(void *ctx, uint32_t ndx, stl_tri *tri);
+
+// Check triCount tris read through fetch, split in fixed chunks on up to
+// threads threads; the report does not depend on the thread count.
+// -> 0 on success, -1 out of memory or too many distinct vertices
+int validateMesh(uint32_t triCount, tri_fetch fetch, void *ctx, int threads, mesh_report *report);
+
+// Same over a binary view or a tri array
+int validateView(stl_view *view, int threads, mesh_report *report);
+int validateTris(uint32_t triCount, stl_tri *tris, int threads, mesh_report *report);
+
+// 1 when closed, manifold, consistently wound outward and normals agree
+int meshIsSound(const mesh_report *report);
+
+#endif
@@ -0,0 +1,154 @@
+// Chris Polis
+// validate.c - A tool to check that an STL is watertight and consistently wound
+//
+// Usage: $ validate [input (.stl)] [--json] [--quiet]
+//
+// Reports boundary edges (holes, T-junctions), non-manifold edges, edges
+// two tris walk the same way (flipped faces), normals that disagree with
+// the winding, degenerate tris and an inside out (negative volume) mesh,
+// with the first problem edges. Binary input is checked straight from the
+// mapped file on worker threads (STL_THREADS overrides the count).
+// Exit status 0: sound, 1: problems found, 2: unreadable input.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stl_util.h"
+#include "stl_io.h"
+#include "stl_mesh.h"
+#include "stl_thread.h"
+#include "stl_validate.h"
+
+#define BATCH_TRIS 8192
+
+static const char *problemNames[] = { "boundary", "non-manifold", "flipped" };
+
+// Parse all ASCII facets -> tris, *count set
+stl_tri *readASCII(stl_parser *parser, uint32_t *count) {
+  uint32_t alloc = BATCH_TRIS;
+  stl_tri *tris = malloc(sizeof(stl_tri) * alloc);
+
+  *count = 0;
+  while(tris && parseTriASCII(parser, &tris[*count]))
+    if(++*count == alloc)
+      tris = realloc(tris, sizeof(stl_tri) * (alloc *= 2));
+  return tris;
+}
+
+// Expand a quantized mesh -> tris
+stl_tri *readMesh(stl_mesh *mesh) {
+  stl_tri *tris = malloc(sizeof(stl_tri) * (mesh->triCount + 1));
+  uint32_t ndx;
+
+  for(ndx = 0; tris && ndx < mesh->triCount; ndx++)
+    meshTri(mesh, ndx, &tris[ndx]);
+  return tris;
+}
+
+void printReport(const mesh_report *r, int json) {
+  const edge_sample *s;
+  int ndx;
+
+  if(json) {
+    printf("{ \"sound\": %s, \"triangles\": %llu, \"vertices\": %llu, \"edges\": %llu, \"boundary_edges\": %llu, "
+           "\"nonmanifold_edges\": %llu, \"flipped_edges\": %llu, \"degenerate_tris\": %llu, "
+           "\"normal_mismatches\": %llu, \"volume\": %.9g, \"samples\": [",
+           meshIsSound(r) ? "true" : "false", (unsigned long long)r->triCount,
+           (unsigned long long)r->vertCount, (unsigned long long)r->edgeCount,
+           (unsigned long long)r->boundaryEdges, (unsigned long long)r->nonManifoldEdges,
+           (unsigned long long)r->flippedEdges, (unsigned long long)r->degenerateTris,
+           (unsigned long long)r->normalMismatches, r->volume);
+    for(ndx = 0; ndx < r->sampleCount; ndx++) {
+      s = &r->samples[ndx];
+      printf("%s{ \"problem\": \"%s\", \"uses\": %u, \"a\": [%g, %g, %g], \"b\": [%g, %g, %g] }",
+             ndx ? ", " : "", problemNames[s->problem], s->uses, s->a[0], s->a[1], s->a[2], s->b[0], s->b[1], s->b[2]);
+    }
+    printf("] }\n");
+    return;
+  }
+
+  printf("triangles          : %llu (%llu vertices, %llu edges)\n", (unsigned long long)r->triCount,
+         (unsigned long long)r->vertCount, (unsigned long long)r->edgeCount);
+  printf("boundary edges     : %llu\n", (unsigned long long)r->boundaryEdges);
+  printf("non-manifold edges : %llu\n", (unsigned long long)r->nonManifoldEdges);
+  printf("flipped edges      : %llu\n", (unsigned long long)r->flippedEdges);
+  printf("normal mismatches  : %llu\n", (unsigned long long)r->normalMismatches);
+  printf("degenerate tris    : %llu\n", (unsigned long long)r->degenerateTris);
+  printf("volume             : %f%s\n", r->volume, r->volume < 0 ? " (inside out)" : "");
+  for(ndx = 0; ndx < r->sampleCount; ndx++) {
+    s = &r->samples[ndx];
+    printf("  %-12s x%u  (%g, %g, %g) - (%g, %g, %g)\n", problemNames[s->problem], s->uses,
+           s->a[0], s->a[1], s->a[2], s->b[0], s->b[1], s->b[2]);
+  }
+  printf("%s\n", meshIsSound(r) ? "OK: watertight and consistently wound" : "FAILED");
+}
+
+int main(int argc, char *argv[]) {
+  int json = 0, quiet = 0, ndx, result;
+
+  for(ndx = 2; ndx < argc; ndx++) {
+    if(strcmp(argv[ndx], "--json") == 0)
+      json = 1;
+    else if(strcmp(argv[ndx], "--quiet") == 0)
+      quiet = 1;
+    else
+      argc = 0;
+  }
+  if(argc < 2) {
+    printf("Usage: $ validate [input (.stl)] [--json] [--quiet]\n");
+    return 2;
+  }
+
+  stl_view view;
+  stl_parser parser;
+  stl_mesh mesh;
+  stl_tri *tris = NULL;
+  uint32_t triCount = 0;
+  mesh_report report;
+  int threads = getThreadCount();
+  FILE *infile = fopen(argv[1], "r");
+
+  if(!infile) {
+    printf("Could not open %s\n", argv[1]);
+    return 2;
+  }
+
+  switch(getFileMode(infile)) {
+    case QUANTIZED:
+      initMesh(&mesh, 0.0f);
+      if(readQuantized(infile, &mesh) == 0) {
+        triCount = mesh.triCount;
+        tris = readMesh(&mesh);
+      }
+      freeMesh(&mesh);
+      result = tris ? validateTris(triCount, tris, threads, &report) : -1;
+      break;
+
+    case ASCII:
+      if(openParser(&parser, infile) == 0) {
+        tris = readASCII(&parser, &triCount);
+        closeParser(&parser);
+      }
+      result = tris ? validateTris(triCount, tris, threads, &report) : -1;
+      break;
+
+    default:
+      if((result = openView(&view, infile)) == 0) {
+        result = validateView(&view, threads, &report);
+        closeView(&view);
+      }
+  }
+  free(tris);
+  fclose(infile);
+
+  if(result != 0) {
+    printf("Could not validate %s\n", argv[1]);
+    return 2;
+  }
+  if(!quiet)
+    printReport(&report, json);
+  return !meshIsSound(&report);
+}